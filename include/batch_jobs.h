@@ -0,0 +1,286 @@
+#ifndef BATCH_JOBS_H
+#define BATCH_JOBS_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include <panorama_stitcher.h>
+#include <tiled_output.h>
+#include <trace.h>
+
+using namespace cv;
+using namespace std;
+
+/*
+Panorama jobs for batch (headless) runs: a job is a list of input images -> one output panorama.
+Jobs come from a manifest, JSON (read with cv::FileStorage) or CSV:
+
+JSON:
+{ "jobs": [ { "id": "s2", "output": "s2.png", "inputs": ["S2-im1.png", "S2-im2.png"],
+              "detector": "fast", "descriptor": "brief", "blend": "multiband", "proxy_mp": 2, "guided": 1,
+              "max_keypoints": 2000 } ] }
+(detector, descriptor, blend, proxy_mp, guided and max_keypoints are optional, the defaults come from the command line)
+
+CSV, one job per line (empty lines and lines starting with # are skipped):
+id,output,input1,input2,...
+
+Relative paths in a manifest are relative to the manifest's folder.
+Every job gives back a JobRecord with its status and timings, nothing is shown on screen.
+*/
+
+struct PanoramaJob{
+    string id;
+    vector<string> inputs;
+    string output;
+    StitcherParameters params;
+    PipelineParameters pipeline;
+    TiledOutputParameters tiles; // for .tif / .dzi outputs
+};
+
+struct JobRecord{
+    string id;
+    string output;
+    bool ok = false;
+    string error;          // why it failed (empty if ok)
+    int inputs = 0;
+    int connected = 0;     // inputs that made it into the panorama
+    int width = 0, height = 0;
+    double readMs = 0, stitchMs = 0, writeMs = 0, totalMs = 0; // read = decode busy time, it overlaps the stitching
+    PipelineReport pipeline;                                   // per stage occupancy of the stitch
+};
+
+double millis_since(int64 start){
+    return (getTickCount() - start) * 1000.0 / getTickFrequency();
+}
+
+/* "fast" / "fastr", "sift" / "brief" and "max" / "feather" / "multiband" into the parameters, false if the name is unknown */
+bool set_detector(StitcherParameters &P, const string &name){
+    if (name == "fast") P.features.useFastR = false;
+    else if (name == "fastr") P.features.useFastR = true;
+    else return false;
+    return true;
+}
+
+bool set_descriptor(StitcherParameters &P, const string &name){
+    if (name == "sift") P.features.descriptor = DESCRIPTOR::SIFT;
+    else if (name == "brief") P.features.descriptor = DESCRIPTOR::BRIEF;
+    else return false;
+    return true;
+}
+
+bool set_blend(StitcherParameters &P, const string &name){
+    if (name == "max") P.blend.mode = BLEND::MAX;
+    else if (name == "feather") P.blend.mode = BLEND::FEATHER;
+    else if (name == "multiband") P.blend.mode = BLEND::MULTIBAND;
+    else return false;
+    return true;
+}
+
+string path_folder(const string &path){
+    size_t slash = path.find_last_of("/\\");
+    return slash == string::npos ? string() : path.substr(0, slash + 1);
+}
+
+string resolve_path(const string &folder, const string &path){
+    if (path.empty() || path[0] == '/' || folder.empty()) return path;
+    return folder + path;
+}
+
+/* Jobs of a .json or .csv manifest, throws cv::Exception (CV_Error) on a bad manifest */
+vector<PanoramaJob> load_manifest(const string &path, const StitcherParameters &defaults = {}){
+    vector<PanoramaJob> jobs;
+    const string folder = path_folder(path);
+    const bool json = path.size() >= 5 && path.substr(path.size() - 5) == ".json";
+
+    if (json){
+        FileStorage fs(path, FileStorage::READ | FileStorage::FORMAT_JSON);
+        if (!fs.isOpened()) CV_Error(Error::StsError, "can't open manifest " + path);
+
+        FileNode jobList = fs["jobs"];
+        if (!jobList.isSeq()) CV_Error(Error::StsBadArg, "manifest " + path + " has no \"jobs\" list");
+
+        for (const FileNode &node : jobList){
+            PanoramaJob job;
+            job.params = defaults;
+            job.id = (string)node["id"];
+            job.output = resolve_path(folder, (string)node["output"]);
+            for (const FileNode &in : node["inputs"])
+                job.inputs.push_back(resolve_path(folder, (string)in));
+
+            if (!node["detector"].empty() && !set_detector(job.params, (string)node["detector"]))
+                CV_Error(Error::StsBadArg, "job " + job.id + ": unknown detector " + (string)node["detector"]);
+            if (!node["descriptor"].empty() && !set_descriptor(job.params, (string)node["descriptor"]))
+                CV_Error(Error::StsBadArg, "job " + job.id + ": unknown descriptor " + (string)node["descriptor"]);
+            if (!node["blend"].empty() && !set_blend(job.params, (string)node["blend"]))
+                CV_Error(Error::StsBadArg, "job " + job.id + ": unknown blend " + (string)node["blend"]);
+            if (!node["proxy_mp"].empty())
+                job.params.features.maxProxyPixels = long((double)node["proxy_mp"] * 1e6);
+            if (!node["max_keypoints"].empty())
+                set_max_keypoints(job.params.features, (int)node["max_keypoints"]);
+            if (!node["guided"].empty())
+                job.params.ransac.guided.enabled = (int)node["guided"] != 0;
+
+            if (job.id.empty()) job.id = "job" + to_string(jobs.size());
+            jobs.push_back(job);
+        }
+    }
+    else {
+        ifstream file(path);
+        if (!file) CV_Error(Error::StsError, "can't open manifest " + path);
+
+        string line;
+        while (getline(file, line)){
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty() || line[0] == '#') continue;
+
+            vector<string> fields;
+            stringstream ss(line);
+            string field;
+            while (getline(ss, field, ',')) fields.push_back(field);
+            if (fields.size() < 3) CV_Error(Error::StsBadArg, "manifest line needs id,output,inputs...: " + line);
+
+            PanoramaJob job;
+            job.params = defaults;
+            job.id = fields[0];
+            job.output = resolve_path(folder, fields[1]);
+            for (size_t i = 2; i < fields.size(); i++)
+                job.inputs.push_back(resolve_path(folder, fields[i]));
+            jobs.push_back(job);
+        }
+    }
+    return jobs;
+}
+
+/* Reads, stitches and writes one job, never throws: errors end up in the record */
+JobRecord run_job(const PanoramaJob &job){
+    JobRecord rec;
+    rec.id = job.id;
+    rec.output = job.output;
+    rec.inputs = (int)job.inputs.size();
+    int64 start = getTickCount();
+    TRACE_SCOPE("job");
+
+    try {
+        if (job.inputs.size() < 2) throw runtime_error("a panorama needs at least 2 inputs");
+
+        // .tif / .dzi outputs are written tile by tile while they are blended (tiled_output.h), so the
+        // canvas is never in memory and the writing is part of the stitch time
+        Ptr<TileSink> sink = open_tile_sink(job.output, job.tiles);
+
+        // decoding, features, matching and the warp as a pipeline (stage_pipeline.h)
+        int64 t = getTickCount();
+        PanoramaStitcher stitcher(job.params);
+        Mat pano = stitcher.stitch_paths(job.inputs, job.pipeline, &rec.pipeline, sink.get());
+        rec.stitchMs = millis_since(t);
+        if (!rec.pipeline.stages.empty()) rec.readMs = rec.pipeline.stages[0].busyMs;
+        if (!rec.pipeline.unreadable.empty()) throw runtime_error("can't read " + rec.pipeline.unreadable[0]);
+
+        for (const auto &H : stitcher.transforms()) rec.connected += !H.empty();
+        if ((pano.empty() && !sink) || rec.connected < 2) throw runtime_error("the images could not be aligned");
+        rec.width = stitcher.canvasSize().width;
+        rec.height = stitcher.canvasSize().height;
+
+        if (!sink){
+            t = getTickCount();
+            TRACE_SCOPE("write");
+            if (!imwrite(job.output, pano)) throw runtime_error("can't write " + job.output);
+            rec.writeMs = millis_since(t);
+        }
+        rec.ok = true;
+    }
+    catch (const std::exception &e){
+        rec.error = e.what();
+    }
+    rec.totalMs = millis_since(start);
+    return rec;
+}
+
+/*
+Runs the jobs on `workers` threads (each one takes the next job when it's done with the previous).
+Every stage inside a job is still parallel (parallel_for_), the workers only overlap whole jobs, so
+the reading / writing of one job hides behind the computation of another.
+onDone (optional) is called as each job finishes, from the worker thread.
+The records come back in the order of the jobs.
+*/
+template <typename Callback>
+vector<JobRecord> run_jobs(const vector<PanoramaJob> &jobs, int workers, Callback onDone){
+    vector<JobRecord> records(jobs.size());
+    atomic<size_t> next(0);
+
+    auto worker = [&](){
+        for (size_t i = next++; i < jobs.size(); i = next++){
+            records[i] = run_job(jobs[i]);
+            onDone(records[i]);
+        }
+    };
+
+    workers = std::max(1, std::min(workers, (int)jobs.size()));
+    vector<thread> pool;
+    for (int w = 1; w < workers; w++) pool.emplace_back(worker);
+    worker(); // the calling thread is a worker too
+    for (auto &t : pool) t.join();
+    image_pool().clear(); // the buffers were only worth keeping for the jobs of this batch
+    return records;
+}
+
+vector<JobRecord> run_jobs(const vector<PanoramaJob> &jobs, int workers){
+    return run_jobs(jobs, workers, [](const JobRecord &){});
+}
+
+string json_escape(const string &s){
+    string out;
+    for (char c : s){
+        if (c == '"' || c == '\\'){ out += '\\'; out += c; }
+        else if (c == '\n') out += "\\n";
+        else if ((unsigned char)c < 0x20) out += ' ';
+        else out += c;
+    }
+    return out;
+}
+
+string stages_json(const PipelineReport &p){
+    string out = "[";
+    char buf[256];
+    for (size_t i = 0; i < p.stages.size(); i++){
+        const StageSummary &s = p.stages[i];
+        snprintf(buf, sizeof(buf), "%s{\"name\":\"%s\",\"workers\":%d,\"items\":%ld,\"busy_ms\":%.2f,\"idle_ms\":%.2f,"
+                 "\"blocked_ms\":%.2f,\"occupancy\":%.3f}", i ? "," : "", s.name.c_str(), s.workers, s.items,
+                 s.busyMs, s.idleMs, s.blockedMs, s.occupancy);
+        out += buf;
+    }
+    return out + "]";
+}
+
+/* One record as a line of JSON (JSON lines) */
+string record_json(const JobRecord &r){
+    char times[256];
+    snprintf(times, sizeof(times), "\"read_ms\":%.2f,\"stitch_ms\":%.2f,\"write_ms\":%.2f,\"total_ms\":%.2f",
+             r.readMs, r.stitchMs, r.writeMs, r.totalMs);
+    return "{\"id\":\"" + json_escape(r.id) + "\",\"status\":\"" + (r.ok ? "ok" : "error") + "\"," +
+           "\"error\":\"" + json_escape(r.error) + "\",\"output\":\"" + json_escape(r.output) + "\"," +
+           "\"inputs\":" + to_string(r.inputs) + ",\"connected\":" + to_string(r.connected) + "," +
+           "\"width\":" + to_string(r.width) + ",\"height\":" + to_string(r.height) + "," + times +
+           ",\"stages\":" + stages_json(r.pipeline) + "}";
+}
+
+const char *RECORD_CSV_HEADER = "id,status,error,output,inputs,connected,width,height,read_ms,stitch_ms,write_ms,total_ms";
+
+string record_csv(const JobRecord &r){
+    auto quoted = [](string s){
+        replace(s.begin(), s.end(), '"', '\'');
+        return "\"" + s + "\"";
+    };
+    char times[128];
+    snprintf(times, sizeof(times), "%.2f,%.2f,%.2f,%.2f", r.readMs, r.stitchMs, r.writeMs, r.totalMs);
+    return quoted(r.id) + "," + (r.ok ? "ok" : "error") + "," + quoted(r.error) + "," + quoted(r.output) + "," +
+           to_string(r.inputs) + "," + to_string(r.connected) + "," + to_string(r.width) + "," +
+           to_string(r.height) + "," + times;
+}
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+
+using namespace cv;
+using namespace std;
+
+/*
+Small benchmark harness (no external dependency): a benchmark is a function that is run once to warm up
+(caches, thread pool, lazy allocations) and then again and again until it has run for at least minSeconds
+and at least minIters times. Every run is timed on its own, so we get the median (what we compare
+between versions, robust to the odd slow run), the mean, min, max and standard deviation.
+Results go out as JSON so two runs can be diffed by a script.
+*/
+
+struct BenchOptions{
+    double minSeconds = 0.5; // keep running until this much time was spent...
+    int minIters = 3;        // ...and at least this many runs
+    int maxIters = 1000;
+};
+
+struct BenchResult{
+    string name;         // what was measured (e.g. "fast_detect")
+    string dataset;      // on what (e.g. "S2@12MP")
+    double megapixels = 0;
+    int iterations = 0;
+    double medianMs = 0, meanMs = 0, minMs = 0, maxMs = 0, stddevMs = 0;
+    map<string, double> counters; // sizes of the work (keypoints, matches...), to read the times with
+};
+
+template <typename Fn>
+BenchResult run_bench(const string &name, const string &dataset, double megapixels, const BenchOptions &O, Fn fn){
+    BenchResult r;
+    r.name = name;
+    r.dataset = dataset;
+    r.megapixels = megapixels;
+
+    fn(); // warm up
+
+    vector<double> times;
+    double total = 0;
+    while ((int)times.size() < O.maxIters && (total < O.minSeconds * 1000.0 || (int)times.size() < O.minIters)){
+        int64 start = getTickCount();
+        fn();
+        double ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+        times.push_back(ms);
+        total += ms;
+    }
+
+    r.iterations = (int)times.size();
+    r.meanMs = total / times.size();
+    vector<double> sorted = times;
+    sort(sorted.begin(), sorted.end());
+    r.minMs = sorted.front();
+    r.maxMs = sorted.back();
+    size_t mid = sorted.size() / 2;
+    r.medianMs = sorted.size() % 2 ? sorted[mid] : 0.5 * (sorted[mid - 1] + sorted[mid]);
+    double var = 0;
+    for (double t : times) var += (t - r.meanMs) * (t - r.meanMs);
+    r.stddevMs = std::sqrt(var / times.size());
+    return r;
+}
+
+/* one line per result, for a terminal */
+string bench_line(const BenchResult &r){
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%-28s %-14s %7.2f MP %10.3f ms (median, %d runs, min %.3f, sd %.3f)",
+             r.name.c_str(), r.dataset.c_str(), r.megapixels, r.medianMs, r.iterations, r.minMs, r.stddevMs);
+    string line = buf;
+    for (const auto &c : r.counters){
+        snprintf(buf, sizeof(buf), " %s=%g", c.first.c_str(), c.second);
+        line += buf;
+    }
+    return line;
+}
+
+/* all the results + a little about the machine, as a JSON document */
+string bench_json(const vector<BenchResult> &results){
+    char buf[512];
+    time_t now = time(nullptr);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    string out = "{\n";
+    snprintf(buf, sizeof(buf), "  \"date\": \"%s\",\n  \"opencv\": \"%s\",\n  \"threads\": %d,\n  \"cpus\": %d,\n  \"avx2\": %s,\n",
+             date, CV_VERSION, getNumThreads(), getNumberOfCPUs(), checkHardwareSupport(CV_CPU_AVX2) ? "true" : "false");
+    out += buf;
+    out += "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++){
+        const BenchResult &r = results[i];
+        snprintf(buf, sizeof(buf), "    {\"name\": \"%s\", \"dataset\": \"%s\", \"megapixels\": %.3f, \"iterations\": %d, "
+                 "\"median_ms\": %.4f, \"mean_ms\": %.4f, \"min_ms\": %.4f, \"max_ms\": %.4f, \"stddev_ms\": %.4f, \"counters\": {",
+                 r.name.c_str(), r.dataset.c_str(), r.megapixels, r.iterations,
+                 r.medianMs, r.meanMs, r.minMs, r.maxMs, r.stddevMs);
+        out += buf;
+        bool first = true;
+        for (const auto &c : r.counters){
+            snprintf(buf, sizeof(buf), "%s\"%s\": %g", first ? "" : ", ", c.first.c_str(), c.second);
+            out += buf;
+            first = false;
+        }
+        out += i + 1 < results.size() ? "}},\n" : "}}\n";
+    }
+    out += "  ]\n}\n";
+    return out;
+}
+
+#endif
@@ -0,0 +1,397 @@
+#ifndef BLENDER_H
+#define BLENDER_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "tiled_compositor.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+Blending: how the warped images are combined where they overlap.
+- MAX: per pixel max (what warpAndBlendPanorama always did). Fast, but the seams and the exposure
+  differences between the images are visible.
+- FEATHER: weighted average, every image weighs more in its centre and fades out to its borders
+  (distance to the border of the source image, ramped over featherWidth pixels). Hides exposure steps,
+  but small misalignments show up as ghosts.
+- MULTIBAND: Laplacian pyramid blending (Burt & Adelson). Every pixel belongs to the image that weighs
+  the most there (a hard seam), but each frequency band is blended over a width that matches it: the
+  low frequencies (exposure) over a wide area, the details over a few pixels. No seams and no ghosts.
+
+All of them work tile by tile in parallel (like composite_tiled), the only canvas sized buffer is the output;
+blend_to() doesn't even have that one, it hands every tile to a TileSink (tiled_output.h writes them to disk).
+The weights are 8 bit and the sums are in int32 (fixed point), the Laplacian levels are int16 with 3
+fractional bits. The multi-band tiles carry a halo so the pyramid of a tile sees the same neighbourhood
+as a pyramid of the whole canvas would (bench's blend_multiband compares it with a one-tile blend).
+*/
+
+enum class BLEND {MAX, FEATHER, MULTIBAND};
+
+struct BlendParameters{
+    BLEND mode = BLEND::MAX;
+    int featherWidth = 50;   // pixels from the border until an image has full weight (0 = its whole half size)
+    int bands = 5;           // pyramid levels of the multi-band blender
+    int tileSize = 512;      // output tile (for multi-band rounded up to a multiple of 2^bands)
+};
+
+/* What every tile of one blend needs: the images, where they land on the canvas and their weights */
+struct BlendInputs{
+    const vector<Mat> &images;
+    const vector<Mat> &H;
+    Size canvas;
+    vector<Rect> footprint;
+    vector<Mat> weights; // 8 bit, per source image (feather / multi-band only)
+};
+
+/* Buffers of one worker, reused by every tile it blends */
+struct BlendScratch{
+    Mat warped, w;
+    vector<int> acc, wsum;
+};
+
+class Blender{
+public:
+    virtual ~Blender(){}
+
+    /* images[i] warped by H[i] (image -> canvas, empty = skip) and blended into a canvas of the given size */
+    Mat blend(const vector<Mat> &images, const vector<Mat> &H, Size canvas) const{
+        TRACE_SCOPE(name());
+        BlendInputs in = prepare(images, H, canvas);
+        Mat panorama(canvas, images[0].type(), Scalar::all(0));
+        TRACE_COUNT("canvas_pixels", canvas.area());
+        TRACE_BYTES(panorama);
+
+        const int ts = tileSize();
+        const int tilesX = (canvas.width + ts - 1) / ts;
+        const int tilesY = (canvas.height + ts - 1) / ts;
+
+        parallel_for_(Range(0, tilesX * tilesY), [&](const Range &r){
+            TRACE_SCOPE("blend_tiles");
+            BlendScratch scratch;
+            for (int t = r.start; t < r.end; t++){
+                Rect tile((t % tilesX) * ts, (t / tilesX) * ts, ts, ts);
+                tile &= Rect(Point(0, 0), canvas);
+                Mat out = panorama(tile);
+                blendTile(in, tile, out, scratch);
+            }
+        });
+        return panorama;
+    }
+
+    /*
+    Same blend without a canvas: the tiles of the sink's grid are made one row at a time (the tiles of a
+    row in parallel) and handed to sink.write() by the worker that made them, so the sink compresses in
+    parallel too. Memory is one row of tiles plus what the sink keeps, whatever the canvas size.
+    */
+    void blend_to(const vector<Mat> &images, const vector<Mat> &H, Size canvas, TileSink &sink) const{
+        TRACE_SCOPE(name());
+        BlendInputs in = prepare(images, H, canvas);
+        TRACE_COUNT("canvas_pixels", canvas.area());
+        sink.begin(canvas, images[0].type());
+
+        const int ts = std::max(sink.tileSize(), 16);
+        const int tilesX = (canvas.width + ts - 1) / ts;
+        const int tilesY = (canvas.height + ts - 1) / ts;
+
+        for (int ty = 0; ty < tilesY; ty++){
+            parallel_for_(Range(0, tilesX), [&](const Range &r){
+                TRACE_SCOPE("blend_tiles");
+                BlendScratch scratch;
+                Mat out;
+                for (int tx = r.start; tx < r.end; tx++){
+                    Rect tile(tx * ts, ty * ts, ts, ts);
+                    tile &= Rect(Point(0, 0), canvas);
+                    out.create(tile.size(), images[0].type());
+                    out.setTo(Scalar::all(0));
+                    blendTile(in, tile, out, scratch);
+                    sink.write(tile, out);
+                }
+            });
+        }
+        sink.finish();
+    }
+
+protected:
+    virtual const char *name() const = 0;
+    /* tile grid of blend() */
+    virtual int tileSize() const = 0;
+    /* 8 bit weight of every pixel of a source image of size s (empty = the blender doesn't use weights) */
+    virtual Mat imageWeights(Size) const { return Mat(); }
+    /* the canvas pixels of tile into out (tile sized, zeros to start with) */
+    virtual void blendTile(const BlendInputs &in, const Rect &tile, Mat &out, BlendScratch &scratch) const = 0;
+
+private:
+    BlendInputs prepare(const vector<Mat> &images, const vector<Mat> &H, Size canvas) const{
+        CV_Assert(!images.empty() && images.size() == H.size());
+        BlendInputs in{images, H, canvas, vector<Rect>(images.size()), vector<Mat>(images.size())};
+        for (size_t i = 0; i < images.size(); i++){
+            if (H[i].empty()) continue;
+            in.footprint[i] = warped_footprint(images[i].size(), H[i], canvas);
+            in.weights[i] = imageWeights(images[i].size());
+            if (!in.weights[i].empty()) CV_Assert(images[i].depth() == CV_8U);
+        }
+        return in;
+    }
+};
+
+class MaxBlender : public Blender{
+public:
+    explicit MaxBlender(int tileSize = COMPOSITE_TILE) : tiles(std::max(tileSize, 16)){}
+
+protected:
+    const char *name() const override { return "composite"; }
+    int tileSize() const override { return tiles; }
+    void blendTile(const BlendInputs &in, const Rect &tile, Mat &out, BlendScratch &scratch) const override{
+        composite_tile(in.images, in.H, in.footprint, tile, out, scratch.warped);
+    }
+
+private:
+    int tiles;
+};
+
+/* 8 bit weight of every pixel of an image of size s: distance to its border, 255 after featherWidth pixels */
+Mat feather_weights(Size s, int featherWidth){
+    // 1 pixel of zeros around it, so the border pixels are at distance 1 and not 0
+    Mat mask(s.height + 2, s.width + 2, CV_8U, Scalar(0));
+    mask(Rect(1, 1, s.width, s.height)).setTo(255);
+
+    Mat dist;
+    distanceTransform(mask, dist, DIST_L2, 3);
+    dist = dist(Rect(1, 1, s.width, s.height));
+
+    double ramp = featherWidth;
+    if (ramp <= 0) minMaxLoc(dist, nullptr, &ramp);
+
+    Mat w;
+    dist.convertTo(w, CV_8U, 255.0 / std::max(ramp, 1.0)); // saturates to 255 after the ramp
+    w = cv::max(w, 1.0); // inside the image the weight is never 0
+    return w;
+}
+
+/* translation by (-x, -y), to warp into a tile or region that starts at (x, y) */
+Mat canvas_shift(int x, int y){
+    return (Mat_<double>(3, 3) << 1, 0, -x, 0, 1, -y, 0, 0, 1);
+}
+
+class FeatherBlender : public Blender{
+public:
+    FeatherBlender(int featherWidth, int tileSize) : featherWidth(featherWidth), tiles(std::max(tileSize, 16)){}
+
+protected:
+    const char *name() const override { return "blend_feather"; }
+    int tileSize() const override { return tiles; }
+    Mat imageWeights(Size s) const override { return feather_weights(s, featherWidth); }
+
+    void blendTile(const BlendInputs &in, const Rect &tile, Mat &out, BlendScratch &scratch) const override{
+        const int cn = in.images[0].channels();
+        vector<int> &acc = scratch.acc, &wsum = scratch.wsum;
+        acc.assign(tile.area() * cn, 0);
+        wsum.assign(tile.area(), 0);
+
+        for (size_t i = 0; i < in.images.size(); i++){
+            Rect part = in.footprint[i] & tile;
+            if (part.empty()) continue;
+
+            Mat M = canvas_shift(part.x, part.y) * in.H[i];
+            warpPerspective(in.images[i], scratch.warped, M, part.size());
+            warpPerspective(in.weights[i], scratch.w, M, part.size());
+
+            for (int y = 0; y < part.height; y++){
+                const uchar *p = scratch.warped.ptr<uchar>(y);
+                const uchar *wp = scratch.w.ptr<uchar>(y);
+                int base = (part.y - tile.y + y) * tile.width + (part.x - tile.x);
+                for (int x = 0; x < part.width; x++){
+                    int wv = wp[x];
+                    if (!wv) continue;
+                    wsum[base + x] += wv;
+                    for (int c = 0; c < cn; c++)
+                        acc[(base + x) * cn + c] += p[x * cn + c] * wv;
+                }
+            }
+        }
+
+        // weighted average, rounded
+        for (int y = 0; y < tile.height; y++){
+            uchar *o = out.ptr<uchar>(y);
+            for (int x = 0; x < tile.width; x++){
+                int s = wsum[y * tile.width + x];
+                if (!s) continue;
+                for (int c = 0; c < cn; c++)
+                    o[x * cn + c] = saturate_cast<uchar>((acc[(y * tile.width + x) * cn + c] + s / 2) / s);
+            }
+        }
+    }
+
+private:
+    int featherWidth;
+    int tiles;
+};
+
+class MultiBandBlender : public Blender{
+public:
+    MultiBandBlender(int bands, int featherWidth, int tileSize)
+        : bands(std::min(std::max(bands, 0), 10)), featherWidth(featherWidth){
+        // regions start at multiples of 2^bands, so every region samples the pyramid on the same grid
+        // as the whole canvas would (the tiles of blend() are multiples of it too)
+        align = 1 << this->bands;
+        tiles = (std::max(tileSize, align) + align - 1) / align * align;
+        /* A pixel of the tile depends on the pixels around it through the pyrDown chain (2 pixels of level l
+        per level, 2 * (2^bands - 1) at full resolution) and back through the pyrUp collapse (about as
+        much again): ~4 * 2^bands with every tap counted, but the outer taps weigh 1/16 per level and
+        their products vanish long before that. Measured against a one-tile blend of the same canvas
+        (5 bands, 256 pixel tiles, noise images with exposure steps): max difference 9 with a halo of
+        1 * 2^bands, 1 with 2 *, 0 from 3 * on. 4 * 2^bands keeps one more 2^bands step of margin. */
+        halo = 4 * align;
+    }
+
+protected:
+    const char *name() const override { return "blend_multiband"; }
+    int tileSize() const override { return tiles; }
+    Mat imageWeights(Size s) const override { return feather_weights(s, featherWidth); }
+
+    /* the tile and a halo around it, its start moved back to the 2^bands grid (a sink's tiles may not be on it) */
+    void blendTile(const BlendInputs &in, const Rect &tile, Mat &out, BlendScratch &) const override{
+        int x0 = std::max(tile.x - halo, 0), y0 = std::max(tile.y - halo, 0);
+        x0 -= x0 % align;
+        y0 -= y0 % align;
+        Rect region(x0, y0, tile.x + tile.width + halo - x0, tile.y + tile.height + halo - y0);
+        region &= Rect(Point(0, 0), in.canvas);
+        blendRegion(in.images, in.H, in.footprint, in.weights, tile, region, out);
+    }
+
+private:
+    void blendRegion(const vector<Mat> &images, const vector<Mat> &H, const vector<Rect> &footprint,
+                     const vector<Mat> &weights, const Rect &tile, const Rect &region, Mat &dst) const{
+        const int cn = images[0].channels();
+
+        vector<int> idx;
+        for (size_t i = 0; i < images.size(); i++)
+            if (!(footprint[i] & region).empty()) idx.push_back((int)i);
+        if (idx.empty()) return;
+
+        // every image (and its weight) warped into the region, only over the part its footprint covers
+        vector<Mat> img(idx.size()), mask(idx.size());
+        for (size_t k = 0; k < idx.size(); k++){
+            Rect part = footprint[idx[k]] & region;
+            Rect local(part.x - region.x, part.y - region.y, part.width, part.height);
+            img[k] = Mat::zeros(region.size(), images[idx[k]].type());
+            mask[k] = Mat::zeros(region.size(), CV_8U);
+            Mat imgPart = img[k](local), maskPart = mask[k](local);
+            Mat M = canvas_shift(part.x, part.y) * H[idx[k]];
+            warpPerspective(images[idx[k]], imgPart, M, part.size());
+            warpPerspective(weights[idx[k]], maskPart, M, part.size());
+        }
+
+        // hard seams: the pixel belongs to the image with the biggest weight there (first one on ties),
+        // one pass over the weights into a map of image indices (-1 = none), then a mask per image from it
+        Mat owner(region.size(), CV_16S);
+        vector<const uchar *> wrow(idx.size());
+        for (int y = 0; y < region.height; y++){
+            for (size_t k = 0; k < idx.size(); k++) wrow[k] = mask[k].ptr<uchar>(y);
+            short *o = owner.ptr<short>(y);
+            for (int x = 0; x < region.width; x++){
+                int best = -1, bestW = 0;
+                for (size_t k = 0; k < idx.size(); k++){
+                    int wv = wrow[k][x];
+                    if (wv > bestW){ bestW = wv; best = (int)k; }
+                }
+                o[x] = (short)best;
+            }
+        }
+        for (size_t k = 0; k < idx.size(); k++)
+            compare(owner, Scalar((double)k), mask[k], CMP_EQ); // 255 where image k owns the pixel, 0 elsewhere
+
+        vector<Size> sz(bands + 1);
+        sz[0] = region.size();
+        for (int l = 1; l <= bands; l++)
+            sz[l] = Size((sz[l - 1].width + 1) / 2, (sz[l - 1].height + 1) / 2);
+
+        // sum over the images of Laplacian * Gaussian(mask), and of the Gaussian(mask), per level
+        vector<Mat> acc(bands + 1), wsum(bands + 1);
+        for (int l = 0; l <= bands; l++){
+            acc[l] = Mat::zeros(sz[l], CV_32SC(cn));
+            wsum[l] = Mat::zeros(sz[l], CV_32S);
+        }
+
+        for (size_t k = 0; k < idx.size(); k++){
+            Mat g, m = mask[k];
+            img[k].convertTo(g, CV_16S, 8); // 3 fractional bits
+
+            for (int l = 0; l <= bands; l++){
+                Mat lap, gDown, up;
+                if (l < bands){
+                    pyrDown(g, gDown, sz[l + 1]);
+                    pyrUp(gDown, up, sz[l]);
+                    subtract(g, up, lap, noArray(), CV_16S);
+                }
+                else lap = g;
+
+                for (int y = 0; y < sz[l].height; y++){
+                    const short *lp = lap.ptr<short>(y);
+                    const uchar *mp = m.ptr<uchar>(y);
+                    int *ap = acc[l].ptr<int>(y), *wp = wsum[l].ptr<int>(y);
+                    for (int x = 0; x < sz[l].width; x++){
+                        int wv = mp[x];
+                        if (!wv) continue;
+                        wp[x] += wv;
+                        for (int c = 0; c < cn; c++)
+                            ap[x * cn + c] += lp[x * cn + c] * wv;
+                    }
+                }
+
+                if (l < bands){
+                    Mat mDown;
+                    pyrDown(m, mDown, sz[l + 1]);
+                    g = gDown;
+                    m = mDown;
+                }
+            }
+        }
+
+        // normalize every level and collapse the pyramid, coarse to fine
+        Mat result;
+        for (int l = bands; l >= 0; l--){
+            Mat level(sz[l], CV_16SC(cn));
+            for (int y = 0; y < sz[l].height; y++){
+                const int *ap = acc[l].ptr<int>(y), *wp = wsum[l].ptr<int>(y);
+                short *lp = level.ptr<short>(y);
+                for (int x = 0; x < sz[l].width; x++)
+                    for (int c = 0; c < cn; c++)
+                        lp[x * cn + c] = wp[x] ? saturate_cast<short>(cvRound(double(ap[x * cn + c]) / wp[x])) : 0;
+            }
+
+            if (result.empty()) result = level;
+            else{
+                Mat up;
+                pyrUp(result, up, sz[l]);
+                add(up, level, result, noArray(), CV_16S);
+            }
+        }
+
+        // only the tile itself goes to the output, and only where some image is
+        Rect inner(tile.x - region.x, tile.y - region.y, tile.width, tile.height);
+        Mat out;
+        result(inner).convertTo(out, CV_8U, 1.0 / 8);
+        Mat covered = wsum[0](inner) > 0;
+        out.copyTo(dst, covered);
+    }
+
+    int bands;
+    int featherWidth;
+    int align;
+    int tiles;
+    int halo;
+};
+
+Ptr<Blender> create_blender(const BlendParameters &P = {}){
+    switch (P.mode){
+        case BLEND::FEATHER: return makePtr<FeatherBlender>(P.featherWidth, P.tileSize);
+        case BLEND::MULTIBAND: return makePtr<MultiBandBlender>(P.bands, P.featherWidth, P.tileSize);
+        default: return makePtr<MaxBlender>(P.tileSize);
+    }
+}
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef BRIEF_DESCRIPTOR_H
+#define BRIEF_DESCRIPTOR_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cmath>
+#include <algorithm>
+#include "feature_set.h"
+#include "frame_arena.h"
+#include "trace.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+Binary descriptors (oriented BRIEF, like ORB's but with a random pattern instead of the learned one) at
+our own keypoints, for when SIFT is more than needed (previews, small proxies):
+- the image is smoothed once (Gaussian 7x7): a test on two single pixels is very sensitive to noise
+- every keypoint gets an orientation from the intensity centroid of its circular patch (the angle of
+  (m10, m01)), so the descriptor turns with the image
+- 256 tests "smooth(p) < smooth(q)" on pairs of points of the patch, rotated by that angle, one bit each:
+  32 bytes (CV_8U) per keypoint instead of SIFT's 512, made with ~500 pixel reads instead of a Gaussian
+  pyramid and 4x4 gradient histograms
+The pairs are drawn once from an isotropic Gaussian (sigma = patchSize / 5, the best of the BRIEF paper's
+patterns) with a fixed seed, so every run gets the same descriptors, and kept rotated in 12 degree steps.
+The image is padded (reflected) by the patch radius, so every keypoint gets a descriptor and the rows
+line up with the FeatureSet (OpenCV's ORB drops the keypoints near the border instead).
+They are compared with the Hamming distance: brief_describe_into sets the FeatureSet's norm to
+NORM_HAMMING and the matchers (descriptor_matcher.h) count the bits that differ with popcount.
+*/
+
+const int BRIEF_BITS = 256;
+const int BRIEF_BYTES = BRIEF_BITS / 8;
+const int BRIEF_ANGLES = 30;
+
+struct BriefParameters{
+    int patchSize = 31;    // diameter of the patch the test points are drawn from
+    double sigma = 2.0;    // of the smoothing before the tests
+    bool oriented = true;  // false = upright BRIEF (a bit faster, only for frames that don't rotate)
+};
+
+/* The test points of one patch size: 2 * BRIEF_BITS points per angle, the pairs of every bit one after the other */
+struct BriefPattern{
+    int radius = 0;
+    vector<Point> points[BRIEF_ANGLES]; // points[a]: the pattern rotated by a * 360 / BRIEF_ANGLES degrees
+    vector<int> umax;                   // half width of the circular patch at every row offset 0..radius
+};
+
+/* made the first time a patch size is asked for, shared by every thread after that */
+const BriefPattern &brief_pattern(int patchSize){
+    static mutex m;
+    static map<int, BriefPattern> patterns;
+    lock_guard<mutex> lock(m);
+    auto it = patterns.find(patchSize);
+    if (it != patterns.end()) return it->second;
+
+    BriefPattern &p = patterns[patchSize];
+    p.radius = std::max(patchSize / 2, 2);
+    const int r2 = p.radius * p.radius;
+    const double sigma = patchSize / 5.0;
+
+    // Gaussian points around the center, redrawn until they are inside the patch
+    RNG rng(0x42524945);
+    vector<Point2d> base(2 * BRIEF_BITS);
+    for (auto &pt : base){
+        do {
+            pt = Point2d(rng.gaussian(sigma), rng.gaussian(sigma));
+        } while (pt.x * pt.x + pt.y * pt.y > r2);
+    }
+
+    for (int a = 0; a < BRIEF_ANGLES; a++){
+        const double theta = a * 2.0 * CV_PI / BRIEF_ANGLES, c = std::cos(theta), s = std::sin(theta);
+        p.points[a].resize(base.size());
+        for (size_t k = 0; k < base.size(); k++)
+            p.points[a][k] = Point(cvRound(base[k].x * c - base[k].y * s), cvRound(base[k].x * s + base[k].y * c));
+    }
+
+    p.umax.resize(p.radius + 1);
+    for (int v = 0; v <= p.radius; v++) p.umax[v] = cvFloor(std::sqrt(double(r2 - v * v)));
+    return p;
+}
+
+/* orientation of the patch around c (intensity centroid), as the closest of the BRIEF_ANGLES steps */
+int brief_angle_bin(const uchar *c, int step, const BriefPattern &p){
+    int m10 = 0, m01 = 0;
+    for (int u = -p.radius; u <= p.radius; u++) m10 += u * c[u];
+    // rows v and -v together: their u moments add up, their v moments subtract
+    for (int v = 1; v <= p.radius; v++){
+        int diff = 0;
+        for (int u = -p.umax[v]; u <= p.umax[v]; u++){
+            int below = c[u + v * step], above = c[u - v * step];
+            diff += below - above;
+            m10 += u * (below + above);
+        }
+        m01 += v * diff;
+    }
+    if (m10 == 0 && m01 == 0) return 0;
+    double angle = std::atan2(double(m01), double(m10)); // (-pi, pi]
+    int bin = cvRound(angle * BRIEF_ANGLES / (2.0 * CV_PI));
+    return (bin % BRIEF_ANGLES + BRIEF_ANGLES) % BRIEF_ANGLES;
+}
+
+/*
+32-byte descriptors at the positions of f (pixels of image, gray or BGR), one row per feature, into desc.
+The padded and smoothed copies of the image are the arena's.
+*/
+void brief_describe_into(const Mat &image, FeatureSet &f, Mat &desc, const BriefParameters &P = {},
+                         FrameArena &arena = frame_arena()){
+    TRACE_SCOPE("brief_describe");
+    TRACE_COUNT("keypoints", f.count());
+    f.norm = NORM_HAMMING;
+    if (f.empty()){
+        desc.release();
+        return;
+    }
+
+    Mat gray = image;
+    if (image.channels() == 3){
+        gray = arena.mat(ARENA_BRIEF_GRAY, image.size(), CV_8U);
+        cvtColor(image, gray, COLOR_BGR2GRAY);
+    }
+    CV_Assert(gray.type() == CV_8UC1);
+
+    // rotated points can end up half a pixel further than the radius
+    const BriefPattern &pattern = brief_pattern(P.patchSize);
+    const int pad = pattern.radius + 1;
+    Mat padded = arena.mat(ARENA_BRIEF_PADDED, Size(gray.cols + 2 * pad, gray.rows + 2 * pad), CV_8U);
+    copyMakeBorder(gray, padded, pad, pad, pad, pad, BORDER_REFLECT_101);
+    Mat smooth = arena.mat(ARENA_BRIEF_SMOOTH, padded.size(), CV_8U);
+    GaussianBlur(padded, smooth, Size(7, 7), P.sigma, P.sigma, BORDER_REFLECT_101);
+
+    // the pattern as offsets in this image (both copies have the same step)
+    const int step = (int)padded.step;
+    vector<int> &offsets = arena.vec<int>(ARENA_BRIEF_OFFSETS);
+    offsets.resize((size_t)BRIEF_ANGLES * 2 * BRIEF_BITS);
+    for (int a = 0; a < BRIEF_ANGLES; a++)
+        for (int k = 0; k < 2 * BRIEF_BITS; k++)
+            offsets[a * 2 * BRIEF_BITS + k] = pattern.points[a][k].y * step + pattern.points[a][k].x;
+
+    desc.create(f.count(), BRIEF_BYTES, CV_8U);
+    parallel_for_(Range(0, f.count()), [&](const Range &r){
+        for (int i = r.start; i < r.end; i++){
+            const int x = std::min(std::max(cvRound(f.x[i]), 0), gray.cols - 1) + pad;
+            const int y = std::min(std::max(cvRound(f.y[i]), 0), gray.rows - 1) + pad;
+            const int a = P.oriented ? brief_angle_bin(padded.ptr<uchar>(y) + x, step, pattern) : 0;
+
+            const uchar *center = smooth.ptr<uchar>(y) + x;
+            const int *o = offsets.data() + a * 2 * BRIEF_BITS;
+            uchar *d = desc.ptr<uchar>(i);
+            for (int b = 0; b < BRIEF_BYTES; b++, o += 16){
+                int bits = 0;
+                for (int k = 0; k < 8; k++) bits |= int(center[o[2 * k]] < center[o[2 * k + 1]]) << k;
+                d[b] = (uchar)bits;
+            }
+        }
+    });
+}
+
+/* same at KeyPoints (their positions only) */
+void briefDescriptorsAt(const Mat &image, const vector<KeyPoint> &kps, Mat &desc, const BriefParameters &P = {}){
+    FeatureSet &f = frame_arena().get<FeatureSet>(ARENA_BRIEF_FEATURES);
+    from_keypoints(kps, f);
+    brief_describe_into(image, f, desc, P);
+}
+
+#endif
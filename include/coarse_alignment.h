@@ -0,0 +1,193 @@
+#ifndef COARSE_ALIGNMENT_H
+#define COARSE_ALIGNMENT_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include <image_pyramid.h>
+#include <ransac.h>
+
+using namespace cv;
+using namespace std;
+
+/*
+Coarse to fine alignment of two images.
+1) both images go down a gray pyramid to a proxy of ~2 MP (image_pyramid.h)
+2) FAST + SIFT + matching + RANSAC on the proxies: everything costs 4^level times less
+3) the homography is scaled back to full resolution: H = S * H_proxy * S^-1, S = diag(s, s, 1)
+4) (optional) refinement at full resolution: a few of the inliers are taken back to the full images, a
+   small patch around each point of A is searched for in B only around where H says it should be
+   (normalized cross correlation), and the homography is estimated again from those positions.
+   A 1 pixel error on the proxy is 2^level pixels at full resolution, this brings it back to ~1 pixel.
+The full resolution images are only read by the refinement patches (and later by the final warp).
+*/
+
+struct AlignmentParameters{
+    long maxProxyPixels = 2000000; // the proxy is the first pyramid level with at most this many pixels
+    int level = -1;                // or a fixed level (-1 = from maxProxyPixels)
+    bool refine = true;            // full resolution refinement
+    int refinePoints = 64;         // inliers used by the refinement
+    int patchRadius = 8;           // patch of (2r+1)^2 pixels around each point
+    int searchRadius = 6;          // pixels around the predicted position, at least 2x the proxy scale (refine_search_radius)
+    float minCorrelation = 0.8f;   // weaker patch matches are dropped
+    double refineThreshold = 1.5;  // RANSAC threshold of the refined homography (full resolution pixels)
+};
+
+struct AlignmentReport{
+    int level = 0;
+    int matches = 0;        // ratio test matches on the proxy
+    int inliers = 0;        // RANSAC inliers on the proxy
+    int refined = 0;        // patch matches accepted by the refinement (0 = no refinement)
+    int refinedInliers = 0;
+    double millis = 0;
+};
+
+/* H estimated on level coordinates -> the same homography in full resolution coordinates */
+Mat scale_homography(const Mat &H, float s){
+    if (s == 1.0f) return H.clone();
+    Mat S = (Mat_<double>(3, 3) << s, 0, 0, 0, s, 0, 0, 0, 1);
+    Mat Sinv = (Mat_<double>(3, 3) << 1.0 / s, 0, 0, 0, 1.0 / s, 0, 0, 0, 1);
+    return S * H * Sinv;
+}
+
+/* search radius of the refinement for a homography from level `level`: a 1-2 pixel error there is 2^level - 2^(level+1) here */
+int refine_search_radius(const AlignmentParameters &A, int level){
+    return std::max(A.searchRadius, 2 * (int)ImagePyramid::scale(level));
+}
+
+/*
+Refines H_BtoA at full resolution with patches around seedsA (points of A, full resolution).
+Returns H_BtoA unchanged if there aren't enough good patch matches. grayA / grayB are single channel 8 bit.
+*/
+Mat refine_homography(const Mat &grayA, const Mat &grayB, const Mat &H_BtoA, const vector<Point2f> &seedsA,
+                      const AlignmentParameters &A, const RansacParameters &P, AlignmentReport *report = nullptr){
+    TRACE_SCOPE("refine_homography");
+    if (seedsA.empty() || H_BtoA.empty()) return H_BtoA;
+
+    // evenly spread subset of the seeds
+    vector<Point2f> seeds;
+    int step = std::max(1, (int)seedsA.size() / std::max(A.refinePoints, 1));
+    for (size_t i = 0; i < seedsA.size() && (int)seeds.size() < A.refinePoints; i += step)
+        seeds.push_back(seedsA[i]);
+
+    vector<Point2f> predicted;
+    perspectiveTransform(seeds, predicted, H_BtoA.inv());
+
+    const int r = A.patchRadius, R = A.searchRadius;
+    vector<Point2f> pA(seeds.size()), pB(seeds.size());
+    vector<char> ok(seeds.size(), 0);
+
+    parallel_for_(Range(0, (int)seeds.size()), [&](const Range &range){
+        for (int i = range.start; i < range.end; i++){
+            Point a(cvRound(seeds[i].x), cvRound(seeds[i].y));
+            Point b(cvRound(predicted[i].x), cvRound(predicted[i].y));
+
+            Rect patch(a.x - r, a.y - r, 2 * r + 1, 2 * r + 1);
+            Rect window(b.x - R - r, b.y - R - r, 2 * (R + r) + 1, 2 * (R + r) + 1);
+            // both completely inside their image
+            if ((patch & Rect(Point(0, 0), grayA.size())).area() != patch.area()) continue;
+            if ((window & Rect(Point(0, 0), grayB.size())).area() != window.area()) continue;
+
+            Mat score;
+            matchTemplate(grayB(window), grayA(patch), score, TM_CCOEFF_NORMED);
+            double best;
+            Point loc;
+            minMaxLoc(score, nullptr, &best, nullptr, &loc);
+            if (best < A.minCorrelation) continue;
+            // a peak on the border of the window is not a peak: the match is further than R (or the window cut it)
+            if (loc.x == 0 || loc.y == 0 || loc.x == score.cols - 1 || loc.y == score.rows - 1) continue;
+
+            // sub pixel: parabola through the peak and its neighbours
+            float dx = 0, dy = 0;
+            {
+                float l = score.at<float>(loc.y, loc.x - 1), c = score.at<float>(loc), rr = score.at<float>(loc.y, loc.x + 1);
+                float d = l - 2 * c + rr;
+                if (d < 0) dx = 0.5f * (l - rr) / d;
+            }
+            {
+                float u = score.at<float>(loc.y - 1, loc.x), c = score.at<float>(loc), dd = score.at<float>(loc.y + 1, loc.x);
+                float d = u - 2 * c + dd;
+                if (d < 0) dy = 0.5f * (u - dd) / d;
+            }
+
+            pA[i] = Point2f(float(a.x), float(a.y));
+            pB[i] = Point2f(window.x + loc.x + r + dx, window.y + loc.y + r + dy);
+            ok[i] = 1;
+        }
+    });
+
+    vector<Point2f> srcB, dstA;
+    for (size_t i = 0; i < seeds.size(); i++){
+        if (!ok[i]) continue;
+        srcB.push_back(pB[i]);
+        dstA.push_back(pA[i]);
+    }
+    if (report) report->refined = (int)srcB.size();
+    if (srcB.size() < 8) return H_BtoA;
+
+    vector<char> mask;
+    Mat H = find_homography_ransac(srcB, dstA, {}, A.refineThreshold, P.confidence, P.maxIters, false, mask);
+    if (H.empty()) return H_BtoA;
+    if (report) report->refinedInliers = (int)count(mask.begin(), mask.end(), 1);
+    return H;
+}
+
+/* Full resolution H (B -> A) estimated on a pyramid level of both images, empty if it fails */
+Mat align_coarse_to_fine(const Mat &imgA, const Mat &imgB, const RansacParameters &P = {},
+                         const AlignmentParameters &A = {}, AlignmentReport *report = nullptr){
+    int64 start = getTickCount();
+    AlignmentReport rep;
+
+    rep.level = A.level >= 0 ? A.level : std::max(proxy_level(imgA.size(), A.maxProxyPixels),
+                                                   proxy_level(imgB.size(), A.maxProxyPixels));
+    ImagePyramid pyrA = build_pyramid(imgA, rep.level), pyrB = build_pyramid(imgB, rep.level);
+    const Mat &proxyA = pyrA.levels[rep.level], &proxyB = pyrB.levels[rep.level];
+
+    auto finish = [&](Mat H){
+        rep.millis = (getTickCount() - start) * 1000.0 / getTickFrequency();
+        if (report) *report = rep;
+        return H;
+    };
+
+    // 1) detect + describe + match on the proxies
+    vector<KeyPoint> kpA = my_fast_detector(proxyA), kpB = my_fast_detector(proxyB);
+    Mat dA, dB;
+    siftDescriptorsAt(proxyA, kpA, dA);
+    siftDescriptorsAt(proxyB, kpB, dB);
+    if (dA.empty() || dB.empty()) return finish(Mat());
+
+    vector<DMatch> good = knnRatioMatch(dA, dB, P.ratio, P.matcher);
+    rep.matches = (int)good.size();
+    if (good.size() < 8) return finish(Mat());
+
+    // 2) RANSAC on the proxies (the threshold is in proxy pixels too)
+    vector<char> inliers;
+    Mat Hproxy = estimateHomographyRANSAC(kpA, kpB, good, P, inliers);
+    if (Hproxy.empty()) return finish(Mat());
+    rep.inliers = (int)count(inliers.begin(), inliers.end(), 1);
+
+    // 3) back to full resolution
+    float s = ImagePyramid::scale(rep.level);
+    Mat H = scale_homography(Hproxy, s);
+    if (!A.refine || rep.level == 0) return finish(H);
+
+    // 4) refine with patches around the inliers of A
+    vector<Point2f> seeds;
+    for (size_t i = 0; i < good.size(); i++)
+        if (inliers[i]) seeds.push_back(kpA[good[i].queryIdx].pt * s);
+    AlignmentParameters refineA = A;
+    refineA.searchRadius = refine_search_radius(A, rep.level);
+    return finish(refine_homography(pyrA.levels[0], pyrB.levels[0], H, seeds, refineA, P, &rep));
+}
+
+/* panorama_FAST, aligned coarse to fine: full resolution only in the warp (and the refinement patches) */
+Mat panorama_FAST_pyramid(const Mat &imgA, const Mat &imgB, const RansacParameters &P = {},
+                          const AlignmentParameters &A = {}, AlignmentReport *report = nullptr){
+    Mat H_BtoA = align_coarse_to_fine(imgA, imgB, P, A, report);
+    if (H_BtoA.empty()) return Mat();
+    return warpAndBlendPanorama(imgA, imgB, H_BtoA);
+}
+
+#endif
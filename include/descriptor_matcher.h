@@ -0,0 +1,501 @@
+#ifndef DESCRIPTOR_MATCHER_H
+#define DESCRIPTOR_MATCHER_H
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/features2d.hpp>
+#include <opencv2/flann.hpp>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <algorithm>
+#include "simd_common.h"
+#include "trace.h"
+#include "frame_arena.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+Descriptor matching with the KNN (k = 2) + Lowe ratio test, with different engines behind it:
+
+BRUTE_FORCE: the original BFMatcher(NORM_L2), compares everything with everything. It is the reference.
+FLANN:       randomized KD-forest (cv::flann), approximate, for when there are many thousands of descriptors.
+BLOCKED:     our own brute force, exact, but it walks the descriptors in small blocks so the query block
+             stays in L1, and the distances use AVX2 when the CPU has it. SIFT descriptors are whole
+             numbers in [0, 255], so they can be stored as 8-bit (4x less memory) without changing any distance.
+AUTO:        picks one of them from the number of descriptors.
+
+All of them keep the same ratio test semantics: the best match is kept if its distance (L2, not squared)
+is smaller than ratio * the distance of the second best.
+
+Binary descriptors (brief_descriptor.h) are compared with the Hamming distance instead (norm = NORM_HAMMING):
+the number of bits that differ, counted with popcount (AVX-512 VPOPCNTDQ, or a nibble table with AVX2).
+A KD-forest doesn't work on bits, so FLANN is replaced by BLOCKED for them.
+*/
+enum class MATCHER {
+    AUTO,
+    BRUTE_FORCE,
+    FLANN,
+    BLOCKED
+};
+
+const char *matcher_name(MATCHER m){
+    switch (m){
+        case MATCHER::BRUTE_FORCE: return "brute_force";
+        case MATCHER::FLANN: return "flann";
+        case MATCHER::BLOCKED: return "blocked";
+        default: return "auto";
+    }
+}
+
+struct MatcherParameters{
+    MATCHER backend = MATCHER::AUTO;
+    bool quantize = true;            // BLOCKED: use 8-bit descriptors when that is lossless
+    int flannTrees = 4;              // FLANN: number of randomized trees
+    int flannChecks = 64;            // FLANN: leaves to visit per query (more = better recall, slower)
+    long bruteForcePairs = 250000;   // AUTO: below this many query x train pairs just use BRUTE_FORCE
+    int flannMinTrain = 4000;        // AUTO: from this many train descriptors on, use FLANN
+    bool measureRecall = false;      // also run BRUTE_FORCE and report how many of its matches we found
+    int norm = NORM_L2;              // NORM_HAMMING for binary descriptors (a FeatureSet says which its are)
+};
+
+/* What happened in one call, for logging / benchmarks */
+struct MatchReport{
+    MATCHER backend = MATCHER::AUTO; // the engine that actually ran
+    size_t queries = 0, train = 0;
+    size_t matches = 0;              // after the ratio test
+    double recall = -1;              // fraction of the brute force matches found (-1 if not measured)
+    double millis = 0;
+};
+
+/*
+Interface of a matching engine: ratio test matches from d1 (query) to d2 (train).
+match_into does the same into good; the engines that can take their temporaries from the arena
+(frame_arena.h) instead of allocating them on every call.
+*/
+class RatioMatcher{
+public:
+    virtual ~RatioMatcher(){}
+    virtual vector<DMatch> match(const Mat &d1, const Mat &d2, float ratio) const = 0;
+    virtual void match_into(const Mat &d1, const Mat &d2, float ratio, vector<DMatch> &good, FrameArena &arena) const{
+        good = match(d1, d2, ratio);
+    }
+};
+
+/* The ratio test on the 2 nearest neighbours, the same for every engine */
+bool passes_ratio(float best, float second, float ratio){
+    return best < ratio * second;
+}
+
+class BruteForceRatioMatcher : public RatioMatcher{
+public:
+    explicit BruteForceRatioMatcher(int norm = NORM_L2) : norm(norm){}
+
+    vector<DMatch> match(const Mat &d1, const Mat &d2, float ratio) const override{
+        vector<DMatch> good;
+        match_into(d1, d2, ratio, good, frame_arena());
+        return good;
+    }
+
+    /* the KNN table is the arena's (BFMatcher still allocates inside) */
+    void match_into(const Mat &d1, const Mat &d2, float ratio, vector<DMatch> &good, FrameArena &arena) const override{
+        BFMatcher matcher(norm, false);
+        vector<vector<DMatch>> &knn = arena.get<vector<vector<DMatch>>>(ARENA_MATCH_KNN);
+        matcher.knnMatch(d1, d2, knn, 2);
+
+        good.clear();
+        good.reserve(knn.size());
+        for (size_t i = 0; i < knn.size(); i++){
+            const vector<DMatch> &v = knn[i];
+            if (v.size() < 2)
+                continue;
+            if (passes_ratio(v[0].distance, v[1].distance, ratio))
+                good.push_back(v[0]);
+        }
+    }
+
+private:
+    int norm;
+};
+
+class FlannRatioMatcher : public RatioMatcher{
+public:
+    FlannRatioMatcher(int trees = 4, int checks = 64) : trees(trees), checks(checks){}
+
+    vector<DMatch> match(const Mat &d1, const Mat &d2, float ratio) const override{
+        vector<DMatch> good;
+        if (d1.empty() || d2.rows < 2) return good;
+
+        Mat query, train;
+        d1.convertTo(query, CV_32F);
+        d2.convertTo(train, CV_32F);
+
+        flann::Index index(train, flann::KDTreeIndexParams(trees));
+        Mat indices, dists;
+        index.knnSearch(query, indices, dists, 2, flann::SearchParams(checks));
+
+        good.reserve(query.rows);
+        for (int i = 0; i < query.rows; i++){
+            int i0 = indices.at<int>(i, 0), i1 = indices.at<int>(i, 1);
+            if (i0 < 0 || i1 < 0) continue;
+            // FLANN gives squared L2, the ratio test is on the real distance
+            float best = std::sqrt(dists.at<float>(i, 0));
+            float second = std::sqrt(dists.at<float>(i, 1));
+            if (passes_ratio(best, second, ratio))
+                good.push_back(DMatch(i, i0, best));
+        }
+        return good;
+    }
+
+private:
+    int trees, checks;
+};
+
+/*
+Descriptors copied into one contiguous block, every row padded with zeros to a multiple of 32 values so
+the SIMD loops have no tail (zeros on both sides don't change the distance).
+*/
+struct PackedDescriptors{
+    int rows = 0, dims = 0, stride = 0;
+    bool quantized = false;
+    vector<float> f;  // if !quantized
+    vector<uchar> q;  // if quantized
+
+    const float *frow(int i) const { return f.data() + (size_t)i * stride; }
+    const uchar *qrow(int i) const { return q.data() + (size_t)i * stride; }
+};
+
+/* true if every value is a whole number in [0, 255] (SIFT descriptors are) */
+bool descriptors_fit_u8(const Mat &d){
+    if (d.depth() == CV_8U) return true;
+    Mat f = d; // float (what SIFT gives) is read as it is
+    if (d.depth() != CV_32F) d.convertTo(f, CV_32F);
+    for (int i = 0; i < f.rows; i++){
+        const float *row = f.ptr<float>(i);
+        for (int j = 0; j < f.cols; j++){
+            float v = row[j];
+            if (v < 0.0f || v > 255.0f || v != std::floor(v)) return false;
+        }
+    }
+    return true;
+}
+
+/* into p, whose vectors keep their memory from one call to the next (assign doesn't shrink) */
+void pack_descriptors_into(const Mat &d, bool quantized, PackedDescriptors &p){
+    p.rows = d.rows;
+    p.dims = d.cols;
+    p.stride = (d.cols + 31) / 32 * 32;
+    p.quantized = quantized;
+
+    // 8 bit and float rows are read as they are, anything else goes through a float copy
+    Mat src = d;
+    if (d.depth() != CV_8U && d.depth() != CV_32F) d.convertTo(src, CV_32F);
+    if (quantized) p.q.assign((size_t)p.rows * p.stride, 0);
+    else p.f.assign((size_t)p.rows * p.stride, 0.0f);
+
+    for (int i = 0; i < p.rows; i++){
+        if (src.depth() == CV_8U){
+            const uchar *row = src.ptr<uchar>(i);
+            if (quantized) std::copy(row, row + p.dims, p.q.data() + (size_t)i * p.stride);
+            else std::copy(row, row + p.dims, p.f.data() + (size_t)i * p.stride);
+            continue;
+        }
+        const float *row = src.ptr<float>(i);
+        if (quantized){
+            uchar *dst = p.q.data() + (size_t)i * p.stride;
+            for (int j = 0; j < p.dims; j++) dst[j] = (uchar)row[j];
+        }
+        else {
+            std::copy(row, row + p.dims, p.f.data() + (size_t)i * p.stride);
+        }
+    }
+}
+
+PackedDescriptors pack_descriptors(const Mat &d, bool quantized){
+    PackedDescriptors p;
+    pack_descriptors_into(d, quantized, p);
+    return p;
+}
+
+/* Squared L2 distances, n is a multiple of 32 */
+float l2sqr_f32_scalar(const float *a, const float *b, int n){
+    float s = 0;
+    for (int i = 0; i < n; i++){
+        float d = a[i] - b[i];
+        s += d * d;
+    }
+    return s;
+}
+
+float l2sqr_u8_scalar(const uchar *a, const uchar *b, int n){
+    int s = 0;
+    for (int i = 0; i < n; i++){
+        int d = int(a[i]) - int(b[i]);
+        s += d * d;
+    }
+    return float(s);
+}
+
+#ifdef SIMD_HAVE_X86
+SIMD_TARGET_AVX2
+float l2sqr_f32_avx2(const float *a, const float *b, int n){
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    for (int i = 0; i < n; i += 16){
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(d0, d0));
+        acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(d1, d1));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, _mm256_add_ps(acc0, acc1));
+    return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+/* 8-bit: widen to 16 bits, subtract, and madd gives d0*d0 + d1*d1 in 32 bits (exact) */
+SIMD_TARGET_AVX2
+float l2sqr_u8_avx2(const uchar *a, const uchar *b, int n){
+    __m256i acc = _mm256_setzero_si256();
+    for (int i = 0; i < n; i += 16){
+        __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(a + i)));
+        __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(b + i)));
+        __m256i d = _mm256_sub_epi16(va, vb);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+    }
+    int lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return float(lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7]);
+}
+#endif
+
+/* Hamming distances (bits that differ) of binary descriptors, n bytes, a multiple of 32 */
+float hamming_scalar(const uchar *a, const uchar *b, int n){
+    int s = 0;
+    for (int i = 0; i < n; i += 8){
+        unsigned long long x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        s += simd_popcount64(x ^ y);
+    }
+    return float(s);
+}
+
+#ifdef SIMD_HAVE_X86
+/* AVX2 has no vector popcount: the bits of every nibble come from a 16 entry table (pshufb), and sad
+against zero adds the bytes up into 4 x 64 bits (Mula's method) */
+SIMD_TARGET_AVX2
+float hamming_avx2(const uchar *a, const uchar *b, int n){
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    for (int i = 0; i < n; i += 32){
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+        __m256i bits = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(x, low)),
+                                       _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(bits, _mm256_setzero_si256()));
+    }
+    long long lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return float(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+
+/* AVX-512 VPOPCNTDQ (Ice Lake and later): a popcount per 64 bit lane */
+SIMD_TARGET_AVX512_POPCNT
+float hamming_avx512(const uchar *a, const uchar *b, int n){
+    __m256i acc = _mm256_setzero_si256();
+    for (int i = 0; i < n; i += 32){
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+        acc = _mm256_add_epi64(acc, _mm256_popcnt_epi64(x));
+    }
+    long long lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return float(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+#endif
+
+/*
+Distance between row i of A and row t of B (packed the same way) with the best kernel this CPU has:
+squared L2, or the Hamming distance for binary descriptors. value() turns it into the distance the ratio
+test and DMatch::distance use (L2 not squared, or the bit count as it is).
+*/
+struct DescriptorDistance{
+    bool hamming = false, avx2 = false, vpopcnt = false;
+
+    explicit DescriptorDistance(int norm = NORM_L2) : hamming(norm == NORM_HAMMING){
+#ifdef SIMD_HAVE_X86
+        avx2 = checkHardwareSupport(CV_CPU_AVX2);
+        vpopcnt = checkHardwareSupport(CV_CPU_AVX_512VPOPCNTDQ) && checkHardwareSupport(CV_CPU_AVX_512VL);
+#endif
+    }
+
+    float operator()(const PackedDescriptors &A, const PackedDescriptors &B, int i, int t) const{
+        if (hamming){
+#ifdef SIMD_HAVE_X86
+            if (vpopcnt) return hamming_avx512(A.qrow(i), B.qrow(t), A.stride);
+            if (avx2) return hamming_avx2(A.qrow(i), B.qrow(t), A.stride);
+#endif
+            return hamming_scalar(A.qrow(i), B.qrow(t), A.stride);
+        }
+#ifdef SIMD_HAVE_X86
+        if (avx2)
+            return A.quantized ? l2sqr_u8_avx2(A.qrow(i), B.qrow(t), A.stride) : l2sqr_f32_avx2(A.frow(i), B.frow(t), A.stride);
+#endif
+        return A.quantized ? l2sqr_u8_scalar(A.qrow(i), B.qrow(t), A.stride) : l2sqr_f32_scalar(A.frow(i), B.frow(t), A.stride);
+    }
+
+    float value(float d) const { return hamming ? d : std::sqrt(d); }
+};
+
+class BlockedRatioMatcher : public RatioMatcher{
+public:
+    // 8 query descriptors (4 KB as floats) stay in L1 while 256 train descriptors stream past them
+    static constexpr int QUERY_BLOCK = 8;
+    static constexpr int TRAIN_BLOCK = 256;
+
+    BlockedRatioMatcher(bool quantize = true, int norm = NORM_L2) : quantize(quantize), norm(norm){}
+
+    vector<DMatch> match(const Mat &d1, const Mat &d2, float ratio) const override{
+        vector<DMatch> good;
+        match_into(d1, d2, ratio, good, frame_arena());
+        return good;
+    }
+
+    /* packed descriptors and the best / second best tables are the arena's: no allocation once they fit */
+    void match_into(const Mat &d1, const Mat &d2, float ratio, vector<DMatch> &good, FrameArena &arena) const override{
+        good.clear();
+        if (d1.empty() || d2.rows < 2) return;
+        CV_Assert(d1.cols == d2.cols);
+
+        // binary descriptors are bytes of bits, always packed as they are
+        const DescriptorDistance distance(norm);
+        if (distance.hamming) CV_Assert(d1.depth() == CV_8U && d2.depth() == CV_8U);
+        bool q = distance.hamming || (quantize && descriptors_fit_u8(d1) && descriptors_fit_u8(d2));
+        PackedDescriptors &A = arena.get<PackedDescriptors>(ARENA_MATCH_QUERY);
+        PackedDescriptors &B = arena.get<PackedDescriptors>(ARENA_MATCH_TRAIN);
+        pack_descriptors_into(d1, q, A);
+        pack_descriptors_into(d2, q, B);
+
+        const int nQueryBlocks = (A.rows + QUERY_BLOCK - 1) / QUERY_BLOCK;
+        vector<float> &best1 = arena.vec<float>(ARENA_MATCH_BEST1), &best2 = arena.vec<float>(ARENA_MATCH_BEST2);
+        vector<int> &idx1 = arena.vec<int>(ARENA_MATCH_INDEX);
+        best1.assign(A.rows, FLT_MAX);
+        best2.assign(A.rows, FLT_MAX);
+        idx1.assign(A.rows, -1);
+
+        parallel_for_(Range(0, nQueryBlocks), [&](const Range &r){
+            for (int qb = r.start; qb < r.end; qb++){
+                int q0 = qb * QUERY_BLOCK, q1 = std::min(q0 + QUERY_BLOCK, A.rows);
+
+                for (int t0 = 0; t0 < B.rows; t0 += TRAIN_BLOCK){
+                    int t1 = std::min(t0 + TRAIN_BLOCK, B.rows);
+                    for (int t = t0; t < t1; t++){
+                        for (int i = q0; i < q1; i++){
+                            float d = distance(A, B, i, t);
+                            // strict < keeps the lowest train index on ties, like BFMatcher
+                            if (d < best1[i]){
+                                best2[i] = best1[i];
+                                best1[i] = d;
+                                idx1[i] = t;
+                            }
+                            else if (d < best2[i]){
+                                best2[i] = d;
+                            }
+                        }
+                    }
+                }
+            }
+        });
+
+        good.reserve(A.rows);
+        for (int i = 0; i < A.rows; i++){
+            float b1 = distance.value(best1[i]), b2 = distance.value(best2[i]);
+            if (idx1[i] >= 0 && passes_ratio(b1, b2, ratio))
+                good.push_back(DMatch(i, idx1[i], b1));
+        }
+    }
+
+private:
+    bool quantize;
+    int norm;
+};
+
+Ptr<RatioMatcher> create_ratio_matcher(MATCHER backend, const MatcherParameters &P = {}){
+    switch (backend){
+        case MATCHER::FLANN:
+            if (P.norm != NORM_HAMMING) return makePtr<FlannRatioMatcher>(P.flannTrees, P.flannChecks);
+            return makePtr<BlockedRatioMatcher>(P.quantize, P.norm);
+        case MATCHER::BLOCKED: return makePtr<BlockedRatioMatcher>(P.quantize, P.norm);
+        default: return makePtr<BruteForceRatioMatcher>(P.norm);
+    }
+}
+
+/*
+AUTO: small problems are cheapest with the plain brute force (nothing to build),
+very big train sets amortize the KD-forest, and everything in between goes to the blocked brute force.
+Binary descriptors never go to FLANN (a KD-forest splits on values, not bits): the blocked engine instead.
+*/
+MATCHER choose_matcher(int queries, int train, const MatcherParameters &P){
+    const bool binary = P.norm == NORM_HAMMING;
+    if (P.backend == MATCHER::FLANN && binary) return MATCHER::BLOCKED;
+    if (P.backend != MATCHER::AUTO) return P.backend;
+    if ((long)queries * train <= P.bruteForcePairs) return MATCHER::BRUTE_FORCE;
+    if (train >= P.flannMinTrain && !binary) return MATCHER::FLANN;
+    return MATCHER::BLOCKED;
+}
+
+/* fraction of the reference matches (same query -> same train) that are also in found */
+double match_recall(const vector<DMatch> &reference, const vector<DMatch> &found, int queries){
+    if (reference.empty()) return 1.0;
+    vector<int> trainOf(queries, -1);
+    for (const auto &m : found) trainOf[m.queryIdx] = m.trainIdx;
+
+    size_t hits = 0;
+    for (const auto &m : reference)
+        if (trainOf[m.queryIdx] == m.trainIdx) hits++;
+    return double(hits) / double(reference.size());
+}
+
+/*
+Entry point: ratio test matching with the engine from P (or the one AUTO picks), into good.
+The engine lives on the stack and its temporaries in the arena, so with the blocked engine a steady
+stream of frames doesn't allocate (brute force and FLANN still allocate inside OpenCV).
+*/
+void ratio_match_into(const Mat &d1, const Mat &d2, float ratio, vector<DMatch> &good, const MatcherParameters &P = {},
+                      MatchReport *report = nullptr, FrameArena &arena = frame_arena()){
+    TRACE_SCOPE("match");
+    MATCHER backend = choose_matcher(d1.rows, d2.rows, P);
+
+    int64 t0 = getTickCount();
+    switch (backend){
+        case MATCHER::FLANN: FlannRatioMatcher(P.flannTrees, P.flannChecks).match_into(d1, d2, ratio, good, arena); break;
+        case MATCHER::BLOCKED: BlockedRatioMatcher(P.quantize, P.norm).match_into(d1, d2, ratio, good, arena); break;
+        default: BruteForceRatioMatcher(P.norm).match_into(d1, d2, ratio, good, arena); break;
+    }
+    double millis = (getTickCount() - t0) * 1000.0 / getTickFrequency();
+    TRACE_COUNT("matches_before_ratio", d1.rows); // one nearest neighbour candidate per query
+    TRACE_COUNT("matches_after_ratio", good.size());
+
+    if (report){
+        report->backend = backend;
+        report->queries = d1.rows;
+        report->train = d2.rows;
+        report->matches = good.size();
+        report->millis = millis;
+        report->recall = -1;
+        if (P.measureRecall){
+            vector<DMatch> reference = backend == MATCHER::BRUTE_FORCE ? good : BruteForceRatioMatcher(P.norm).match(d1, d2, ratio);
+            report->recall = match_recall(reference, good, d1.rows);
+        }
+    }
+}
+
+vector<DMatch> ratio_match(const Mat &d1, const Mat &d2, float ratio, const MatcherParameters &P = {},
+                           MatchReport *report = nullptr){
+    vector<DMatch> good;
+    ratio_match_into(d1, d2, ratio, good, P, report);
+    return good;
+}
+
+#endif
@@ -4,6 +4,9 @@
 #include <iostream>
 #include <opencv2/opencv.hpp>
 #include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
 #include "harris_corner_detector.h"
 #include "fast_detector.h"
 
@@ -15,33 +18,88 @@ using namespace std;
 // Essentially here I have to: calculate the fast first, then calculate the harris corner and compare if the
 // keypoints of the fast detector have also a high harris corner to have more strong corners!
 
-
-vector<KeyPoint> my_fastR_detector(const Mat input){
-
-    // image holds the actual image, H holds the harris matrix
-    Mat gray;
-    if (input.channels() == 3) 
+/*
+How the Harris score decides which FAST keypoints stay:
+FULL_FRAME is the original one: Harris on the whole image, normalized with its min and max, keep > 0.35.
+The problem is that the min/max of the whole image move a lot between frames (on the S* images it keeps
+from 30% to 99% of the keypoints) and computing the full map just to read it at < 1% of the pixels is a waste.
+ABSOLUTE and PERCENTILE only compute the Harris response around each FAST keypoint (harris_response_at):
+ABSOLUTE keeps the raw response > harrisThreshold (intensities in [0, 1]),
+PERCENTILE keeps the best keepFraction of the keypoints, and never the ones with a negative response (edges).
+*/
+enum class FASTR_MODE {
+    FULL_FRAME,
+    ABSOLUTE,
+    PERCENTILE
+};
+
+struct FastRParameters{
+    FastParameters fast;
+    FASTR_MODE mode = FASTR_MODE::PERCENTILE;
+    float normalizedThreshold = 0.35f; // FULL_FRAME
+    float harrisThreshold = 0.1f;      // ABSOLUTE
+    float keepFraction = 0.5f;         // PERCENTILE
+    HARRIS_PRECISION harrisPrecision = HARRIS_PRECISION::FIXED_POINT; // integer Harris on 8-bit images (same thresholds)
+};
+
+/* result gets the keypoints, the temporaries come from the arena (see frame_arena.h) */
+void my_fastR_detector_into(const Mat input, const FastRParameters &P, vector<KeyPoint> &result,
+                            FrameArena &arena = frame_arena()){
+    TRACE_SCOPE("fastR_detect");
+
+    // one grayscale image for both FAST and Harris (8 bit stays 8 bit, both of them read it directly)
+    Mat gray = input;
+    if (input.channels() == 3){
+        gray = arena.mat(ARENA_FASTR_GRAY, input.size(), CV_8UC1);
         cvtColor(input, gray, COLOR_BGR2GRAY);
-    else gray = input;
-    
-    Mat image, H;
-    if (gray.type() != CV_32F) gray.convertTo(image, CV_32F, 1.0/255.0);
-    else image = gray;
+    }
 
-    vector<KeyPoint> temp = my_fast_detector(input);
+    vector<KeyPoint> &temp = arena.vec<KeyPoint>(ARENA_FASTR_FAST);
+    my_fast_detector_into(gray, P.fast, temp, arena);
+
+    result.clear();
+    result.reserve(temp.size());
+
+    if (P.mode == FASTR_MODE::FULL_FRAME){
+        // H holds the harris matrix
+        Mat H = arena.mat(ARENA_HARRIS, gray.size(), CV_32F);
+        my_harris_corner_detector_into(gray, H, DETECT_BAND_ROWS, P.harrisPrecision);
+        for (int i = 0; i < temp.size(); i++){
+            int x = cvRound(temp[i].pt.x);
+            int y = cvRound(temp[i].pt.y);
+            if (H.at<float>(y, x) > P.normalizedThreshold){
+                result.push_back(temp[i]);
+            }
+        }
+        return;
+    }
 
-    H = my_harris_corner_detector(image);
+    // only the 7x7 neighbourhood of each keypoint
+    vector<float> &score = arena.vec<float>(ARENA_FASTR_SCORE);
+    harris_response_at_into(gray, temp, score, 1.0f / 255.0f, HARRIS_K, P.harrisPrecision);
+
+    float threshold = P.harrisThreshold;
+    if (P.mode == FASTR_MODE::PERCENTILE){
+        if (temp.empty()) return;
+        vector<float> &sorted = arena.vec<float>(ARENA_FASTR_SORTED);
+        sorted.assign(score.begin(), score.end());
+        int cut = int((1.0f - std::min(std::max(P.keepFraction, 0.0f), 1.0f)) * sorted.size());
+        cut = std::min(cut, (int)sorted.size() - 1);
+        nth_element(sorted.begin(), sorted.begin() + cut, sorted.end());
+        // >= so ties at the cut don't depend on the order of the keypoints
+        threshold = std::nextafter(std::max(sorted[cut], 0.0f), -FLT_MAX);
+    }
 
-    vector<KeyPoint> result;
-    float threshold = 0.35;
     for (int i = 0; i < temp.size(); i++){
-        int x = cvRound(temp[i].pt.x);
-        int y = cvRound(temp[i].pt.y);
-        if (H.at<float>(y, x) > threshold){
+        if (score[i] > threshold){
             result.push_back(temp[i]);
         }
     }
-    
+}
+
+vector<KeyPoint> my_fastR_detector(const Mat input, const FastRParameters &P = {}){
+    vector<KeyPoint> result;
+    my_fastR_detector_into(input, P, result);
     return result;
 }
 
@@ -4,6 +4,10 @@
 #include <iostream>
 #include <opencv2/opencv.hpp>
 #include <vector>
+#include "fast_simd.h"
+#include "keypoint_selection.h"
+#include "trace.h"
+#include "frame_arena.h"
 
 using namespace cv;
 using namespace std;
@@ -87,7 +91,11 @@ bool is_darker(const Mat &image, const Point &p, float threshold, const Point *o
 }
 
 
-vector<KeyPoint> my_fast_detector(const Mat image){
+/*
+This is the original float implementation, it stays as the reference that the 8-bit kernels in
+fast_simd.h have to match keypoint by keypoint (FAST_KERNEL::REFERENCE forces it)
+*/
+vector<KeyPoint> my_fast_detector_reference(const Mat image, float threshold = 0.25){
     
     /* first get the image and since it's normalized from input, we wont have to do it again*/
     Mat gray;
@@ -102,7 +110,7 @@ vector<KeyPoint> my_fast_detector(const Mat image){
     /* now start with the padding */
     copyMakeBorder(input, input, 3, 3, 3, 3, BORDER_REFLECT_101);
 
-    // This will be the threshold to check the points in the image
+    // This will be the threshold to check the points in the image (it comes in as a parameter now, 0.25 by default)
     
     /* Here I will make some notes about thresholds used:
     0.1 = too many points in my opinon
@@ -111,7 +119,6 @@ vector<KeyPoint> my_fast_detector(const Mat image){
 
     still, remember that the real test is when you actually try to match the images together
     */
-    float threshold = 0.25;
 
     // making the offsets for the padding
     // Point comes from cv library, it is just a regular Point structure
@@ -182,4 +189,70 @@ vector<KeyPoint> my_fast_detector(const Mat image){
     return result;
 }
 
+// Same idea as RansacParameters
+struct FastParameters{
+    float threshold = 0.25f; // in [0, 1] intensity units, like the reference
+    int intensityThreshold = -1; // in 8-bit intensity units (brighter: n > c + t), -1 = from threshold (0.25 -> 63)
+    FAST_KERNEL kernel = FAST_KERNEL::AUTO; // which segment test implementation to run
+    int bandRows = DETECT_BAND_ROWS; // rows per parallel band (the result doesn't depend on it)
+
+    /* after the segment test (see keypoint_selection.h), the response of every keypoint is its corner score */
+    bool nonmaxSuppression = true; // keep only the local maxima (3x3) of the corner score
+    int maxKeypoints = 0;          // keep at most this many (0 = all of them)
+    int gridCols = 1, gridRows = 1; // spread maxKeypoints over a grid of cells
+};
+
+/*
+Entry point for FAST: 8-bit images go straight to the SIMD kernels (no float copy, no padding),
+anything else (or FAST_KERNEL::REFERENCE) goes through the float reference.
+Both give exactly the same keypoints (and the same scores).
+The _into version writes into result and takes its temporaries (gray, band vectors, keypoints before the
+suppression) from the arena, so on an 8-bit image it allocates nothing once the buffers are big enough
+(a maxKeypoints cap and the reference path still allocate).
+*/
+void my_fast_detector_into(const Mat image, const FastParameters &P, vector<KeyPoint> &result,
+                           FrameArena &arena = frame_arena()){
+    TRACE_SCOPE("fast_detect");
+    Mat gray = image;
+    if (image.channels() == 3){
+        gray = arena.mat(ARENA_FAST_GRAY, image.size(), CV_8UC1);
+        cvtColor(image, gray, COLOR_BGR2GRAY);
+    }
+
+    vector<KeyPoint> &all = arena.vec<KeyPoint>(ARENA_FAST_ALL);
+    if (P.kernel == FAST_KERNEL::REFERENCE || gray.type() != CV_8UC1){
+        // an 8-bit threshold t is half a level above t for the float test (n - c > t + 0.5 is n > c + t)
+        float threshold = P.intensityThreshold >= 0 ? (P.intensityThreshold + 0.5f) / 255.0f : P.threshold;
+        all = my_fast_detector_reference(gray, threshold);
+
+        // the reference doesn't compute scores, so they are computed afterwards on the 8-bit image
+        Mat gray8 = gray;
+        if (gray.depth() == CV_32F) gray.convertTo(gray8, CV_8U, 255.0);
+        else if (gray.depth() != CV_8U) gray.convertTo(gray8, CV_8U);
+        fast_score_keypoints(gray8, all);
+    }
+    else {
+        FastThresholds T = P.intensityThreshold >= 0 ? fast_thresholds_u8_int(P.intensityThreshold)
+                                                     : fast_thresholds_u8(P.threshold);
+        fast_detect_u8_into(gray, T, P.kernel, all,
+                            arena.bands<KeyPoint>(ARENA_FAST_BANDS, band_count(gray.rows, P.bandRows)), P.bandRows);
+    }
+
+    if (P.nonmaxSuppression){
+        if (!is_sorted(all.begin(), all.end(), keypoint_raster_less))
+            stable_sort(all.begin(), all.end(), keypoint_raster_less);
+        nonmax_suppression_3x3_into(all, result);
+    }
+    else result.assign(all.begin(), all.end());
+
+    if (P.maxKeypoints > 0 && (int)result.size() > P.maxKeypoints)
+        result = retain_best_keypoints(result, P.maxKeypoints, gray.size(), P.gridCols, P.gridRows);
+}
+
+vector<KeyPoint> my_fast_detector(const Mat image, const FastParameters &P = {}){
+    vector<KeyPoint> result;
+    my_fast_detector_into(image, P, result);
+    return result;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,435 @@
+#ifndef FAST_SIMD_H
+#define FAST_SIMD_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <cmath>
+#include "parallel_bands.h"
+#include "simd_common.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+Which implementation of the segment test to use.
+REFERENCE is the original float code in fast_detector.h, the rest work directly on CV_8U rows:
+SCALAR checks one pixel at a time, SSE2/NEON check 16 pixels per instruction and AVX2 checks 32.
+AUTO picks the widest one the CPU supports at runtime.
+*/
+enum class FAST_KERNEL {
+    AUTO,
+    REFERENCE,
+    SCALAR,
+    SSE2,
+    AVX2,
+    NEON
+};
+
+/* Circle of 16 pixels around p, same order as the offsets in my_fast_detector (x, y) */
+static const int fast_circle_dx[16] = {-3, -3, -2, -1, 0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3};
+static const int fast_circle_dy[16] = { 0, 1, 2, 3, 3, 3, 2, 1, 0, -1, -2, -3, -3, -3, -2, -1};
+
+/*
+The float path compares (c / 255 + threshold) < n / 255. In 8-bit units that is n - c > threshold * 255,
+so normally it is the same as n > c + floor(threshold * 255) (0.25 * 255 = 63.75, so 63 for the default).
+But when threshold * 255 lands (almost) on an integer, float rounding decides, and it can decide differently
+for different c. So we just ask the float arithmetic itself, for every c, which n are brighter/darker.
+*/
+struct FastThresholds{
+    int hi[256]; // n > hi[c] means brighter
+    int lo[256]; // n < lo[c] means darker
+    int t;       // the same bounds as one offset (hi = c + t, lo = c - t), only valid if uniform
+    bool uniform;
+};
+
+FastThresholds fast_thresholds_u8(float threshold){
+    FastThresholds T;
+    const float scale = float(1.0 / 255.0); // the same scale convertTo gets in the reference
+
+    for (int c = 0; c < 256; c++){
+        volatile float cval = float(c) * scale;
+        volatile float up = cval + threshold;
+        volatile float down = cval - threshold;
+
+        T.hi[c] = 255;
+        for (int n = 0; n < 256; n++)
+            if (up < float(n) * scale){ T.hi[c] = n - 1; break; }
+
+        T.lo[c] = 0;
+        for (int n = 255; n >= 0; n--)
+            if (down > float(n) * scale){ T.lo[c] = n + 1; break; }
+    }
+
+    T.t = int(floor(double(threshold) * 255.0));
+    T.t = std::min(std::max(T.t, 0), 255);
+
+    /* the SIMD kernels use saturated c + t and c - t, so this is what they need to agree with */
+    T.uniform = true;
+    for (int c = 0; c < 256; c++){
+        if (T.hi[c] != std::min(c + T.t, 255) || T.lo[c] != std::max(c - T.t, 0))
+            T.uniform = false;
+    }
+    return T;
+}
+
+/* A threshold given directly in 8-bit intensity units: brighter is n > c + t, darker n < c - t */
+FastThresholds fast_thresholds_u8_int(int t){
+    FastThresholds T;
+    T.t = std::min(std::max(t, 0), 255);
+    for (int c = 0; c < 256; c++){
+        T.hi[c] = std::min(c + T.t, 255);
+        T.lo[c] = std::max(c - T.t, 0);
+    }
+    T.uniform = true;
+    return T;
+}
+
+/*
+Checks if there are 12 contiguous bits set in the circular 16 bit mask.
+Doubling the mask into 32 bits is the same trick as the i % 16 loop in is_brighter/is_darker:
+a run that wraps around from bit 15 to bit 0 becomes a normal run in the middle.
+*/
+bool fast_has_arc(unsigned mask){
+    unsigned m = mask | (mask << 16);
+    unsigned run = m;
+    for (int k = 1; k < 12; k++)
+        run &= m >> k;
+    return run != 0;
+}
+
+/*
+Full segment test on the 16 circle values v of a pixel with intensity c.
+It follows exactly the same steps as high_speed_test + is_brighter/is_darker:
+first the 4 compass pixels (0, 4, 8, 12) and only then the whole circle
+*/
+bool fast_segment_test_u8(int c, const int *v, const FastThresholds &T){
+    int hi = T.hi[c];
+    int lo = T.lo[c];
+
+    int bright = (v[0] > hi) + (v[4] > hi) + (v[8] > hi) + (v[12] > hi);
+    int dark = (v[0] < lo) + (v[4] < lo) + (v[8] < lo) + (v[12] < lo);
+
+    unsigned mask = 0;
+    if (bright >= 3){
+        for (int i = 0; i < 16; i++)
+            if (v[i] > hi) mask |= 1u << i;
+        return fast_has_arc(mask);
+    }
+    if (dark >= 3){
+        for (int i = 0; i < 16; i++)
+            if (v[i] < lo) mask |= 1u << i;
+        return fast_has_arc(mask);
+    }
+    return false;
+}
+
+/* Segment test with a plain integer threshold t (brighter: n > c + t, darker: n < c - t) */
+bool fast_arc_test(int c, const int *v, int t){
+    unsigned bright = 0, dark = 0;
+    for (int i = 0; i < 16; i++){
+        if (v[i] > c + t) bright |= 1u << i;
+        else if (v[i] < c - t) dark |= 1u << i;
+    }
+    return fast_has_arc(bright) || fast_has_arc(dark);
+}
+
+/*
+Corner score: the largest threshold (in 8-bit units) for which the pixel still passes the segment test.
+A bigger threshold can only make fewer pixels pass, so a binary search over [0, 255] is enough
+(nothing passes with 255 since n > c + 255 is impossible).
+*/
+int fast_corner_score(int c, const int *v){
+    if (!fast_arc_test(c, v, 0)) return 0;
+    int lo = 0, hi = 255;
+    while (hi - lo > 1){
+        int mid = (lo + hi) / 2;
+        if (fast_arc_test(c, v, mid)) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* The 16 circle values of (x, y), reflecting the index like the BORDER_REFLECT_101 padding of the reference */
+void fast_circle_border_u8(const Mat &gray, int x, int y, int *v){
+    for (int i = 0; i < 16; i++){
+        int yy = borderInterpolate(y + fast_circle_dy[i], gray.rows, BORDER_REFLECT_101);
+        int xx = borderInterpolate(x + fast_circle_dx[i], gray.cols, BORDER_REFLECT_101);
+        v[i] = gray.at<uchar>(yy, xx);
+    }
+}
+
+/* Pixels closer than 3 to the border. If it is a corner, score gets its corner score */
+bool fast_test_border_pixel_u8(const Mat &gray, int x, int y, const FastThresholds &T, int *score){
+    int v[16];
+    fast_circle_border_u8(gray, x, y, v);
+    int c = gray.at<uchar>(y, x);
+    if (!fast_segment_test_u8(c, v, T)) return false;
+    *score = fast_corner_score(c, v);
+    return true;
+}
+
+/* Interior pixels: the 16 neighbours are just fixed offsets from the pixel pointer */
+bool fast_test_interior_pixel_u8(const uchar *p, const int *circle, const FastThresholds &T, int *score){
+    int v[16];
+    for (int i = 0; i < 16; i++)
+        v[i] = p[circle[i]];
+    if (!fast_segment_test_u8(p[0], v, T)) return false;
+    *score = fast_corner_score(p[0], v);
+    return true;
+}
+
+/* Fills the response of keypoints that come from somewhere else (the float reference) with the corner score */
+void fast_score_keypoints(const Mat &gray, vector<KeyPoint> &kps){
+    CV_Assert(gray.type() == CV_8UC1);
+    for (auto &kp : kps){
+        int x = cvRound(kp.pt.x), y = cvRound(kp.pt.y);
+        int v[16];
+        fast_circle_border_u8(gray, x, y, v);
+        kp.response = float(fast_corner_score(gray.at<uchar>(y, x), v));
+    }
+}
+
+/*
+A row kernel runs the high speed test (3 of the 4 compass pixels) on the pixels [x0, x1) of one row
+and writes the x of every pixel that survives it into cand, in increasing order.
+The vector versions do the tail of the row with the scalar one.
+*/
+typedef int (*FastRowKernel)(const uchar *row, size_t step, int x0, int x1, const FastThresholds &T, int *cand);
+
+int fast_row_candidates_scalar(const uchar *row, size_t step, int x0, int x1, const FastThresholds &T, int *cand){
+    int n = 0;
+    for (int x = x0; x < x1; x++){
+        const uchar *p = row + x;
+        int hi = T.hi[p[0]];
+        int lo = T.lo[p[0]];
+        int up = p[-3 * (ptrdiff_t)step], down = p[3 * step], left = p[-3], right = p[3];
+
+        int bright = (up > hi) + (down > hi) + (left > hi) + (right > hi);
+        int dark = (up < lo) + (down < lo) + (left < lo) + (right < lo);
+        if (bright >= 3 || dark >= 3)
+            cand[n++] = x;
+    }
+    return n;
+}
+
+#ifdef SIMD_HAVE_X86
+/*
+SSE2 has no unsigned byte comparison, so both sides get xor 0x80 to turn them into signed bytes
+(that keeps the order). c + t and c - t use saturating adds: if c + t would go over 255 no pixel can be
+brighter anyway, which is also what happens with the int comparison.
+*/
+SIMD_TARGET_SSE2
+int fast_row_candidates_sse2(const uchar *row, size_t step, int x0, int x1, const FastThresholds &T, int *cand){
+    const __m128i vt = _mm_set1_epi8((char)T.t);
+    const __m128i sign = _mm_set1_epi8((char)0x80);
+    const __m128i minus2 = _mm_set1_epi8(-2);
+    const ptrdiff_t s3 = 3 * (ptrdiff_t)step;
+
+    int n = 0;
+    int x = x0;
+    for (; x + 16 <= x1; x += 16){
+        const uchar *p = row + x;
+        __m128i c = _mm_loadu_si128((const __m128i *)p);
+        __m128i hi = _mm_xor_si128(_mm_adds_epu8(c, vt), sign);
+        __m128i lo = _mm_xor_si128(_mm_subs_epu8(c, vt), sign);
+
+        __m128i up = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p - s3)), sign);
+        __m128i down = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p + s3)), sign);
+        __m128i left = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p - 3)), sign);
+        __m128i right = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p + 3)), sign);
+
+        // every comparison gives -1 (all bits set) when true, so the sum is minus the count
+        __m128i bright = _mm_add_epi8(_mm_add_epi8(_mm_cmpgt_epi8(up, hi), _mm_cmpgt_epi8(down, hi)),
+                                      _mm_add_epi8(_mm_cmpgt_epi8(left, hi), _mm_cmpgt_epi8(right, hi)));
+        __m128i dark = _mm_add_epi8(_mm_add_epi8(_mm_cmpgt_epi8(lo, up), _mm_cmpgt_epi8(lo, down)),
+                                    _mm_add_epi8(_mm_cmpgt_epi8(lo, left), _mm_cmpgt_epi8(lo, right)));
+
+        // count >= 3  <=>  -count < -2
+        __m128i pass = _mm_or_si128(_mm_cmpgt_epi8(minus2, bright), _mm_cmpgt_epi8(minus2, dark));
+        unsigned mask = (unsigned)_mm_movemask_epi8(pass);
+        while (mask){
+            cand[n++] = x + simd_lowest_bit(mask);
+            mask &= mask - 1;
+        }
+    }
+    return n + fast_row_candidates_scalar(row, step, x, x1, T, cand + n);
+}
+
+/* Same as the SSE2 one but 32 pixels at a time */
+SIMD_TARGET_AVX2
+int fast_row_candidates_avx2(const uchar *row, size_t step, int x0, int x1, const FastThresholds &T, int *cand){
+    const __m256i vt = _mm256_set1_epi8((char)T.t);
+    const __m256i sign = _mm256_set1_epi8((char)0x80);
+    const __m256i minus2 = _mm256_set1_epi8(-2);
+    const ptrdiff_t s3 = 3 * (ptrdiff_t)step;
+
+    int n = 0;
+    int x = x0;
+    for (; x + 32 <= x1; x += 32){
+        const uchar *p = row + x;
+        __m256i c = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hi = _mm256_xor_si256(_mm256_adds_epu8(c, vt), sign);
+        __m256i lo = _mm256_xor_si256(_mm256_subs_epu8(c, vt), sign);
+
+        __m256i up = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p - s3)), sign);
+        __m256i down = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + s3)), sign);
+        __m256i left = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p - 3)), sign);
+        __m256i right = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p + 3)), sign);
+
+        __m256i bright = _mm256_add_epi8(_mm256_add_epi8(_mm256_cmpgt_epi8(up, hi), _mm256_cmpgt_epi8(down, hi)),
+                                         _mm256_add_epi8(_mm256_cmpgt_epi8(left, hi), _mm256_cmpgt_epi8(right, hi)));
+        __m256i dark = _mm256_add_epi8(_mm256_add_epi8(_mm256_cmpgt_epi8(lo, up), _mm256_cmpgt_epi8(lo, down)),
+                                       _mm256_add_epi8(_mm256_cmpgt_epi8(lo, left), _mm256_cmpgt_epi8(lo, right)));
+
+        __m256i pass = _mm256_or_si256(_mm256_cmpgt_epi8(minus2, bright), _mm256_cmpgt_epi8(minus2, dark));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(pass);
+        while (mask){
+            cand[n++] = x + simd_lowest_bit(mask);
+            mask &= mask - 1;
+        }
+    }
+    return n + fast_row_candidates_scalar(row, step, x, x1, T, cand + n);
+}
+#endif
+
+#ifdef SIMD_HAVE_NEON
+/* NEON does have unsigned comparisons, and a true comparison is 0xFF so >> 7 gives 1 to count with */
+int fast_row_candidates_neon(const uchar *row, size_t step, int x0, int x1, const FastThresholds &T, int *cand){
+    const uint8x16_t vt = vdupq_n_u8((uint8_t)T.t);
+    const uint8x16_t three = vdupq_n_u8(3);
+    const ptrdiff_t s3 = 3 * (ptrdiff_t)step;
+
+    int n = 0;
+    int x = x0;
+    for (; x + 16 <= x1; x += 16){
+        const uchar *p = row + x;
+        uint8x16_t c = vld1q_u8(p);
+        uint8x16_t hi = vqaddq_u8(c, vt);
+        uint8x16_t lo = vqsubq_u8(c, vt);
+
+        uint8x16_t up = vld1q_u8(p - s3), down = vld1q_u8(p + s3);
+        uint8x16_t left = vld1q_u8(p - 3), right = vld1q_u8(p + 3);
+
+        uint8x16_t bright = vaddq_u8(vaddq_u8(vshrq_n_u8(vcgtq_u8(up, hi), 7), vshrq_n_u8(vcgtq_u8(down, hi), 7)),
+                                     vaddq_u8(vshrq_n_u8(vcgtq_u8(left, hi), 7), vshrq_n_u8(vcgtq_u8(right, hi), 7)));
+        uint8x16_t dark = vaddq_u8(vaddq_u8(vshrq_n_u8(vcltq_u8(up, lo), 7), vshrq_n_u8(vcltq_u8(down, lo), 7)),
+                                   vaddq_u8(vshrq_n_u8(vcltq_u8(left, lo), 7), vshrq_n_u8(vcltq_u8(right, lo), 7)));
+
+        uint8x16_t pass = vorrq_u8(vcgeq_u8(bright, three), vcgeq_u8(dark, three));
+
+        // no movemask on NEON: skip the (very common) empty blocks and read the lanes otherwise
+        uint64x2_t pass64 = vreinterpretq_u64_u8(pass);
+        if ((vgetq_lane_u64(pass64, 0) | vgetq_lane_u64(pass64, 1)) == 0)
+            continue;
+        uchar lanes[16];
+        vst1q_u8(lanes, pass);
+        for (int i = 0; i < 16; i++)
+            if (lanes[i]) cand[n++] = x + i;
+    }
+    return n + fast_row_candidates_scalar(row, step, x, x1, T, cand + n);
+}
+#endif
+
+/* Turns AUTO into the best kernel for this CPU, and anything the CPU can't run into something it can */
+FAST_KERNEL fast_resolve_kernel(FAST_KERNEL kernel){
+#ifdef SIMD_HAVE_X86
+    bool avx2 = checkHardwareSupport(CV_CPU_AVX2);
+    bool sse2 = checkHardwareSupport(CV_CPU_SSE2);
+    if (kernel == FAST_KERNEL::AUTO) kernel = avx2 ? FAST_KERNEL::AVX2 : FAST_KERNEL::SSE2;
+    if (kernel == FAST_KERNEL::AVX2 && !avx2) kernel = FAST_KERNEL::SSE2;
+    if (kernel == FAST_KERNEL::SSE2 && !sse2) kernel = FAST_KERNEL::SCALAR;
+    if (kernel == FAST_KERNEL::NEON) kernel = FAST_KERNEL::SCALAR;
+#elif defined(SIMD_HAVE_NEON)
+    if (kernel == FAST_KERNEL::AUTO) kernel = FAST_KERNEL::NEON;
+    if (kernel == FAST_KERNEL::SSE2 || kernel == FAST_KERNEL::AVX2) kernel = FAST_KERNEL::SCALAR;
+#else
+    if (kernel != FAST_KERNEL::REFERENCE) kernel = FAST_KERNEL::SCALAR;
+#endif
+    return kernel;
+}
+
+FastRowKernel fast_row_kernel(FAST_KERNEL kernel, const FastThresholds &T){
+    // the vector kernels only know about a single offset t, see fast_thresholds_u8
+    if (!T.uniform) return fast_row_candidates_scalar;
+
+    switch (fast_resolve_kernel(kernel)){
+#ifdef SIMD_HAVE_X86
+        case FAST_KERNEL::AVX2: return fast_row_candidates_avx2;
+        case FAST_KERNEL::SSE2: return fast_row_candidates_sse2;
+#endif
+#ifdef SIMD_HAVE_NEON
+        case FAST_KERNEL::NEON: return fast_row_candidates_neon;
+#endif
+        default: return fast_row_candidates_scalar;
+    }
+}
+
+/*
+FAST on a CV_8U grayscale image, no float copy and no padded copy.
+The keypoints come out in the same (row major) order as the reference, including the 3 pixel border that
+the reference handles through its BORDER_REFLECT_101 padding. The rows are split in bands that run in
+parallel (see parallel_bands.h), the order and the keypoints don't depend on the number of threads.
+The keypoints go into result, perBand are the band buffers (at least one per band), both can be reused
+from frame to frame (frame_arena.h).
+*/
+void fast_detect_u8_into(const Mat &gray, const FastThresholds &T, FAST_KERNEL kernel, vector<KeyPoint> &result,
+                         vector<vector<KeyPoint>> &perBand, int bandRows = DETECT_BAND_ROWS){
+    CV_Assert(gray.type() == CV_8UC1);
+
+    FastRowKernel rowKernel = fast_row_kernel(kernel, T);
+    const size_t step = gray.step;
+
+    int circle[16];
+    for (int i = 0; i < 16; i++)
+        circle[i] = fast_circle_dy[i] * (int)step + fast_circle_dx[i];
+
+    /* Every band reads its 3 rows of neighbours straight from gray, so the bands don't need a copy with halo */
+    parallel_bands_collect_into(gray.rows, bandRows, [&](const Range &rows, vector<KeyPoint> &result){
+        // candidates of a row, kept by the (pool) thread from one band to the next
+        thread_local vector<int> cand;
+        if ((int)cand.size() < gray.cols) cand.resize(gray.cols);
+        int score = 0;
+
+        // the corner score goes in the response of the keypoint
+        for (int y = rows.start; y < rows.end; y++){
+            // rows (or whole images) that are too close to the border go through the reflecting path
+            if (y < 3 || y >= gray.rows - 3 || gray.cols < 7){
+                for (int x = 0; x < gray.cols; x++)
+                    if (fast_test_border_pixel_u8(gray, x, y, T, &score))
+                        result.push_back(KeyPoint(Point2f(x, y), 7.0f, -1, float(score)));
+                continue;
+            }
+
+            const uchar *row = gray.ptr<uchar>(y);
+            for (int x = 0; x < 3; x++)
+                if (fast_test_border_pixel_u8(gray, x, y, T, &score))
+                    result.push_back(KeyPoint(Point2f(x, y), 7.0f, -1, float(score)));
+
+            int n = rowKernel(row, step, 3, gray.cols - 3, T, cand.data());
+            for (int i = 0; i < n; i++){
+                int x = cand[i];
+                if (fast_test_interior_pixel_u8(row + x, circle, T, &score))
+                    result.push_back(KeyPoint(Point2f(x, y), 7.0f, -1, float(score)));
+            }
+
+            for (int x = gray.cols - 3; x < gray.cols; x++)
+                if (fast_test_border_pixel_u8(gray, x, y, T, &score))
+                    result.push_back(KeyPoint(Point2f(x, y), 7.0f, -1, float(score)));
+        }
+    }, perBand, result);
+}
+
+/* threshold in [0, 1] intensity units, turned into the same 8-bit bounds as the float reference */
+void fast_detect_u8_into(const Mat &gray, float threshold, FAST_KERNEL kernel, vector<KeyPoint> &result,
+                         vector<vector<KeyPoint>> &perBand, int bandRows = DETECT_BAND_ROWS){
+    fast_detect_u8_into(gray, fast_thresholds_u8(threshold), kernel, result, perBand, bandRows);
+}
+
+vector<KeyPoint> fast_detect_u8(const Mat &gray, float threshold, FAST_KERNEL kernel, int bandRows = DETECT_BAND_ROWS){
+    vector<KeyPoint> result;
+    vector<vector<KeyPoint>> perBand(band_count(gray.rows, bandRows));
+    fast_detect_u8_into(gray, threshold, kernel, result, perBand, bandRows);
+    return result;
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef FEATURE_SET_H
+#define FEATURE_SET_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <cmath>
+#include <cfloat>
+
+using namespace cv;
+using namespace std;
+
+/*
+The features of one image as a structure of arrays.
+A KeyPoint is 28 bytes (pt, size, angle, response, octave, class_id) and our detectors only fill the
+position and the response: the size is 7 pixels for all of them and the rest is never read. The stages
+that go over all of them (RANSAC taking the points of the matches, moving keypoints into the panorama)
+were loading a whole KeyPoint for the 8 bytes they wanted. A FeatureSet keeps:
+- x[], y[]: positions in full resolution pixels, contiguous, so 8 of them are one AVX2 load
+- score[]: the detector response (FAST corner score, or whatever the detector puts in KeyPoint::response)
+- diameter: KeyPoint::size, one for the whole set
+- descriptors: one row per feature; OpenCV allocates Mats 64-byte aligned and a SIFT row is 512 bytes,
+  so every row starts on a cache line
+- norm: how the descriptors are compared, NORM_L2 (SIFT) or NORM_HAMMING (binary, brief_descriptor.h);
+  the matchers take it from here
+That is 12 bytes per keypoint instead of 28 (descriptors apart).
+KeyPoints only exist where OpenCV wants them (SIFT, drawing): from_keypoints / to_keypoints.
+*/
+struct FeatureSet{
+    vector<float> x, y, score;
+    float diameter = 7.0f;
+    Mat descriptors;
+    int norm = NORM_L2;
+
+    int count() const { return (int)x.size(); }
+    bool empty() const { return x.empty(); }
+    Point2f pt(int i) const { return Point2f(x[i], y[i]); }
+
+    void clear(){
+        x.clear();
+        y.clear();
+        score.clear();
+        descriptors.release();
+    }
+
+    void reserve(size_t n){
+        x.reserve(n);
+        y.reserve(n);
+        score.reserve(n);
+    }
+
+    void push(float px, float py, float s){
+        x.push_back(px);
+        y.push_back(py);
+        score.push_back(s);
+    }
+
+    /* memory held, descriptors included */
+    size_t bytes() const{
+        return (x.capacity() + y.capacity() + score.capacity()) * sizeof(float) + descriptors.total() * descriptors.elemSize();
+    }
+};
+
+/* positions and responses of kps (the descriptors, if any, are left alone) */
+void from_keypoints(const vector<KeyPoint> &kps, FeatureSet &f){
+    const size_t n = kps.size();
+    f.x.resize(n);
+    f.y.resize(n);
+    f.score.resize(n);
+    for (size_t i = 0; i < n; i++){
+        f.x[i] = kps[i].pt.x;
+        f.y[i] = kps[i].pt.y;
+        f.score[i] = kps[i].response;
+    }
+    if (n) f.diameter = kps[0].size;
+}
+
+void to_keypoints(const FeatureSet &f, vector<KeyPoint> &kps){
+    kps.resize(f.count());
+    for (int i = 0; i < f.count(); i++)
+        kps[i] = KeyPoint(Point2f(f.x[i], f.y[i]), f.diameter, -1, f.score[i]);
+}
+
+vector<KeyPoint> to_keypoints(const FeatureSet &f){
+    vector<KeyPoint> kps;
+    to_keypoints(f, kps);
+    return kps;
+}
+
+/* features found on a pyramid level, in full resolution coordinates (and diameter) */
+void scale_features(FeatureSet &f, float s){
+    if (s == 1.0f) return;
+    for (int i = 0; i < f.count(); i++){
+        f.x[i] *= s;
+        f.y[i] *= s;
+    }
+    f.diameter *= s;
+}
+
+/* every position moved by H (3x3), in double like perspectiveTransform (a point at infinity goes to 0, 0) */
+void transform_features(FeatureSet &f, const Mat &H){
+    Mat M;
+    H.convertTo(M, CV_64F);
+    const double *m = M.ptr<double>();
+    float *x = f.x.data(), *y = f.y.data();
+    for (int i = 0; i < f.count(); i++){
+        double w = m[6] * x[i] + m[7] * y[i] + m[8];
+        w = std::fabs(w) > FLT_EPSILON ? 1.0 / w : 0.0;
+        double u = (m[0] * x[i] + m[1] * y[i] + m[2]) * w;
+        double v = (m[3] * x[i] + m[4] * y[i] + m[5]) * w;
+        x[i] = float(u);
+        y[i] = float(v);
+    }
+}
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef FEATURE_STORE_H
+#define FEATURE_STORE_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <map>
+#include "fast_detector.h"
+#include "fastR_detector.h"
+#include "sift_extractor.h"
+#include "brief_descriptor.h"
+#include "image_pyramid.h"
+#include "feature_set.h"
+
+using namespace cv;
+using namespace std;
+
+/* Keypoints (SoA, see feature_set.h) + descriptors (SIFT or BRIEF) of one source image */
+struct ImageFeatures : FeatureSet{
+    Size size;       // size of the image they come from
+    int level = 0;   // pyramid level they were detected and described on (positions are in full resolution coordinates)
+};
+
+/* SIFT: 128 floats, L2. BRIEF: 256 bits, Hamming (brief_descriptor.h), much cheaper and less distinctive */
+enum class DESCRIPTOR {
+    SIFT,
+    BRIEF
+};
+
+/*
+The stitcher keeps the strongest FAST keypoints of every image, spread over a grid of cells so a textured
+corner of the frame can't take all of them: a busy or large frame has tens of thousands after the
+non-maximum suppression, and matching costs the product of the two counts. 0 = no cap.
+*/
+const int STITCH_MAX_KEYPOINTS = 2000;
+
+FastParameters capped_fast_parameters(int maxKeypoints = STITCH_MAX_KEYPOINTS){
+    FastParameters F;
+    F.maxKeypoints = maxKeypoints;
+    F.gridCols = 8;
+    F.gridRows = 6;
+    return F;
+}
+
+/* FASTR scores the capped FAST keypoints with Harris and keeps its fraction of them */
+FastRParameters capped_fastR_parameters(int maxKeypoints = STITCH_MAX_KEYPOINTS){
+    FastRParameters R;
+    R.fast = capped_fast_parameters(maxKeypoints);
+    return R;
+}
+
+struct FeatureStoreParameters{
+    bool useFastR = false;     // FASTR instead of FAST
+    FastParameters fast = capped_fast_parameters();    // used when useFastR is false
+    FastRParameters fastR = capped_fastR_parameters(); // used when useFastR is true
+    long maxProxyPixels = 0;   // detect and describe on the first pyramid level this small (0 = full resolution)
+    DESCRIPTOR descriptor = DESCRIPTOR::SIFT;
+    BriefParameters brief;     // used when descriptor is BRIEF
+};
+
+/* cap of both detectors (0 = keep every keypoint) */
+void set_max_keypoints(FeatureStoreParameters &P, int maxKeypoints){
+    P.fast.maxKeypoints = P.fastR.fast.maxKeypoints = std::max(maxKeypoints, 0);
+}
+
+/*
+Features of every source image, computed the first time an image ID is asked for and kept after that.
+When a panorama is built image by image, each image is detected and described exactly once (on the
+original image, which is also a better source of features than the warped canvas), and to put them in
+the panorama we just move the keypoints with the homography of that image (mapped_features).
+The store itself isn't thread safe: threads can compute() at the same time but insert / at need a lock.
+*/
+class FeatureStore{
+public:
+    explicit FeatureStore(const FeatureStoreParameters &P = {}) : P(P){}
+
+    /* features of image `id`, computing them from `image` only if they are not stored yet */
+    const ImageFeatures &get(int id, const Mat &image){
+        auto it = features.find(id);
+        if (it != features.end()) return it->second;
+        return insert(id, compute(image, P));
+    }
+
+    /* the features of one image, without storing them (so several threads can compute at once) */
+    static ImageFeatures compute(const Mat &image, const FeatureStoreParameters &P){
+        TRACE_SCOPE("features");
+        ImageFeatures f;
+        f.size = image.size();
+        f.level = proxy_level(image.size(), P.maxProxyPixels);
+
+        // one gray pyramid shared by the detector and the descriptor, the full resolution image isn't touched otherwise
+        ImagePyramid pyramid = build_pyramid(image, f.level);
+        const Mat &proxy = pyramid.levels[f.level];
+        // the detector works in the thread's arena, KeyPoints only live there (SIFT wants them),
+        // what is kept is the SoA positions + the descriptors
+        FrameArena &arena = frame_arena();
+        vector<KeyPoint> &kps = arena.vec<KeyPoint>(ARENA_FEATURE_KEYPOINTS);
+        if (P.useFastR) my_fastR_detector_into(proxy, P.fastR, kps, arena);
+        else my_fast_detector_into(proxy, P.fast, kps, arena);
+        if (P.descriptor == DESCRIPTOR::BRIEF){
+            from_keypoints(kps, f);
+            brief_describe_into(proxy, f, f.descriptors, P.brief, arena);
+        }
+        else {
+            sift_extractor().compute(proxy, kps, f.descriptors);
+            from_keypoints(kps, f);
+        }
+        scale_features(f, ImagePyramid::scale(f.level));
+        TRACE_BYTES(f.descriptors);
+        return f;
+    }
+
+    /* stores features computed elsewhere (replaces what was there) */
+    const ImageFeatures &insert(int id, ImageFeatures f){
+        ImageFeatures &slot = features[id];
+        slot = std::move(f);
+        return slot;
+    }
+
+    const FeatureStoreParameters &parameters() const { return P; }
+
+    bool contains(int id) const { return features.count(id) > 0; }
+    const ImageFeatures &at(int id) const { return features.at(id); }
+    void erase(int id) { features.erase(id); }
+    void clear() { features.clear(); }
+    size_t size() const { return features.size(); }
+
+    /* features of image `id` moved by H (3x3, image -> panorama), the descriptors are shared, not copied */
+    FeatureSet mapped_features(int id, const Mat &H) const{
+        FeatureSet result = features.at(id);
+        transform_features(result, H);
+        return result;
+    }
+
+private:
+    FeatureStoreParameters P;
+    map<int, ImageFeatures> features;
+};
+
+#endif
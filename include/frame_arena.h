@@ -0,0 +1,233 @@
+#ifndef FRAME_ARENA_H
+#define FRAME_ARENA_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <typeindex>
+#include "trace.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+Scratch memory that survives from one frame (and one job) to the next.
+Every detection / matching call used to allocate its keypoint vectors, its per band vectors, its
+match tables and its temporary Mats, and free them on return; under a batch of jobs that churn shows up
+in profiles and fragments the heap. A FrameArena owns those buffers instead: a function asks for its
+slot (an ARENA_SLOT number + a type), gets the buffer it had last time, emptied but with its memory,
+and once the buffers have grown to the size of the frames nothing is allocated any more.
+
+- vec<T>(slot): an empty vector<T> that keeps its capacity
+- bands<T>(slot, n): n empty vectors (one per band of parallel_bands.h)
+- mat(slot, size, type): a Mat of that size and type over a buffer that only grows
+- get<T>(slot): any object, constructed the first time and then left as it is
+
+An arena belongs to one thread: the slots are taken before a parallel_for_ and the bands write into
+the buffers they are given. frame_arena() is the arena of the calling thread: the one it leased from
+the ArenaPool (ArenaLease, the stage workers of a job do that) or else a thread_local one.
+Between jobs a leased arena is reset (emptied, memory kept) and goes back to the pool for the next one.
+*/
+
+/* One slot per buffer of each user; two users that can be active at the same time need different slots */
+enum ARENA_SLOT {
+    ARENA_FAST_GRAY,
+    ARENA_FAST_BANDS,
+    ARENA_FAST_ALL,
+    ARENA_FASTR_GRAY,
+    ARENA_FASTR_FAST,
+    ARENA_FASTR_SCORE,
+    ARENA_FASTR_SORTED,
+    ARENA_HARRIS,
+    ARENA_FEATURE_KEYPOINTS,
+    ARENA_MATCH_QUERY,
+    ARENA_MATCH_TRAIN,
+    ARENA_MATCH_BEST1,
+    ARENA_MATCH_BEST2,
+    ARENA_MATCH_INDEX,
+    ARENA_MATCH_KNN,
+    ARENA_PAIR_MATCHES,
+    ARENA_RANSAC_POINTS,
+    ARENA_RANSAC_QUALITY,
+    ARENA_GUIDED_PREDICTED,
+    ARENA_GUIDED_CELLS,
+    ARENA_GUIDED_FILL,
+    ARENA_GUIDED_ORDER,
+    ARENA_GUIDED_QUERY,
+    ARENA_GUIDED_TRAIN,
+    ARENA_GUIDED_BEST1,
+    ARENA_GUIDED_BEST2,
+    ARENA_GUIDED_INDEX,
+    ARENA_GUIDED_SEEDS,
+    ARENA_GUIDED_SEED_DESCRIPTORS,
+    ARENA_GUIDED_SEED_MATCHES,
+    ARENA_BRIEF_GRAY,
+    ARENA_BRIEF_PADDED,
+    ARENA_BRIEF_SMOOTH,
+    ARENA_BRIEF_OFFSETS,
+    ARENA_BRIEF_FEATURES
+};
+
+/* what "empty it but keep the memory" means for each kind of buffer (nothing, for anything else) */
+template <typename T> void arena_clear(T &){}
+template <typename T> void arena_clear(vector<T> &v){ v.clear(); }
+template <typename T> void arena_clear(vector<vector<T>> &v){ for (auto &inner : v) inner.clear(); }
+
+template <typename T> size_t arena_bytes(const T &){ return sizeof(T); }
+template <typename T> size_t arena_bytes(const vector<T> &v){ return v.capacity() * sizeof(T); }
+template <typename T> size_t arena_bytes(const vector<vector<T>> &v){
+    size_t b = v.capacity() * sizeof(vector<T>);
+    for (const auto &inner : v) b += inner.capacity() * sizeof(T);
+    return b;
+}
+inline size_t arena_bytes(const Mat &m){ return m.total() * m.elemSize(); }
+
+class FrameArena{
+public:
+    /* the slot's object, default constructed the first time */
+    template <typename T>
+    T &get(int slot){
+        auto key = make_pair(type_index(typeid(T)), slot);
+        auto it = slots.find(key);
+        if (it == slots.end()) it = slots.emplace(key, unique_ptr<Holder>(new TypedHolder<T>())).first;
+        return static_cast<TypedHolder<T> *>(it->second.get())->value;
+    }
+
+    template <typename T>
+    vector<T> &vec(int slot){
+        vector<T> &v = get<vector<T>>(slot);
+        v.clear();
+        return v;
+    }
+
+    template <typename T>
+    vector<vector<T>> &bands(int slot, int n){
+        vector<vector<T>> &b = get<vector<vector<T>>>(slot);
+        if ((int)b.size() < n) b.resize(n);
+        for (int i = 0; i < n; i++) b[i].clear();
+        return b;
+    }
+
+    /* a size x type view of the slot's buffer, which is only reallocated when it is too small */
+    Mat mat(int slot, Size size, int type){
+        Mat &backing = get<Mat>(slot);
+        size_t need = (size_t)size.area() * CV_ELEM_SIZE(type);
+        if (backing.empty() || backing.total() * backing.elemSize() < need){
+            backing.create(1, (int)std::max<size_t>(need, 1), CV_8U);
+            growths++;
+            TRACE_BYTES(backing);
+        }
+        return Mat(size, type, backing.data);
+    }
+
+    /* empties every buffer, keeps the memory */
+    void reset(){
+        for (auto &s : slots) s.second->clear();
+    }
+
+    /* gives the memory back too */
+    void release(){
+        slots.clear();
+    }
+
+    size_t reserved() const{
+        size_t b = 0;
+        for (const auto &s : slots) b += s.second->bytes();
+        return b;
+    }
+
+    long matGrowths() const { return growths; }
+
+private:
+    struct Holder{
+        virtual ~Holder(){}
+        virtual void clear() = 0;
+        virtual size_t bytes() const = 0;
+    };
+
+    template <typename T>
+    struct TypedHolder : Holder{
+        T value;
+        void clear() override { arena_clear(value); }
+        size_t bytes() const override { return arena_bytes(value); }
+    };
+
+    map<pair<type_index, int>, unique_ptr<Holder>> slots;
+    long growths = 0;
+};
+
+/* Arenas that are not in use, handed to the workers of the next job (thread safe) */
+class ArenaPool{
+public:
+    FrameArena *take(){
+        lock_guard<mutex> lock(m);
+        if (idle.empty()){
+            all.emplace_back(new FrameArena());
+            return all.back().get();
+        }
+        FrameArena *a = idle.back();
+        idle.pop_back();
+        return a;
+    }
+
+    void give(FrameArena *a){
+        a->reset();
+        lock_guard<mutex> lock(m);
+        idle.push_back(a);
+    }
+
+    size_t size() const{
+        lock_guard<mutex> lock(m);
+        return all.size();
+    }
+
+private:
+    mutable mutex m;
+    vector<unique_ptr<FrameArena>> all;
+    vector<FrameArena *> idle;
+};
+
+ArenaPool &arena_pool(){
+    static ArenaPool pool;
+    return pool;
+}
+
+FrameArena *&leased_arena(){
+    thread_local FrameArena *arena = nullptr;
+    return arena;
+}
+
+/* the arena of the calling thread */
+FrameArena &frame_arena(){
+    if (leased_arena()) return *leased_arena();
+    thread_local FrameArena own;
+    return own;
+}
+
+/* While it lives, frame_arena() on this thread is an arena taken from the pool */
+class ArenaLease{
+public:
+    explicit ArenaLease(ArenaPool &pool = arena_pool()) : pool(pool), arena(pool.take()), previous(leased_arena()){
+        leased_arena() = arena;
+    }
+
+    ~ArenaLease(){
+        TRACE_COUNT("arena_reserved_bytes", arena->reserved());
+        leased_arena() = previous;
+        pool.give(arena);
+    }
+
+    ArenaLease(const ArenaLease &) = delete;
+    ArenaLease &operator=(const ArenaLease &) = delete;
+
+    FrameArena &get(){ return *arena; }
+
+private:
+    ArenaPool &pool;
+    FrameArena *arena;
+    FrameArena *previous;
+};
+
+#endif
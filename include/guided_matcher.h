@@ -0,0 +1,155 @@
+#ifndef GUIDED_MATCHER_H
+#define GUIDED_MATCHER_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <atomic>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include "descriptor_matcher.h"
+#include "feature_set.h"
+#include "frame_arena.h"
+#include "trace.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+Guided matching: matching when we already have an idea of the homography of the pair.
+Two frames of a sequence only overlap on a strip, and a keypoint of A can only have its real match in B
+near where the homography sends it, but ratio_match compares every descriptor of A with every one of B
+(O(N*M)). With a prior H (B -> A):
+- the keypoints of B go into a grid of radius x radius cells (a counting sort: one index array ordered
+  by cell, no vector per cell)
+- every keypoint of A is moved into B with H^-1 and only compared with the keypoints of B that are less
+  than radius pixels from there (in the 3x3 cells around it at most): ~k distances instead of M
+- keypoints of A that land outside B (+ radius) are not compared at all, they are outside the overlap
+The ratio test is the usual one, on the 2 nearest candidates of the neighbourhood (a keypoint with a
+single candidate is dropped, there is nothing to compare it with). Far away repeated textures can't be
+picked anymore either, so fewer wrong matches go into RANSAC.
+
+Where the prior comes from, and what happens when it is wrong, is in matchAndEstimateHomography
+(ransac.h): a supplied prior, the motion of the previous pair of a sequence, or a sparse pass that
+matches only the strongest keypoints of A globally; the guided matches have to verify it (enough of
+them, enough RANSAC inliers), otherwise the pair is matched globally as before.
+*/
+
+struct GuidedMatchParameters{
+    bool enabled = false;        // false = global matching (ratio_match) for every pair
+    float radius = 40.0f;        // search radius around the predicted position, in pixels of B
+    int seedKeypoints = 400;     // no prior given: match this many of the strongest keypoints of A globally to get one (0 = don't)
+    int minMatches = 20;         // the prior is kept if the guided pass gives at least this many matches...
+    double minInlierRatio = 0.3; // ...and at least this fraction of them are RANSAC inliers
+};
+
+struct GuidedMatchReport{
+    bool guided = false;   // the homography comes from the guided matches
+    bool seeded = false;   // the prior came from the sparse pass
+    bool fellBack = false; // there was a prior but it didn't verify, the pair was matched globally
+    long comparisons = 0;  // descriptor distances of the guided pass (a global pass does N * M)
+    int matches = 0;       // matches the homography was estimated from
+    int inliers = 0;
+};
+
+/*
+Ratio test matches from A (query) to B (train), each keypoint of A only compared with the keypoints of
+B within radius of H_BtoA^-1 * (x, y). The descriptors are packed like BlockedRatioMatcher does (8 bit
+when lossless) and compared with A's norm (L2, or Hamming for binary ones); the grid and the tables come
+from the arena.
+*/
+void guided_ratio_match_into(const FeatureSet &A, const FeatureSet &B, const Mat &H_BtoA, float ratio, float radius,
+                             vector<DMatch> &good, FrameArena &arena = frame_arena(), long *comparisons = nullptr){
+    TRACE_SCOPE("guided_match");
+    good.clear();
+    if (comparisons) *comparisons = 0;
+    if (A.empty() || B.count() < 2 || A.descriptors.empty() || B.descriptors.empty() || H_BtoA.empty()) return;
+    CV_Assert(A.descriptors.rows == A.count() && B.descriptors.rows == B.count());
+    CV_Assert(A.descriptors.cols == B.descriptors.cols && A.norm == B.norm);
+
+    // where every keypoint of A should be in B
+    FeatureSet &predicted = arena.get<FeatureSet>(ARENA_GUIDED_PREDICTED);
+    predicted.x.assign(A.x.begin(), A.x.end());
+    predicted.y.assign(A.y.begin(), A.y.end());
+    transform_features(predicted, H_BtoA.inv());
+
+    // grid over the keypoints of B: order[start[c] .. start[c + 1]) are the keypoints of cell c
+    radius = std::max(radius, 1.0f);
+    float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+    for (int j = 0; j < B.count(); j++){
+        minX = std::min(minX, B.x[j]); maxX = std::max(maxX, B.x[j]);
+        minY = std::min(minY, B.y[j]); maxY = std::max(maxY, B.y[j]);
+    }
+    const int cols = int((maxX - minX) / radius) + 1, rows = int((maxY - minY) / radius) + 1;
+    auto cell_of = [&](int j){ return int((B.y[j] - minY) / radius) * cols + int((B.x[j] - minX) / radius); };
+
+    vector<int> &start = arena.vec<int>(ARENA_GUIDED_CELLS);
+    vector<int> &fill = arena.vec<int>(ARENA_GUIDED_FILL);
+    vector<int> &order = arena.vec<int>(ARENA_GUIDED_ORDER);
+    start.assign((size_t)cols * rows + 1, 0);
+    order.resize(B.count());
+    for (int j = 0; j < B.count(); j++) start[cell_of(j) + 1]++;
+    for (size_t c = 1; c < start.size(); c++) start[c] += start[c - 1];
+    fill.assign(start.begin(), start.end() - 1);
+    for (int j = 0; j < B.count(); j++) order[fill[cell_of(j)]++] = j;
+
+    const DescriptorDistance distance(A.norm);
+    bool q = distance.hamming || (descriptors_fit_u8(A.descriptors) && descriptors_fit_u8(B.descriptors));
+    PackedDescriptors &pa = arena.get<PackedDescriptors>(ARENA_GUIDED_QUERY);
+    PackedDescriptors &pb = arena.get<PackedDescriptors>(ARENA_GUIDED_TRAIN);
+    pack_descriptors_into(A.descriptors, q, pa);
+    pack_descriptors_into(B.descriptors, q, pb);
+
+    vector<float> &best1 = arena.vec<float>(ARENA_GUIDED_BEST1), &best2 = arena.vec<float>(ARENA_GUIDED_BEST2);
+    vector<int> &idx1 = arena.vec<int>(ARENA_GUIDED_INDEX);
+    best1.assign(A.count(), FLT_MAX);
+    best2.assign(A.count(), FLT_MAX);
+    idx1.assign(A.count(), -1);
+    const float r2 = radius * radius;
+    atomic<long> compared(0);
+
+    parallel_for_(Range(0, A.count()), [&](const Range &r){
+        long local = 0;
+        for (int i = r.start; i < r.end; i++){
+            const float px = predicted.x[i], py = predicted.y[i];
+            if (!(px >= minX - radius && px <= maxX + radius && py >= minY - radius && py <= maxY + radius)) continue;
+
+            const int cx0 = std::max(int(std::floor((px - radius - minX) / radius)), 0);
+            const int cx1 = std::min(int(std::floor((px + radius - minX) / radius)), cols - 1);
+            const int cy0 = std::max(int(std::floor((py - radius - minY) / radius)), 0);
+            const int cy1 = std::min(int(std::floor((py + radius - minY) / radius)), rows - 1);
+
+            float b1 = FLT_MAX, b2 = FLT_MAX;
+            int id = -1;
+            for (int cy = cy0; cy <= cy1; cy++){
+                for (int cx = cx0; cx <= cx1; cx++){
+                    const int c = cy * cols + cx;
+                    for (int k = start[c]; k < start[c + 1]; k++){
+                        const int j = order[k];
+                        const float dx = B.x[j] - px, dy = B.y[j] - py;
+                        if (dx * dx + dy * dy > r2) continue;
+                        const float d = distance(pa, pb, i, j);
+                        local++;
+                        // ties keep the smaller index, like a scan of B in order would
+                        if (d < b1 || (d == b1 && j < id)){ b2 = b1; b1 = d; id = j; }
+                        else if (d < b2) b2 = d;
+                    }
+                }
+            }
+            best1[i] = b1;
+            best2[i] = b2;
+            idx1[i] = id;
+        }
+        compared += local;
+    });
+
+    for (int i = 0; i < A.count(); i++){
+        if (idx1[i] < 0 || best2[i] == FLT_MAX) continue;
+        float d1 = distance.value(best1[i]), d2 = distance.value(best2[i]);
+        if (passes_ratio(d1, d2, ratio)) good.push_back(DMatch(i, idx1[i], d1));
+    }
+    if (comparisons) *comparisons = compared;
+    TRACE_COUNT("guided_comparisons", compared.load());
+}
+
+#endif
@@ -4,6 +4,10 @@
 #include <iostream>
 #include <opencv2/opencv.hpp>
 #include <vector>
+#include <algorithm>
+#include "parallel_bands.h"
+#include "harris_fused.h"
+#include "trace.h"
 
 using namespace std;
 using namespace cv;
@@ -13,13 +17,19 @@ using namespace cv;
 - Smooth the second moments with a Gaussian
 - Compute the harris score
 - Keep the local maxima of R above the threshold
+
+The image is processed in bands of rows (in parallel). Sobel looks 1 row away and the 5x5 Gaussian 2 more,
+so every band is computed with 3 extra rows above and below, and only its own rows are kept.
 */
-Mat my_harris_corner_detector(Mat input){
+const int HARRIS_HALO_ROWS = 3;
+
+/* Raw (not normalized) Harris response of the rows in `rows`, image is already CV_32F */
+Mat harris_response_band(const Mat &image, const Range &rows){
+    Range halo = band_with_halo(rows, HARRIS_HALO_ROWS, image.rows);
+    Mat band = image.rowRange(halo.start, halo.end);
+
     /* To compute the gradient, I will use the sobel kernel */
     //Start creating the sobel Kernels
-    
-    Mat image = input;
-    image.convertTo(image, CV_32F, 1.0/255.0);
 
     // open cv implemented the oveload operator that is why it works here
     Mat sobelX = (Mat_<float>(3, 3) <<
@@ -33,8 +43,8 @@ Mat my_harris_corner_detector(Mat input){
 
     // desired depth = desired data type, anchor point: Point(-1, -1) is "use the center automatically", 
     // BORDER_DEFAULT reflects the border without repeating edge pixels in case there are not enough parameters to do our calculation (like in the left, right corner)
-    filter2D(image, Ix, CV_32F, sobelX, Point(-1, -1), 0, BORDER_DEFAULT);
-    filter2D(image, Iy, CV_32F, sobelY, Point(-1, -1), 0, BORDER_DEFAULT);
+    filter2D(band, Ix, CV_32F, sobelX, Point(-1, -1), 0, BORDER_DEFAULT);
+    filter2D(band, Iy, CV_32F, sobelY, Point(-1, -1), 0, BORDER_DEFAULT);
 
     // Now we have to build second moments (for later in harris corner)
     // And we also build our general gradient matrix Ixy (mul performs dot product)
@@ -96,18 +106,74 @@ Mat my_harris_corner_detector(Mat input){
     // spreading from the middle out, which means that all the sourroundings are different than it
     Mat R = detM - k * traceM.mul(traceM);
 
-    // After computing R, the resulting values in R can vary a lot because these are not bounded, hence we should normalize it
-    double rmin, rmax;
-    minMaxLoc(R, &rmin, &rmax);
-    if (rmax > rmin) {
-        /* So what we do here is subtract rmin to everything so that the minimum value is 0, then we
-        divide it by rmax - rmin to normalize it */
-        R = (R - float(rmin)) / float(rmax - rmin);
-    }
-    else {
-        R.setTo(0);
+    // drop the halo rows
+    return R.rowRange(rows.start - halo.start, rows.end - halo.start);
+}
+
+/* Normalizes R to [0, 1] in place, band by band (rmin/rmax are the min and max of the whole R) */
+void harris_normalize(Mat &R, double rmin, double rmax, int bandRows = DETECT_BAND_ROWS){
+    parallel_bands_for(R.rows, bandRows, [&](int, const Range &rows){
+        Mat Rb = R.rowRange(rows.start, rows.end);
+        if (rmax > rmin) {
+            /* So what we do here is subtract rmin to everything so that the minimum value is 0, then we
+            divide it by rmax - rmin to normalize it */
+            Mat normalized = (Rb - float(rmin)) / float(rmax - rmin);
+            normalized.copyTo(Rb);
+        }
+        else {
+            Rb.setTo(0);
+        }
+    });
+}
+
+/*
+Original version with the full frame matrices (Ix, Iy, Ix2, ... R), kept as the reference for the fused one.
+*/
+Mat my_harris_corner_detector_reference(Mat input, int bandRows = DETECT_BAND_ROWS){
+    Mat image;
+    input.convertTo(image, CV_32F, 1.0/255.0);
+
+    Mat R(image.size(), CV_32F);
+    int nBands = band_count(image.rows, bandRows);
+    vector<double> bandMin(nBands, 0), bandMax(nBands, 0);
+
+    parallel_bands_for(image.rows, bandRows, [&](int i, const Range &rows){
+        Mat Rb = harris_response_band(image, rows);
+        Rb.copyTo(R.rowRange(rows.start, rows.end));
+        minMaxLoc(Rb, &bandMin[i], &bandMax[i]);
+    });
+
+    // After computing R, the resulting values in R can vary a lot, hence we should normalize it
+    // (the min and max of the whole image are just the min and max of the bands)
+    double rmin = 0, rmax = 0;
+    if (nBands > 0){
+        rmin = *min_element(bandMin.begin(), bandMin.end());
+        rmax = *max_element(bandMax.begin(), bandMax.end());
     }
+    harris_normalize(R, rmin, rmax, bandRows);
+
+    return R;
+}
+
+/*
+Normalized Harris response of the image, through the fused kernel in harris_fused.h:
+the only full frame buffer is R itself (the reference keeps about a dozen of them).
+The min and max come from the tiles, so the normalization is just one more pass over R.
+8-bit images are never converted to float: the gradients and the smoothing are integer (fixed point,
+see harris_fused.h) unless precision says FLOAT.
+*/
+void my_harris_corner_detector_into(const Mat &input, Mat &R, int bandRows = DETECT_BAND_ROWS,
+                                    HARRIS_PRECISION precision = HARRIS_PRECISION::FIXED_POINT){
+    TRACE_SCOPE("harris_response");
+    double rmin = 0, rmax = 0;
+    harris_response_fused_into(input, R, 1.0f / 255.0f, HARRIS_K, &rmin, &rmax, bandRows, HARRIS_TILE_COLS, precision);
+    harris_normalize(R, rmin, rmax, bandRows);
+}
 
+Mat my_harris_corner_detector(Mat input, int bandRows = DETECT_BAND_ROWS,
+                              HARRIS_PRECISION precision = HARRIS_PRECISION::FIXED_POINT){
+    Mat R;
+    my_harris_corner_detector_into(input, R, bandRows, precision);
     return R;
 }
 
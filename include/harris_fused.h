@@ -0,0 +1,439 @@
+#ifndef HARRIS_FUSED_H
+#define HARRIS_FUSED_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+#include "parallel_bands.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+Fused Harris response: the same math as harris_response_band (Sobel -> products -> 5x5 Gaussian ->
+det - k * trace^2) but done in one streaming pass, without any of the full frame temporaries.
+
+The image is split in tiles (a band of rows x a block of columns) so the working set stays in cache.
+For every row of products we only keep the result after the horizontal Gaussian, in a ring of 5 rows
+(the height of the Gaussian), and the vertical Gaussian + the response are computed as soon as the
+5 rows are there. The only full frame buffer is the output.
+
+Borders are BORDER_REFLECT_101 (= BORDER_DEFAULT) on the whole image, like the reference.
+The numbers are not bit-identical to the reference (the sums are done in a different order) but the
+difference is float rounding.
+
+On 8-bit images the default is a fixed point version of the same pass (HARRIS_PRECISION::FIXED_POINT):
+converting to float at 1/255 reads 4 bytes per pixel where the image has 1, and a float lane is twice
+as wide as an int16 one. Instead:
+- Sobel on the 8-bit pixels, in int16: |gx|, |gy| <= 4 * 255 = 1020
+- the products gx * gx, gy * gy, gx * gy in int32: |p| <= 1020^2 < 2^20
+- the Gaussian weights in Q10 (the float weights * 1024, rounded, the centre one adjusted so they add up
+  to 1024): 1020^2 * 1024 < 2^31 is as many fractional bits as int32 can take
+- horizontal pass: 5 products * Q10 weights < 2^31, rounded back to Sobel^2 units (>> 10)
+- vertical pass: 5 of those * Q10 weights < 2^31, kept in Q10: S = Sobel^2 * 1024, still int32
+- det and trace^2 of S in int64 (< 2^62), R = det - k * trace^2 converted once, times (scale^2 / 1024)^2,
+  so R is in the same units as the float path (intensities * scale, 1/255 by default) and every threshold
+  on it stays the same
+The only differences with the float path are the Q10 weights (each within 0.5 / 1024 of the float one)
+and the rounding of the horizontal pass: on the S* images the responses agree to a fraction of a percent
+of their range and the FASTR keypoints kept are the same but for the odd one right at the cut. FLOAT is still there (and is
+what CV_32F images always use).
+*/
+
+const int HARRIS_TILE_COLS = 256;
+const float HARRIS_K = 0.05f;
+const int HARRIS_FIXED_BITS = 10; // fractional bits of the fixed point Gaussian weights and of S
+
+enum class HARRIS_PRECISION {
+    FIXED_POINT, // int16 gradients, int32 products and smoothing (8-bit images only)
+    FLOAT        // everything in float, like the reference
+};
+
+/* reflect101 only when we are actually outside, the function call is too slow for every pixel */
+inline int harris_reflect(int i, int n){
+    if ((unsigned)i < (unsigned)n) return i;
+    return borderInterpolate(i, n, BORDER_REFLECT_101);
+}
+
+/* The 5 weights of the separable Gaussian (5x5, sigma 1, same as GaussianBlur in the reference), computed once */
+void harris_gaussian_weights(float *g){
+    static const vector<float> weights = []{
+        Mat kernel = getGaussianKernel(5, 1.0, CV_32F);
+        return vector<float>(kernel.ptr<float>(), kernel.ptr<float>() + 5);
+    }();
+    std::copy(weights.begin(), weights.end(), g);
+}
+
+/* The same weights in fixed point: they add up to exactly 2^HARRIS_FIXED_BITS (the rounding error goes to the centre one) */
+void harris_gaussian_weights_fixed(int *w){
+    static const vector<int> weights = []{
+        float g[5];
+        harris_gaussian_weights(g);
+        vector<int> q(5);
+        const int one = 1 << HARRIS_FIXED_BITS;
+        q[0] = q[4] = cvRound(g[0] * one);
+        q[1] = q[3] = cvRound(g[1] * one);
+        q[2] = one - 2 * (q[0] + q[1]);
+        return q;
+    }();
+    std::copy(weights.begin(), weights.end(), w);
+}
+
+/*
+Sobel X and Y at column x, r0/r1/r2 are the rows above, at and below (already reflected),
+xl and xr the columns left and right (already reflected). The scale is the 1/255 of the reference.
+*/
+template <typename T>
+inline void harris_gradient(const T *r0, const T *r1, const T *r2, int xl, int x, int xr, float scale, float &gx, float &gy){
+    gx = ((float(r0[xr]) - float(r0[xl])) + 2.0f * (float(r1[xr]) - float(r1[xl])) + (float(r2[xr]) - float(r2[xl]))) * scale;
+    gy = ((float(r2[xl]) - float(r0[xl])) + 2.0f * (float(r2[x]) - float(r0[x])) + (float(r2[xr]) - float(r0[xr]))) * scale;
+}
+
+/* Integer Sobel X and Y of an 8-bit image, same layout as harris_gradient (no scale) */
+inline void harris_gradient_s16(const uchar *r0, const uchar *r1, const uchar *r2, int xl, int x, int xr, short &gx, short &gy){
+    gx = short((r0[xr] - r0[xl]) + 2 * (r1[xr] - r1[xl]) + (r2[xr] - r2[xl]));
+    gy = short((r2[xl] - r0[xl]) + 2 * (r2[x] - r0[x]) + (r2[xr] - r0[xr]));
+}
+
+/* a sum of fixed point weighted values back to the units of the values, rounded */
+inline int harris_round_fixed(int sum){
+    return (sum + (1 << (HARRIS_FIXED_BITS - 1))) >> HARRIS_FIXED_BITS;
+}
+
+/*
+Fixed point counterpart of harris_combine: vertical Gaussian of 5 horizontally smoothed rows (Sobel^2 units)
+into S (fixed point), det and trace in int64, then the response in the float path's units (unit = (scale^2 / 2^bits)^2)
+*/
+inline float harris_combine_fixed(const int *w, const int *xx, const int *yy, const int *xy, float k, double unit){
+    int sxx = w[0] * xx[0] + w[1] * xx[1] + w[2] * xx[2] + w[3] * xx[3] + w[4] * xx[4];
+    int syy = w[0] * yy[0] + w[1] * yy[1] + w[2] * yy[2] + w[3] * yy[3] + w[4] * yy[4];
+    int sxy = w[0] * xy[0] + w[1] * xy[1] + w[2] * xy[2] + w[3] * xy[3] + w[4] * xy[4];
+
+    int64 det = int64(sxx) * syy - int64(sxy) * sxy;
+    int64 trace = int64(sxx) + syy;
+    return float((double(det) - double(k) * double(trace) * double(trace)) * unit);
+}
+
+/* (scale^2 / 2^bits)^2: from det - k * trace^2 of the fixed point sums of squared integer gradients to the float path's units */
+inline double harris_fixed_unit(float scale){
+    double s = double(scale) * scale / double(1 << HARRIS_FIXED_BITS);
+    return s * s;
+}
+
+/* Vertical Gaussian of the 5 horizontally smoothed values and the response, shared by the dense and sparse paths */
+inline float harris_combine(const float *g, const float *xx, const float *yy, const float *xy, float k){
+    float sxx = g[0] * xx[0] + g[1] * xx[1] + g[2] * xx[2] + g[3] * xx[3] + g[4] * xx[4];
+    float syy = g[0] * yy[0] + g[1] * yy[1] + g[2] * yy[2] + g[3] * yy[3] + g[4] * yy[4];
+    float sxy = g[0] * xy[0] + g[1] * xy[1] + g[2] * xy[2] + g[3] * xy[3] + g[4] * xy[4];
+
+    float det = sxx * syy - sxy * sxy;
+    float trace = sxx + syy;
+    return det - k * trace * trace;
+}
+
+/* One tile: rows x cols of the raw response into R, and the min/max of what it wrote */
+template <typename T>
+void harris_fused_tile(const Mat &src, float scale, float k, const float *g,
+                       const Range &rows, const Range &cols, Mat &R, float &tileMin, float &tileMax){
+    const int W = src.cols, H = src.rows;
+
+    // products are needed 2 columns further than the tile for the horizontal Gaussian
+    const int px0 = std::max(cols.start - 2, 0), px1 = std::min(cols.end + 2, W);
+    const int pw = px1 - px0, tw = cols.size();
+
+    // kept by the (pool) thread from one tile to the next, every value is written before it's read
+    thread_local vector<float> prod, ring;
+    if (prod.size() < size_t(3 * pw)) prod.resize(3 * pw);      // Ix2, Iy2, Ixy of the current row
+    if (ring.size() < size_t(5 * 3 * tw)) ring.resize(5 * 3 * tw); // 5 rows of horizontally smoothed Ix2, Iy2, Ixy
+    int ringRow[5] = {-1, -1, -1, -1, -1};
+
+    /* returns the horizontally smoothed products of image row p, computing them only if they aren't in the ring */
+    auto smoothedRow = [&](int p) -> const float * {
+        int slot = p % 5;
+        float *h = &ring[slot * 3 * tw];
+        if (ringRow[slot] == p) return h;
+        ringRow[slot] = p;
+
+        const T *r0 = src.ptr<T>(harris_reflect(p - 1, H));
+        const T *r1 = src.ptr<T>(p);
+        const T *r2 = src.ptr<T>(harris_reflect(p + 1, H));
+
+        float *Pxx = prod.data(), *Pyy = Pxx + pw, *Pxy = Pyy + pw;
+        for (int x = px0; x < px1; x++){
+            float gx, gy;
+            harris_gradient(r0, r1, r2, harris_reflect(x - 1, W), x, harris_reflect(x + 1, W), scale, gx, gy);
+            Pxx[x - px0] = gx * gx;
+            Pyy[x - px0] = gy * gy;
+            Pxy[x - px0] = gx * gy;
+        }
+
+        float *Hxx = h, *Hyy = h + tw, *Hxy = h + 2 * tw;
+        for (int x = cols.start; x < cols.end; x++){
+            float sxx = 0, syy = 0, sxy = 0;
+            for (int d = -2; d <= 2; d++){
+                int xx = harris_reflect(x + d, W) - px0;
+                sxx += g[d + 2] * Pxx[xx];
+                syy += g[d + 2] * Pyy[xx];
+                sxy += g[d + 2] * Pxy[xx];
+            }
+            Hxx[x - cols.start] = sxx;
+            Hyy[x - cols.start] = syy;
+            Hxy[x - cols.start] = sxy;
+        }
+        return h;
+    };
+
+    tileMin = FLT_MAX;
+    tileMax = -FLT_MAX;
+    for (int y = rows.start; y < rows.end; y++){
+        // the (up to) 5 rows are different modulo 5 so they never evict each other
+        const float *hr[5];
+        for (int d = -2; d <= 2; d++)
+            hr[d + 2] = smoothedRow(harris_reflect(y + d, H));
+
+        float *out = R.ptr<float>(y) + cols.start;
+        for (int i = 0; i < tw; i++){
+            float xx[5], yy[5], xy[5];
+            for (int j = 0; j < 5; j++){
+                xx[j] = hr[j][i];
+                yy[j] = hr[j][tw + i];
+                xy[j] = hr[j][2 * tw + i];
+            }
+            float r = harris_combine(g, xx, yy, xy, k);
+            out[i] = r;
+            tileMin = std::min(tileMin, r);
+            tileMax = std::max(tileMax, r);
+        }
+    }
+}
+
+/* harris_fused_tile on an 8-bit image in fixed point: int16 gradients, int32 products and rings */
+void harris_fused_tile_fixed(const Mat &src, float scale, float k, const int *w,
+                          const Range &rows, const Range &cols, Mat &R, float &tileMin, float &tileMax){
+    const int W = src.cols, H = src.rows;
+    const double unit = harris_fixed_unit(scale);
+
+    const int px0 = std::max(cols.start - 2, 0), px1 = std::min(cols.end + 2, W);
+    const int pw = px1 - px0, tw = cols.size();
+
+    thread_local vector<int> prod, ring;
+    if (prod.size() < size_t(3 * pw)) prod.resize(3 * pw);
+    if (ring.size() < size_t(5 * 3 * tw)) ring.resize(5 * 3 * tw);
+    int ringRow[5] = {-1, -1, -1, -1, -1};
+
+    auto smoothedRow = [&](int p) -> const int * {
+        int slot = p % 5;
+        int *h = &ring[slot * 3 * tw];
+        if (ringRow[slot] == p) return h;
+        ringRow[slot] = p;
+
+        const uchar *r0 = src.ptr<uchar>(harris_reflect(p - 1, H));
+        const uchar *r1 = src.ptr<uchar>(p);
+        const uchar *r2 = src.ptr<uchar>(harris_reflect(p + 1, H));
+
+        int *Pxx = prod.data(), *Pyy = Pxx + pw, *Pxy = Pyy + pw;
+        for (int x = px0; x < px1; x++){
+            short gx, gy;
+            harris_gradient_s16(r0, r1, r2, harris_reflect(x - 1, W), x, harris_reflect(x + 1, W), gx, gy);
+            Pxx[x - px0] = gx * gx;
+            Pyy[x - px0] = gy * gy;
+            Pxy[x - px0] = gx * gy;
+        }
+
+        int *Hxx = h, *Hyy = h + tw, *Hxy = h + 2 * tw;
+        for (int x = cols.start; x < cols.end; x++){
+            int sxx = 0, syy = 0, sxy = 0;
+            for (int d = -2; d <= 2; d++){
+                int xx = harris_reflect(x + d, W) - px0;
+                sxx += w[d + 2] * Pxx[xx];
+                syy += w[d + 2] * Pyy[xx];
+                sxy += w[d + 2] * Pxy[xx];
+            }
+            Hxx[x - cols.start] = harris_round_fixed(sxx);
+            Hyy[x - cols.start] = harris_round_fixed(syy);
+            Hxy[x - cols.start] = harris_round_fixed(sxy);
+        }
+        return h;
+    };
+
+    tileMin = FLT_MAX;
+    tileMax = -FLT_MAX;
+    for (int y = rows.start; y < rows.end; y++){
+        const int *hr[5];
+        for (int d = -2; d <= 2; d++)
+            hr[d + 2] = smoothedRow(harris_reflect(y + d, H));
+
+        float *out = R.ptr<float>(y) + cols.start;
+        for (int i = 0; i < tw; i++){
+            int xx[5], yy[5], xy[5];
+            for (int j = 0; j < 5; j++){
+                xx[j] = hr[j][i];
+                yy[j] = hr[j][tw + i];
+                xy[j] = hr[j][2 * tw + i];
+            }
+            float r = harris_combine_fixed(w, xx, yy, xy, k, unit);
+            out[i] = r;
+            tileMin = std::min(tileMin, r);
+            tileMax = std::max(tileMax, r);
+        }
+    }
+}
+
+/* Raw response at a single pixel, with the same arithmetic as harris_fused_tile (so the same value) */
+template <typename T>
+float harris_response_at_pixel(const Mat &src, float scale, float k, const float *g, int x, int y){
+    const int W = src.cols, H = src.rows;
+    float xx[5], yy[5], xy[5];
+
+    for (int dy = -2; dy <= 2; dy++){
+        int p = harris_reflect(y + dy, H);
+        const T *r0 = src.ptr<T>(harris_reflect(p - 1, H));
+        const T *r1 = src.ptr<T>(p);
+        const T *r2 = src.ptr<T>(harris_reflect(p + 1, H));
+
+        float sxx = 0, syy = 0, sxy = 0;
+        for (int dx = -2; dx <= 2; dx++){
+            int c = harris_reflect(x + dx, W);
+            float gx, gy;
+            harris_gradient(r0, r1, r2, harris_reflect(c - 1, W), c, harris_reflect(c + 1, W), scale, gx, gy);
+            sxx += g[dx + 2] * (gx * gx);
+            syy += g[dx + 2] * (gy * gy);
+            sxy += g[dx + 2] * (gx * gy);
+        }
+        xx[dy + 2] = sxx;
+        yy[dy + 2] = syy;
+        xy[dy + 2] = sxy;
+    }
+    return harris_combine(g, xx, yy, xy, k);
+}
+
+/* Same for harris_fused_tile_fixed */
+float harris_response_at_pixel_fixed(const Mat &src, float scale, float k, const int *w, int x, int y){
+    const int W = src.cols, H = src.rows;
+    int xx[5], yy[5], xy[5];
+
+    for (int dy = -2; dy <= 2; dy++){
+        int p = harris_reflect(y + dy, H);
+        const uchar *r0 = src.ptr<uchar>(harris_reflect(p - 1, H));
+        const uchar *r1 = src.ptr<uchar>(p);
+        const uchar *r2 = src.ptr<uchar>(harris_reflect(p + 1, H));
+
+        int sxx = 0, syy = 0, sxy = 0;
+        for (int dx = -2; dx <= 2; dx++){
+            int c = harris_reflect(x + dx, W);
+            short gx, gy;
+            harris_gradient_s16(r0, r1, r2, harris_reflect(c - 1, W), c, harris_reflect(c + 1, W), gx, gy);
+            sxx += w[dx + 2] * (gx * gx);
+            syy += w[dx + 2] * (gy * gy);
+            sxy += w[dx + 2] * (gx * gy);
+        }
+        xx[dy + 2] = harris_round_fixed(sxx);
+        yy[dy + 2] = harris_round_fixed(syy);
+        xy[dy + 2] = harris_round_fixed(sxy);
+    }
+    return harris_combine_fixed(w, xx, yy, xy, k, harris_fixed_unit(scale));
+}
+
+/* single channel CV_8U stays as it is, anything else becomes single channel CV_32F (scale is applied later) */
+Mat harris_source(const Mat &input){
+    Mat gray;
+    if (input.channels() == 3) cvtColor(input, gray, COLOR_BGR2GRAY);
+    else gray = input;
+
+    if (gray.depth() == CV_8U || gray.depth() == CV_32F) return gray;
+    Mat f;
+    gray.convertTo(f, CV_32F);
+    return f;
+}
+
+/*
+Raw (not normalized) Harris response of the whole image, computed tile by tile in parallel, into R
+(R.create: a buffer of the right size and type is reused as it is).
+scale multiplies the intensities first (1/255 like the reference). If rmin/rmax are given they get the
+min and max of the response, so the caller can normalize without another pass to find them.
+8-bit images go through the fixed point tiles unless precision is FLOAT.
+*/
+void harris_response_fused_into(const Mat &input, Mat &R, float scale = 1.0f / 255.0f, float k = HARRIS_K,
+                                double *rmin = nullptr, double *rmax = nullptr,
+                                int bandRows = DETECT_BAND_ROWS, int tileCols = HARRIS_TILE_COLS,
+                                HARRIS_PRECISION precision = HARRIS_PRECISION::FIXED_POINT){
+    Mat src = harris_source(input);
+    R.create(src.size(), CV_32F);
+    const bool fixed = src.depth() == CV_8U && precision == HARRIS_PRECISION::FIXED_POINT;
+
+    float g[5];
+    int w[5];
+    harris_gaussian_weights(g);
+    harris_gaussian_weights_fixed(w);
+
+    tileCols = std::max(tileCols, 1);
+    const int nBands = band_count(src.rows, bandRows);
+    const int nTiles = (src.cols + tileCols - 1) / tileCols;
+    // the calling thread's buffers (references, so the tiles running on other threads write into these ones)
+    thread_local vector<float> tileMinBuffer, tileMaxBuffer;
+    vector<float> &tileMin = tileMinBuffer, &tileMax = tileMaxBuffer;
+    tileMin.assign(nBands * nTiles, 0);
+    tileMax.assign(nBands * nTiles, 0);
+
+    parallel_for_(Range(0, nBands * nTiles), [&](const Range &r){
+        for (int t = r.start; t < r.end; t++){
+            Range rows = band_range(t / nTiles, src.rows, bandRows);
+            Range cols((t % nTiles) * tileCols, std::min((t % nTiles + 1) * tileCols, src.cols));
+            if (fixed)
+                harris_fused_tile_fixed(src, scale, k, w, rows, cols, R, tileMin[t], tileMax[t]);
+            else if (src.depth() == CV_8U)
+                harris_fused_tile<uchar>(src, scale, k, g, rows, cols, R, tileMin[t], tileMax[t]);
+            else
+                harris_fused_tile<float>(src, scale, k, g, rows, cols, R, tileMin[t], tileMax[t]);
+        }
+    });
+
+    if (rmin) *rmin = tileMin.empty() ? 0 : *min_element(tileMin.begin(), tileMin.end());
+    if (rmax) *rmax = tileMax.empty() ? 0 : *max_element(tileMax.begin(), tileMax.end());
+}
+
+Mat harris_response_fused(const Mat &input, float scale = 1.0f / 255.0f, float k = HARRIS_K,
+                          double *rmin = nullptr, double *rmax = nullptr,
+                          int bandRows = DETECT_BAND_ROWS, int tileCols = HARRIS_TILE_COLS,
+                          HARRIS_PRECISION precision = HARRIS_PRECISION::FIXED_POINT){
+    Mat R;
+    harris_response_fused_into(input, R, scale, k, rmin, rmax, bandRows, tileCols, precision);
+    return R;
+}
+
+/*
+Raw Harris response only at the given keypoints (one value per keypoint), for when we just need to
+score a few candidates (FASTR): every point costs a 7x7 neighbourhood instead of the whole frame.
+*/
+void harris_response_at_into(const Mat &input, const vector<KeyPoint> &kps, vector<float> &result,
+                             float scale = 1.0f / 255.0f, float k = HARRIS_K,
+                             HARRIS_PRECISION precision = HARRIS_PRECISION::FIXED_POINT){
+    Mat src = harris_source(input);
+    const bool fixed = src.depth() == CV_8U && precision == HARRIS_PRECISION::FIXED_POINT;
+    float g[5];
+    int w[5];
+    harris_gaussian_weights(g);
+    harris_gaussian_weights_fixed(w);
+
+    result.resize(kps.size());
+    parallel_for_(Range(0, (int)kps.size()), [&](const Range &r){
+        for (int i = r.start; i < r.end; i++){
+            int x = std::min(std::max(cvRound(kps[i].pt.x), 0), src.cols - 1);
+            int y = std::min(std::max(cvRound(kps[i].pt.y), 0), src.rows - 1);
+            if (fixed) result[i] = harris_response_at_pixel_fixed(src, scale, k, w, x, y);
+            else result[i] = src.depth() == CV_8U ? harris_response_at_pixel<uchar>(src, scale, k, g, x, y)
+                                                  : harris_response_at_pixel<float>(src, scale, k, g, x, y);
+        }
+    });
+}
+
+vector<float> harris_response_at(const Mat &input, const vector<KeyPoint> &kps,
+                                 float scale = 1.0f / 255.0f, float k = HARRIS_K,
+                                 HARRIS_PRECISION precision = HARRIS_PRECISION::FIXED_POINT){
+    vector<float> result;
+    harris_response_at_into(input, kps, result, scale, k, precision);
+    return result;
+}
+
+#endif
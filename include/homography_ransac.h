@@ -0,0 +1,390 @@
+#ifndef HOMOGRAPHY_RANSAC_H
+#define HOMOGRAPHY_RANSAC_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include "simd_common.h"
+#include "trace.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+Our own RANSAC for homographies (findHomography(..., RANSAC) is the reference in ransac.h).
+We want to see (and tune) what it does, so:
+- the points are stored as separate x / y arrays (SoA) and the reprojection error of a hypothesis is
+  evaluated for 8 points at a time with AVX2 (scalar otherwise, same arithmetic)
+- hypotheses are made in batches, every batch runs in parallel
+- it stops as soon as the best hypothesis so far makes more iterations pointless for the confidence
+  asked for: N = log(1 - confidence) / log(1 - w^4), w = inlier ratio
+- PROSAC: if we get a quality for every match (the descriptor distance), the samples are first drawn from
+  the best matches and the pool grows slowly to all of them, so good pairs are found in a few iterations
+- samples with 3 collinear points, or where the 4 points change orientation between the images, are
+  rejected before solving (they can't give a sensible homography)
+- the best hypothesis is refined with least squares (DLT) on its inliers
+The random numbers of hypothesis t only depend on t and the batches are merged in order, so the result
+doesn't depend on the number of threads.
+*/
+
+struct RansacReport{
+    int matches = 0;      // correspondences given
+    int iterations = 0;   // hypotheses tried (including rejected samples)
+    int inliers = 0;      // inliers of the returned homography
+    double millis = 0;
+    bool prosac = false;
+};
+
+/*
+The correspondences as SoA, src (x, y) -> dst (X, Y). They come in in pixels (gathered straight from
+the FeatureSets of the two images, see estimateHomographyRANSAC) and are normalized for the solver
+(see homography_normalization).
+*/
+struct HomographyPoints{
+    vector<float> x, y, X, Y;
+    int size() const { return (int)x.size(); }
+    void resize(int n){ x.resize(n); y.resize(n); X.resize(n); Y.resize(n); }
+};
+
+/*
+Hartley normalization: centroid to 0 and average distance to sqrt(2). Solving the 8x8 system with pixel
+coordinates (values around 1 next to values around 10^6) loses a lot of precision, this avoids it.
+*/
+Matx33d homography_normalization(const vector<float> &x, const vector<float> &y){
+    const size_t n = x.size();
+    double cx = 0, cy = 0;
+    for (size_t i = 0; i < n; i++){ cx += x[i]; cy += y[i]; }
+    cx /= n;
+    cy /= n;
+
+    double d = 0;
+    for (size_t i = 0; i < n; i++) d += std::sqrt((x[i] - cx) * (x[i] - cx) + (y[i] - cy) * (y[i] - cy));
+    d /= n;
+    double s = d > 1e-12 ? std::sqrt(2.0) / d : 1.0;
+
+    return Matx33d(s, 0, -s * cx,
+                   0, s, -s * cy,
+                   0, 0, 1);
+}
+
+/* homography (h33 = 1) through 4 correspondences, Gaussian elimination on the 8x8 system */
+bool homography_from_4(const HomographyPoints &p, const int *idx, double *h){
+    double A[8][9];
+    for (int i = 0; i < 4; i++){
+        double x = p.x[idx[i]], y = p.y[idx[i]], X = p.X[idx[i]], Y = p.Y[idx[i]];
+        double r0[9] = {x, y, 1, 0, 0, 0, -X * x, -X * y, X};
+        double r1[9] = {0, 0, 0, x, y, 1, -Y * x, -Y * y, Y};
+        std::copy(r0, r0 + 9, A[2 * i]);
+        std::copy(r1, r1 + 9, A[2 * i + 1]);
+    }
+
+    for (int c = 0; c < 8; c++){
+        int piv = c;
+        for (int r = c + 1; r < 8; r++)
+            if (std::fabs(A[r][c]) > std::fabs(A[piv][c])) piv = r;
+        if (std::fabs(A[piv][c]) < 1e-10) return false;
+        if (piv != c) std::swap(A[piv], A[c]);
+
+        for (int r = c + 1; r < 8; r++){
+            double f = A[r][c] / A[c][c];
+            for (int k = c; k < 9; k++) A[r][k] -= f * A[c][k];
+        }
+    }
+    for (int c = 7; c >= 0; c--){
+        double v = A[c][8];
+        for (int k = c + 1; k < 8; k++) v -= A[c][k] * h[k];
+        h[c] = v / A[c][c];
+    }
+    h[8] = 1.0;
+    return true;
+}
+
+/*
+A sample is bad if 3 of its points are (almost) collinear in either image, or if a triangle of it
+changes orientation between the images (a homography of a real scene doesn't mirror it).
+*/
+bool homography_sample_is_good(const HomographyPoints &p, const int *idx){
+    static const int tri[4][3] = {{0, 1, 2}, {0, 1, 3}, {0, 2, 3}, {1, 2, 3}};
+    const double eps = 1e-5; // in normalized coordinates (the points are ~1.4 from the centre)
+
+    for (const auto &t : tri){
+        int a = idx[t[0]], b = idx[t[1]], c = idx[t[2]];
+        double cs = (p.x[b] - p.x[a]) * (p.y[c] - p.y[a]) - (p.y[b] - p.y[a]) * (p.x[c] - p.x[a]);
+        double cd = (p.X[b] - p.X[a]) * (p.Y[c] - p.Y[a]) - (p.Y[b] - p.Y[a]) * (p.X[c] - p.X[a]);
+        if (std::fabs(cs) < eps || std::fabs(cd) < eps) return false;
+        if ((cs > 0) != (cd > 0)) return false;
+    }
+    return true;
+}
+
+/* Points [i0, n) whose squared reprojection error through h is < thr2, mask (if given) gets 1 / 0 */
+int homography_inliers_scalar(const HomographyPoints &p, const float *h, float thr2, uchar *mask, int i0 = 0){
+    int total = 0;
+    for (int i = i0; i < p.size(); i++){
+        float w = (h[6] * p.x[i] + h[7] * p.y[i]) + h[8];
+        float u = ((h[0] * p.x[i] + h[1] * p.y[i]) + h[2]) / w;
+        float v = ((h[3] * p.x[i] + h[4] * p.y[i]) + h[5]) / w;
+        float dx = u - p.X[i], dy = v - p.Y[i];
+        bool in = dx * dx + dy * dy < thr2; // NaN / inf (w = 0) are never inliers
+        total += in;
+        if (mask) mask[i] = in;
+    }
+    return total;
+}
+
+#ifdef SIMD_HAVE_X86
+/* Same as the scalar version, 8 points per step */
+SIMD_TARGET_AVX2
+int homography_inliers_avx2(const HomographyPoints &p, const float *h, float thr2, uchar *mask){
+    __m256 h0 = _mm256_set1_ps(h[0]), h1 = _mm256_set1_ps(h[1]), h2 = _mm256_set1_ps(h[2]);
+    __m256 h3 = _mm256_set1_ps(h[3]), h4 = _mm256_set1_ps(h[4]), h5 = _mm256_set1_ps(h[5]);
+    __m256 h6 = _mm256_set1_ps(h[6]), h7 = _mm256_set1_ps(h[7]), h8 = _mm256_set1_ps(h[8]);
+    __m256 thr = _mm256_set1_ps(thr2);
+
+    const int n = p.size();
+    int total = 0, i = 0;
+    for (; i + 8 <= n; i += 8){
+        __m256 x = _mm256_loadu_ps(&p.x[i]), y = _mm256_loadu_ps(&p.y[i]);
+        __m256 w = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h6, x), _mm256_mul_ps(h7, y)), h8);
+        __m256 u = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h0, x), _mm256_mul_ps(h1, y)), h2), w);
+        __m256 v = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h3, x), _mm256_mul_ps(h4, y)), h5), w);
+        __m256 dx = _mm256_sub_ps(u, _mm256_loadu_ps(&p.X[i]));
+        __m256 dy = _mm256_sub_ps(v, _mm256_loadu_ps(&p.Y[i]));
+        __m256 e = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+
+        unsigned bits = (unsigned)_mm256_movemask_ps(_mm256_cmp_ps(e, thr, _CMP_LT_OQ));
+        total += simd_popcount(bits);
+        if (mask)
+            for (int j = 0; j < 8; j++) mask[i + j] = (bits >> j) & 1u;
+    }
+    return total + homography_inliers_scalar(p, h, thr2, mask, i);
+}
+#endif
+
+int homography_inliers(const HomographyPoints &p, const double *hd, float thr2, uchar *mask, bool avx2){
+    float h[9];
+    for (int k = 0; k < 9; k++) h[k] = float(hd[k]);
+#ifdef SIMD_HAVE_X86
+    if (avx2) return homography_inliers_avx2(p, h, thr2, mask);
+#endif
+    return homography_inliers_scalar(p, h, thr2, mask);
+}
+
+/* Least squares homography (DLT, smallest eigenvector of A^T A) through the points where mask is set */
+bool homography_least_squares(const HomographyPoints &p, const vector<uchar> &mask, double *h){
+    Matx<double, 9, 9> AtA = Matx<double, 9, 9>::zeros();
+    int used = 0;
+    for (int i = 0; i < p.size(); i++){
+        if (!mask[i]) continue;
+        double x = p.x[i], y = p.y[i], X = p.X[i], Y = p.Y[i];
+        double r0[9] = {x, y, 1, 0, 0, 0, -X * x, -X * y, -X};
+        double r1[9] = {0, 0, 0, x, y, 1, -Y * x, -Y * y, -Y};
+        for (int a = 0; a < 9; a++)
+            for (int b = 0; b < 9; b++)
+                AtA(a, b) += r0[a] * r0[b] + r1[a] * r1[b];
+        used++;
+    }
+    if (used < 4) return false;
+
+    Mat values, vectors;
+    eigen(Mat(AtA), values, vectors); // descending eigenvalues, the last row is the solution
+    if (std::fabs(vectors.at<double>(8, 8)) < 1e-12) return false;
+    for (int k = 0; k < 9; k++) h[k] = vectors.at<double>(8, k) / vectors.at<double>(8, 8);
+    return true;
+}
+
+/*
+PROSAC growth schedule (Chum & Matas 2005): growth[n] is the hypothesis number at which the pool of
+best matches grows to n points. Hypothesis t samples the newest point of its pool + 3 older ones.
+*/
+vector<int> prosac_growth(int n, int maxIters){
+    const int m = 4;
+    vector<int> growth(n + 1, 0);
+    double Tn = maxIters;
+    for (int i = 0; i < m; i++) Tn *= double(m - i) / double(n - i);
+
+    growth[m] = 1;
+    for (int k = m; k < n; k++){
+        double next = Tn * double(k + 1) / double(k + 1 - m);
+        growth[k + 1] = growth[k] + std::max(1, (int)std::ceil(next - Tn));
+        Tn = next;
+    }
+    return growth;
+}
+
+/*
+Seed of hypothesis t's RNG. OpenCV's RNG is one multiply-with-carry step, so seeds that differ only in
+their low bits (t, t + 1, ...) give first draws that are an affine function of t: the samples of
+neighbouring hypotheses were correlated. splitmix64 spreads every bit of t over the whole state.
+It only depends on t, so the samples still don't depend on how the batch is split between threads.
+*/
+uint64 ransac_seed(uint64 t){
+    uint64 z = t + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* 4 different indices for hypothesis t (1-based) */
+void homography_sample(int t, int n, const vector<int> &growth, RNG &rng, int *idx){
+    int pool = n, fixed = -1;
+    if (!growth.empty() && t <= growth[n]){
+        pool = int(lower_bound(growth.begin() + 4, growth.end(), t) - growth.begin());
+        fixed = pool - 1; // the newest point of the pool is always in the sample
+    }
+
+    int k = 0;
+    if (fixed >= 0) idx[k++] = fixed;
+    int range = fixed >= 0 ? fixed : pool;
+    while (k < 4){
+        int c = rng.uniform(0, range);
+        bool seen = false;
+        for (int j = 0; j < k; j++) seen |= idx[j] == c;
+        if (!seen) idx[k++] = c;
+    }
+}
+
+/* iterations needed to pick an all inlier sample with the given confidence */
+int ransac_required_iterations(double inlierRatio, double confidence, int maxIters){
+    double w4 = std::pow(inlierRatio, 4.0);
+    if (w4 <= 0) return maxIters;
+    if (w4 >= 1) return 1;
+    double n = std::log(1.0 - confidence) / std::log(1.0 - w4);
+    return (int)std::min<double>(maxIters, std::ceil(n));
+}
+
+/*
+Homography mapping (x[i], y[i]) -> (X[i], Y[i]) with RANSAC, the points in pixels. threshold is the
+reprojection error in pixels (of dst). quality (optional, lower is better, e.g. descriptor distance) turns
+on PROSAC when prosac is true. mask gets 1 for the inliers. Returns an empty Mat if there's no homography.
+*/
+Mat find_homography_ransac(const HomographyPoints &pixels, const vector<float> &quality,
+                           double threshold, double confidence, int maxIters, bool prosac,
+                           vector<char> &mask, RansacReport *report = nullptr){
+    // hypotheses per parallel batch, fixed so the stopping point doesn't depend on the thread count
+    const int BATCH = 16;
+    TRACE_SCOPE("ransac");
+
+    int64 start = getTickCount();
+    const int n = pixels.size();
+    mask.assign(n, 0);
+
+    RansacReport rep;
+    rep.matches = n;
+    rep.prosac = prosac && (int)quality.size() == n;
+
+    auto finish = [&](Mat H){
+        rep.millis = (getTickCount() - start) * 1000.0 / getTickFrequency();
+        TRACE_COUNT("ransac_iterations", rep.iterations);
+        TRACE_COUNT("ransac_inlier_ratio", n ? double(rep.inliers) / n : 0.0);
+        if (report) *report = rep;
+        return H;
+    };
+    if (n < 4) return finish(Mat());
+
+    // best matches first for PROSAC (stable, so equal qualities keep their order)
+    vector<int> order(n);
+    iota(order.begin(), order.end(), 0);
+    if (rep.prosac)
+        stable_sort(order.begin(), order.end(), [&](int a, int b){ return quality[a] < quality[b]; });
+
+    Matx33d Ts = homography_normalization(pixels.x, pixels.y), Td = homography_normalization(pixels.X, pixels.Y);
+    HomographyPoints p;
+    p.resize(n);
+    // one array at a time, in = s * in + t (straight contiguous loops unless PROSAC reorders the points)
+    auto normalize = [&](const vector<float> &in, vector<float> &out, double s, double t){
+        if (rep.prosac) for (int i = 0; i < n; i++) out[i] = float(s * in[order[i]] + t);
+        else            for (int i = 0; i < n; i++) out[i] = float(s * in[i] + t);
+    };
+    normalize(pixels.x, p.x, Ts(0, 0), Ts(0, 2));
+    normalize(pixels.y, p.y, Ts(1, 1), Ts(1, 2));
+    normalize(pixels.X, p.X, Td(0, 0), Td(0, 2));
+    normalize(pixels.Y, p.Y, Td(1, 1), Td(1, 2));
+    const float thr2 = float(threshold * Td(0, 0) * threshold * Td(0, 0));
+
+    bool avx2 = false;
+#ifdef SIMD_HAVE_X86
+    avx2 = checkHardwareSupport(CV_CPU_AVX2);
+#endif
+
+    vector<int> growth;
+    if (rep.prosac) growth = prosac_growth(n, maxIters);
+
+    double best[9];
+    int bestCount = 0, needed = std::max(maxIters, 1), t = 0;
+
+    while (t < needed){
+        const int count = std::min(BATCH, needed - t);
+        vector<int> score(count, -1);
+        vector<Vec<double, 9>> hyp(count);
+
+        parallel_for_(Range(0, count), [&](const Range &r){
+            for (int k = r.start; k < r.end; k++){
+                RNG rng(ransac_seed((uint64)(t + k + 1)));
+                int idx[4];
+                homography_sample(t + k + 1, n, growth, rng, idx);
+                if (!homography_sample_is_good(p, idx)) continue;
+                if (!homography_from_4(p, idx, hyp[k].val)) continue;
+                score[k] = homography_inliers(p, hyp[k].val, thr2, nullptr, avx2);
+            }
+        });
+
+        for (int k = 0; k < count; k++){
+            if (score[k] > bestCount){
+                bestCount = score[k];
+                std::copy(hyp[k].val, hyp[k].val + 9, best);
+            }
+        }
+        t += count;
+        if (bestCount >= 4)
+            needed = std::min(needed, std::max(t, ransac_required_iterations(double(bestCount) / n, confidence, maxIters)));
+    }
+    rep.iterations = t;
+    if (bestCount < 4) return finish(Mat());
+
+    // least squares on the inliers, as long as it doesn't lose inliers
+    vector<uchar> in(n);
+    homography_inliers(p, best, thr2, in.data(), avx2);
+    for (int it = 0; it < 3; it++){
+        double refined[9];
+        if (!homography_least_squares(p, in, refined)) break;
+        vector<uchar> in2(n);
+        int c = homography_inliers(p, refined, thr2, in2.data(), avx2);
+        if (c < bestCount) break;
+        bool same = c == bestCount && in2 == in;
+        bestCount = c;
+        std::copy(refined, refined + 9, best);
+        in.swap(in2);
+        if (same) break;
+    }
+
+    // back to pixels: H = Td^-1 * Hn * Ts
+    Matx33d Hn(best);
+    Matx33d H = Td.inv() * Hn * Ts;
+    if (std::fabs(H(2, 2)) < 1e-12) return finish(Mat());
+    H *= 1.0 / H(2, 2);
+
+    for (int i = 0; i < n; i++) mask[order[i]] = in[i];
+    rep.inliers = bestCount;
+    return finish(Mat(H));
+}
+
+/* Same, from two arrays of points src[i] -> dst[i] */
+Mat find_homography_ransac(const vector<Point2f> &src, const vector<Point2f> &dst, const vector<float> &quality,
+                           double threshold, double confidence, int maxIters, bool prosac,
+                           vector<char> &mask, RansacReport *report = nullptr){
+    CV_Assert(src.size() == dst.size());
+    HomographyPoints pixels;
+    pixels.resize((int)src.size());
+    for (size_t i = 0; i < src.size(); i++){
+        pixels.x[i] = src[i].x;
+        pixels.y[i] = src[i].y;
+        pixels.X[i] = dst[i].x;
+        pixels.Y[i] = dst[i].y;
+    }
+    return find_homography_ransac(pixels, quality, threshold, confidence, maxIters, prosac, mask, report);
+}
+
+#endif
@@ -0,0 +1,329 @@
+#ifndef IMAGE_INGEST_H
+#define IMAGE_INGEST_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <cstring>
+#include "trace.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
+
+using namespace cv;
+using namespace std;
+
+/*
+Reading the input images without the copies imread makes.
+imread reads the whole file into a buffer, decodes it into a new Mat, and then every detector converts
+that Mat to gray again (a 40 MP frame: 120 MB of colour + 40 MB of gray, for every stage that wants gray).
+Here:
+- the file is memory-mapped (no read() copy, the kernel pages it in as the decoder goes)
+- PPM (P5 / P6) and raw files are not encoded at all: their pixels are used right where they are in the
+  mapping (gray P5, BGR raw), or converted from there in a single pass (RGB P6 -> BGR)
+- PNG / JPEG / ... are decoded by imdecode straight from the mapping into a buffer of an ImagePool, so the
+  next image of the same size reuses that memory instead of allocating it again
+- gray is made once, here, and every stage (detectors, SIFT, pyramid, refinement) uses that one
+
+An IngestedImage may point into the file mapping (gray of a P5, colour of a BGR raw), so keep the
+IngestedImage (or at least its `file`) alive as long as its Mats are used. release_image() gives its
+buffers back to the pool.
+*/
+
+/* A whole file mapped read only (copy on write if someone writes to it), or read into memory on Windows */
+class MappedFile{
+public:
+    explicit MappedFile(const string &path){
+#if !defined(_WIN32)
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0){
+            void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED){
+                ptr = (uchar *)p;
+                length = (size_t)st.st_size;
+            }
+        }
+        close(fd);
+#else
+        ifstream file(path, ios::binary | ios::ate);
+        if (!file) return;
+        copy.resize((size_t)file.tellg());
+        file.seekg(0);
+        file.read((char *)copy.data(), copy.size());
+        ptr = copy.data();
+        length = copy.size();
+#endif
+    }
+
+    ~MappedFile(){
+#if !defined(_WIN32)
+        if (ptr) munmap(ptr, length);
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool ok() const { return ptr != nullptr; }
+    uchar *data() const { return ptr; }
+    size_t size() const { return length; }
+
+private:
+    uchar *ptr = nullptr;
+    size_t length = 0;
+#if defined(_WIN32)
+    vector<uchar> copy;
+#endif
+};
+
+/*
+Buffers of images that were used and given back, to be handed out again for an image of the same size
+and type. Thread safe. It keeps at most maxBytes of spare buffers (the oldest ones go first): enough
+for the frames of a few jobs in flight, a batch of varied sizes doesn't keep every size it has seen
+(run_jobs empties it at the end, panorama --pool-mb sets the cap).
+*/
+const size_t IMAGE_POOL_BYTES = size_t(256) << 20;
+
+class ImagePool{
+public:
+    explicit ImagePool(size_t maxBytes = IMAGE_POOL_BYTES) : maxBytes(maxBytes){}
+
+    /* a spare buffer of that size and type, or a new one (the pixels are not cleared) */
+    Mat acquire(Size size, int type){
+        {
+            lock_guard<mutex> lock(m);
+            for (auto it = spare.begin(); it != spare.end(); ++it){
+                if (it->size() == size && it->type() == type){
+                    Mat buffer = *it;
+                    spareBytes -= bytes(buffer);
+                    spare.erase(it);
+                    hits++;
+                    return buffer;
+                }
+            }
+            misses++;
+        }
+        Mat buffer(size, type);
+        TRACE_BYTES(buffer);
+        return buffer;
+    }
+
+    /* buffer goes back to the pool if nobody else holds it (views and shared Mats are just released) */
+    void release(Mat &buffer){
+        if (buffer.u && buffer.u->refcount == 1 && buffer.isContinuous() && !buffer.isSubmatrix()){
+            lock_guard<mutex> lock(m);
+            if (bytes(buffer) <= maxBytes){
+                trim(maxBytes - bytes(buffer));
+                spare.push_back(buffer);
+                spareBytes += bytes(buffer);
+            }
+        }
+        buffer.release();
+    }
+
+    void clear(){
+        lock_guard<mutex> lock(m);
+        spare.clear();
+        spareBytes = 0;
+    }
+
+    /* new cap, the spare buffers over it are freed now (0 = keep none) */
+    void setMaxBytes(size_t bytes){
+        lock_guard<mutex> lock(m);
+        maxBytes = bytes;
+        trim(maxBytes);
+    }
+
+    long reused() const{
+        lock_guard<mutex> lock(m);
+        return hits;
+    }
+
+    long allocated() const{
+        lock_guard<mutex> lock(m);
+        return misses;
+    }
+
+private:
+    static size_t bytes(const Mat &b){ return b.total() * b.elemSize(); }
+
+    /* oldest spare buffers out until at most limit bytes are left (m held) */
+    void trim(size_t limit){
+        while (!spare.empty() && spareBytes > limit){
+            spareBytes -= bytes(spare.front());
+            spare.pop_front();
+        }
+    }
+
+    size_t maxBytes;
+    size_t spareBytes = 0;
+    deque<Mat> spare;
+    long hits = 0, misses = 0;
+    mutable mutex m;
+};
+
+/* the pool shared by every ingest that doesn't bring its own */
+ImagePool &image_pool(){
+    static ImagePool pool;
+    return pool;
+}
+
+struct IngestedImage{
+    Mat color;                   // 8 bit BGR, like imread(IMREAD_COLOR)
+    Mat gray;                    // 8 bit gray of the same pixels
+    shared_ptr<MappedFile> file; // set when color or gray point into the file
+    bool empty() const { return color.empty(); }
+};
+
+struct PpmHeader{
+    Size size;
+    int channels = 0;
+    size_t offset = 0; // where the pixels start
+};
+
+/* largest width or height accepted from a header (JPEG's own limit): anything bigger is a corrupt header */
+const int INGEST_MAX_SIDE = 65535;
+
+/* bytes of width x height pixels of that many channels, computed in size_t (Size::area() is an int product) */
+size_t ingest_bytes(int width, int height, int channels){
+    return (size_t)width * (size_t)height * (size_t)channels;
+}
+
+/* binary PPM / PGM (P6 / P5) with 8 bit samples */
+bool parse_ppm(const uchar *p, size_t n, PpmHeader &h){
+    if (n < 3 || p[0] != 'P' || (p[1] != '5' && p[1] != '6')) return false;
+    size_t i = 2;
+    int values[3];
+    for (int k = 0; k < 3; k++){
+        // whitespace and # comments
+        while (i < n && (isspace(p[i]) || p[i] == '#')){
+            if (p[i] == '#') while (i < n && p[i] != '\n') i++;
+            else i++;
+        }
+        if (i >= n || !isdigit(p[i])) return false;
+        long v = 0;
+        while (i < n && isdigit(p[i])){
+            v = v * 10 + (p[i++] - '0');
+            if (v > INGEST_MAX_SIDE) return false; // too many digits: a broken header, not a huge image
+        }
+        values[k] = (int)v;
+    }
+    if (i >= n || !isspace(p[i]) || values[0] <= 0 || values[1] <= 0 || values[2] <= 0 || values[2] > 255) return false;
+    h.size = Size(values[0], values[1]);
+    h.channels = p[1] == '6' ? 3 : 1;
+    h.offset = i + 1; // exactly one whitespace after maxval
+    return n - h.offset >= ingest_bytes(values[0], values[1], h.channels);
+}
+
+/* width and height from a PNG or JPEG header, so the buffer can come from the pool before decoding */
+bool peek_image_size(const uchar *p, size_t n, Size &size){
+    auto be16 = [&](size_t i){ return (p[i] << 8) | p[i + 1]; };
+    if (n >= 24 && memcmp(p, "\x89PNG\r\n\x1a\n", 8) == 0){
+        size = Size((be16(16) << 16) | be16(18), (be16(20) << 16) | be16(22));
+        return size.width > 0 && size.height > 0 && size.width <= INGEST_MAX_SIDE && size.height <= INGEST_MAX_SIDE;
+    }
+    if (n >= 4 && p[0] == 0xFF && p[1] == 0xD8){
+        size_t i = 2;
+        while (i + 9 < n){
+            if (p[i] != 0xFF){ i++; continue; }
+            int marker = p[i + 1];
+            if (marker == 0xFF){ i++; continue; }
+            if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)){ i += 2; continue; }
+            // start of frame (any but DHT, JPG and DAC): precision, height, width
+            if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC){
+                size = Size(be16(i + 7), be16(i + 5));
+                return size.width > 0 && size.height > 0;
+            }
+            i += 2 + be16(i + 2);
+        }
+    }
+    return false;
+}
+
+/* colour + gray of one file, empty if it can't be read */
+IngestedImage ingest_image(const string &path, ImagePool &pool = image_pool()){
+    TRACE_SCOPE("ingest");
+    IngestedImage img;
+    auto file = make_shared<MappedFile>(path);
+    if (!file->ok()) return img;
+
+    PpmHeader ppm;
+    if (parse_ppm(file->data(), file->size(), ppm)){
+        Mat pixels(ppm.size, ppm.channels == 3 ? CV_8UC3 : CV_8UC1, file->data() + ppm.offset);
+        img.color = pool.acquire(ppm.size, CV_8UC3);
+        if (ppm.channels == 3){
+            cvtColor(pixels, img.color, COLOR_RGB2BGR);
+            img.gray = pool.acquire(ppm.size, CV_8UC1);
+            cvtColor(pixels, img.gray, COLOR_RGB2GRAY);
+        }
+        else {
+            cvtColor(pixels, img.color, COLOR_GRAY2BGR);
+            img.gray = pixels; // straight from the file
+            img.file = file;
+        }
+        return img;
+    }
+
+    // encoded: decoded from the mapping into a pooled buffer (imdecode only reallocates it if the size is off)
+    Mat encoded(1, (int)file->size(), CV_8U, file->data());
+    Size size;
+    Mat color;
+    if (peek_image_size(file->data(), file->size(), size)) color = pool.acquire(size, CV_8UC3);
+    // when no decoder takes the file or its header is broken, imdecode returns an empty Mat and leaves
+    // color as it was (the pooled buffer, pixels never written): only the returned Mat says it worked
+    Mat decoded = imdecode(encoded, IMREAD_COLOR, &color);
+    if (decoded.empty()){
+        pool.release(color);
+        return img;
+    }
+
+    img.color = decoded;
+    img.gray = pool.acquire(decoded.size(), CV_8UC1);
+    cvtColor(decoded, img.gray, COLOR_BGR2GRAY);
+    return img;
+}
+
+/* headerless pixels (8 bit BGR or gray, rows of size.width pixels starting at offset), used in place */
+IngestedImage ingest_raw(const string &path, Size size, int type, size_t offset = 0, ImagePool &pool = image_pool()){
+    TRACE_SCOPE("ingest");
+    CV_Assert(type == CV_8UC3 || type == CV_8UC1);
+    IngestedImage img;
+    auto file = make_shared<MappedFile>(path);
+    if (size.width <= 0 || size.height <= 0 || size.width > INGEST_MAX_SIDE || size.height > INGEST_MAX_SIDE) return img;
+    if (!file->ok() || file->size() < offset || file->size() - offset < ingest_bytes(size.width, size.height, CV_ELEM_SIZE(type)))
+        return img;
+
+    Mat pixels(size, type, file->data() + offset);
+    img.file = file;
+    if (type == CV_8UC3){
+        img.color = pixels;
+        img.gray = pool.acquire(size, CV_8UC1);
+        cvtColor(pixels, img.gray, COLOR_BGR2GRAY);
+    }
+    else {
+        img.gray = pixels;
+        img.color = pool.acquire(size, CV_8UC3);
+        cvtColor(pixels, img.color, COLOR_GRAY2BGR);
+    }
+    return img;
+}
+
+/* its buffers back to the pool, img is empty afterwards */
+void release_image(IngestedImage &img, ImagePool &pool = image_pool()){
+    pool.release(img.color);
+    pool.release(img.gray);
+    img.file.reset();
+}
+
+#endif
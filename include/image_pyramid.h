@@ -0,0 +1,63 @@
+#ifndef IMAGE_PYRAMID_H
+#define IMAGE_PYRAMID_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include "trace.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+Grayscale pyramid of an image: levels[0] is the full resolution gray image and every next level is
+half the size (pyrDown: Gaussian 5x5 + drop every other row and column).
+The alignment doesn't need full resolution, a 1-2 MP proxy gives almost the same homography, so the
+detectors, SIFT and the matching can all run on one level of this pyramid, and the same gray levels are
+shared by all of them (and by the full resolution refinement in coarse_alignment.h).
+*/
+struct ImagePyramid{
+    vector<Mat> levels;
+
+    /* level l pixel (x, y) is full resolution pixel (x, y) * scale(l) */
+    static float scale(int level) { return float(1 << level); }
+};
+
+/* first level with at most maxPixels pixels (0 = no limit), never smaller than 64 pixels on a side */
+int proxy_level(Size size, long maxPixels){
+    int level = 0;
+    if (maxPixels <= 0) return 0;
+    while ((long)size.width * size.height > maxPixels && std::min(size.width, size.height) / 2 >= 64){
+        size = Size((size.width + 1) / 2, (size.height + 1) / 2);
+        level++;
+    }
+    return level;
+}
+
+/* levels 0 .. lastLevel of the gray image */
+ImagePyramid build_pyramid(const Mat &image, int lastLevel){
+    TRACE_SCOPE("pyramid");
+    ImagePyramid p;
+    Mat gray;
+    if (image.channels() == 3) cvtColor(image, gray, COLOR_BGR2GRAY);
+    else gray = image;
+
+    p.levels.push_back(gray);
+    for (int l = 1; l <= lastLevel; l++){
+        Mat down;
+        pyrDown(p.levels.back(), down);
+        TRACE_BYTES(down);
+        p.levels.push_back(down);
+    }
+    return p;
+}
+
+/* keypoints found on a level, in full resolution coordinates (and size) */
+void scale_keypoints(vector<KeyPoint> &kps, float s){
+    if (s == 1.0f) return;
+    for (auto &kp : kps){
+        kp.pt = kp.pt * s;
+        kp.size *= s;
+    }
+}
+
+#endif
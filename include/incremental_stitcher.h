@@ -0,0 +1,296 @@
+#ifndef INCREMENTAL_STITCHER_H
+#define INCREMENTAL_STITCHER_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <cmath>
+#include <climits>
+
+#include <feature_store.h>
+#include <ransac.h>
+#include <tiled_compositor.h>
+#include <trace.h>
+
+using namespace cv;
+using namespace std;
+
+/*
+Live stitching: frames arrive one by one (a capture rig) and the panorama is updated after each of them.
+panorama_FAST / panorama_chain redo the whole panorama for every new image and PanoramaStitcher wants all
+the images up front; here addFrame() only does work proportional to the new frame:
+- it is detected and described once (FeatureStore::compute, same detector / descriptor / proxy options)
+- it is matched only against the last few keyframes (newest first, the older ones only if that fails),
+  with the motion of the last two frames as the prior of guided matching (ransac.guided)
+- the canvas is a sparse grid of tiles in the coordinates of the first frame: the frame is warped and
+  max-blended (like tiled_compositor.h) only into the tiles its footprint touches, and a tile is allocated
+  the first time a frame reaches it, so growing the canvas (even to the left or up) never copies it
+- a frame becomes a keyframe when it doesn't overlap the newest keyframe enough; only keyframes keep
+  their features, and only the last `keyframes` of them
+So the time per frame doesn't grow with the number of frames added. preview() gives the canvas
+downscaled: every tile keeps its small copy and only the tiles that changed are resized again;
+panorama() puts the full resolution tiles together.
+A frame that can't be matched is dropped (addFrame returns false) and the next one tries again.
+*/
+
+struct IncrementalParameters{
+    RansacParameters ransac;          // matching ratio + RANSAC (+ guided matching around the predicted motion)
+    FeatureStoreParameters features;  // detector, descriptor and proxy level of every frame
+    int keyframes = 3;                // a frame is matched against at most this many of the newest keyframes
+    int minInliers = 12;              // fewer and the frame is dropped
+    double keyframeOverlap = 0.6;     // a frame covering less than this much of the newest keyframe's box becomes a keyframe
+    double maxAreaGrowth = 4.0;       // a homography that makes the frame this many times bigger (or smaller) is a failure
+    int tileSize = COMPOSITE_TILE;    // side of the canvas tiles
+};
+
+struct IncrementalFrameReport{
+    bool added = false;        // matched and warped into the canvas (the first frame always is)
+    bool keyframe = false;     // kept to match the next frames against
+    int matchedKeyframe = -1;  // number of the frame it was matched against (-1 for the first one)
+    int inliers = 0;
+    int tilesTouched = 0;      // tiles of the canvas it was warped into
+    int tilesCreated = 0;      // of them, the new ones (the canvas grew)
+    double millis = 0;
+};
+
+class IncrementalStitcher{
+public:
+    explicit IncrementalStitcher(const IncrementalParameters &P = {}) : P(P), tileSize(std::max(P.tileSize, 16)){}
+
+    /* matches the frame, warps it into the canvas; false if it couldn't be placed (the canvas is unchanged) */
+    bool addFrame(const Mat &frame, IncrementalFrameReport *report = nullptr){
+        TRACE_SCOPE("add_frame");
+        int64 start = getTickCount();
+        IncrementalFrameReport rep;
+        auto finish = [&](bool ok){
+            rep.added = ok;
+            rep.millis = (getTickCount() - start) * 1000.0 / getTickFrequency();
+            if (report) *report = rep;
+            return ok;
+        };
+
+        const int number = received++;
+        if (frame.empty()) return finish(false);
+        if (type < 0) type = frame.type();
+        CV_Assert(frame.type() == type);
+
+        Mat gray;
+        ensureGray(frame, gray);
+        ImageFeatures f = FeatureStore::compute(gray, P.features);
+
+        // frame -> canvas (the coordinates of the first frame)
+        Mat H = added == 0 ? Mat(Mat::eye(3, 3, CV_64F)) : locate(f, rep);
+        if (H.empty()) return finish(false);
+
+        Rect box = canvas_footprint(frame.size(), H);
+        double growth = box.area() / double(frame.size().area());
+        if (added > 0 && (growth > P.maxAreaGrowth || growth < 1.0 / P.maxAreaGrowth)) return finish(false);
+
+        warpIntoTiles(frame, H, box, rep);
+        canvasBox = added == 0 ? box : (canvasBox | box);
+
+        rep.keyframe = keys.empty() || overlap(box, keys.back().box) < P.keyframeOverlap;
+        if (rep.keyframe){
+            Keyframe k;
+            k.number = number;
+            k.features = std::move(f);
+            k.toCanvas = H;
+            k.box = box;
+            keys.push_back(std::move(k));
+            while ((int)keys.size() > std::max(P.keyframes, 1)) keys.pop_front();
+        }
+
+        previousH = lastH;
+        lastH = H;
+        added++;
+        TRACE_COUNT("incremental_tiles", rep.tilesTouched);
+        return finish(true);
+    }
+
+    /*
+    The canvas downscaled by scale (0 < scale <= 1). Tile (tx, ty) goes to the pixels
+    [round(tx * tileSize * scale), round((tx + 1) * tileSize * scale)) so the small tiles cover the preview
+    exactly; the ones no frame touched since the last preview are not resized again.
+    */
+    Mat preview(double scale = 0.25){
+        TRACE_SCOPE("preview");
+        if (tiles.empty()) return Mat();
+        scale = std::min(std::max(scale, 1.0 / tileSize), 1.0);
+        if (scale != previewScale){
+            previewScale = scale;
+            for (auto &t : tiles) t.second.dirty = true;
+        }
+        auto edge = [&](int i){ return (int)std::floor(i * double(tileSize) * scale + 0.5); };
+
+        int tx0 = INT_MAX, ty0 = INT_MAX, tx1 = INT_MIN, ty1 = INT_MIN;
+        for (const auto &t : tiles){
+            tx0 = std::min(tx0, t.first.first); tx1 = std::max(tx1, t.first.first);
+            ty0 = std::min(ty0, t.first.second); ty1 = std::max(ty1, t.first.second);
+        }
+        Mat out(edge(ty1 + 1) - edge(ty0), edge(tx1 + 1) - edge(tx0), type, Scalar::all(0));
+
+        for (auto &t : tiles){
+            const int tx = t.first.first, ty = t.first.second;
+            Tile &tile = t.second;
+            Size small(edge(tx + 1) - edge(tx), edge(ty + 1) - edge(ty));
+            if (small.area() == 0) continue;
+            if (tile.dirty){
+                resize(tile.pixels, tile.small, small, 0, 0, INTER_AREA);
+                tile.dirty = false;
+            }
+            tile.small.copyTo(out(Rect(Point(edge(tx) - edge(tx0), edge(ty) - edge(ty0)), small)));
+        }
+
+        // the tiles stick out of the canvas box, crop to it
+        Rect crop(cvFloor(canvasBox.x * scale) - edge(tx0), cvFloor(canvasBox.y * scale) - edge(ty0),
+                  cvCeil(canvasBox.width * scale), cvCeil(canvasBox.height * scale));
+        return out(crop & Rect(Point(0, 0), out.size()));
+    }
+
+    /* the whole canvas at full resolution (black where no frame went), bounds() says where it is */
+    Mat panorama() const{
+        TRACE_SCOPE("incremental_panorama");
+        if (tiles.empty()) return Mat();
+        Mat out(canvasBox.size(), type, Scalar::all(0));
+        TRACE_BYTES(out);
+        for (const auto &t : tiles){
+            Rect r(t.first.first * tileSize, t.first.second * tileSize, tileSize, tileSize);
+            Rect part = r & canvasBox;
+            if (part.empty()) continue;
+            Mat from = t.second.pixels(Rect(part.x - r.x, part.y - r.y, part.width, part.height));
+            from.copyTo(out(Rect(part.x - canvasBox.x, part.y - canvasBox.y, part.width, part.height)));
+        }
+        return out;
+    }
+
+    /* everything back to empty (the next frame is a first frame again) */
+    void reset(){
+        tiles.clear();
+        keys.clear();
+        lastH.release();
+        previousH.release();
+        canvasBox = Rect();
+        received = added = 0;
+        type = -1;
+        previewScale = 0;
+    }
+
+    int frames() const { return added; }            // frames in the canvas
+    int framesReceived() const { return received; } // including the dropped ones
+    int keyframeCount() const { return (int)keys.size(); }
+    size_t tileCount() const { return tiles.size(); }
+    Rect bounds() const { return canvasBox; }       // the canvas, in the coordinates of the first frame
+    const Mat &lastTransform() const { return lastH; } // last frame added -> first frame
+
+private:
+    struct Keyframe{
+        int number = 0;
+        ImageFeatures features; // in the keyframe's own pixels
+        Mat toCanvas;
+        Rect box;
+    };
+
+    struct Tile{
+        Mat pixels;         // tileSize x tileSize
+        Mat small;          // its copy at previewScale
+        bool dirty = true;  // pixels changed since small was made
+    };
+
+    static int floor_div(int a, int b){ return a >= 0 ? a / b : -((-a + b - 1) / b); }
+
+    /* bounding box of the frame moved by H, 1 extra pixel for the interpolation (not clipped: the canvas has no edge) */
+    static Rect canvas_footprint(Size s, const Mat &H){
+        vector<Point2f> corners = {{0, 0}, {float(s.width), 0}, {float(s.width), float(s.height)}, {0, float(s.height)}};
+        vector<Point2f> moved;
+        perspectiveTransform(corners, moved, H);
+        Rect box = boundingRect(moved);
+        return Rect(box.x - 1, box.y - 1, box.width + 2, box.height + 2);
+    }
+
+    /* fraction of a covered by b */
+    static double overlap(Rect a, Rect b){
+        return a.area() > 0 ? (a & b).area() / double(a.area()) : 0.0;
+    }
+
+    /* frame -> canvas from the newest keyframe that matches with enough inliers, empty if none does */
+    Mat locate(const ImageFeatures &f, IncrementalFrameReport &rep){
+        // constant motion: the frame should be where the last one was, moved like the last one moved
+        Mat predicted;
+        if (!previousH.empty()) predicted = lastH * previousH.inv() * lastH;
+
+        for (auto it = keys.rbegin(); it != keys.rend(); ++it){
+            const Keyframe &k = *it;
+            int level = std::max(f.level, k.features.level);
+            RansacParameters R = P.ransac;
+            R.maxDistance *= ImagePyramid::scale(level);
+            R.guided.radius *= ImagePyramid::scale(level);
+
+            Mat prior;
+            if (!predicted.empty()) prior = k.toCanvas.inv() * predicted;
+
+            vector<DMatch> &good = frame_arena().vec<DMatch>(ARENA_PAIR_MATCHES);
+            vector<char> mask;
+            Mat H = matchAndEstimateHomography(k.features, f, R, good, mask, prior);
+            if (H.empty()) continue;
+            int inliers = (int)count(mask.begin(), mask.end(), 1);
+            if (inliers < P.minInliers) continue;
+
+            rep.matchedKeyframe = k.number;
+            rep.inliers = inliers;
+            return k.toCanvas * H;
+        }
+        return Mat();
+    }
+
+    /* the frame warped into every tile its footprint touches, new tiles allocated first (the map isn't thread safe) */
+    void warpIntoTiles(const Mat &frame, const Mat &H, Rect box, IncrementalFrameReport &rep){
+        TRACE_SCOPE("incremental_warp");
+        const int tx0 = floor_div(box.x, tileSize), tx1 = floor_div(box.x + box.width - 1, tileSize);
+        const int ty0 = floor_div(box.y, tileSize), ty1 = floor_div(box.y + box.height - 1, tileSize);
+
+        vector<pair<Rect, Tile *>> touched;
+        for (int ty = ty0; ty <= ty1; ty++){
+            for (int tx = tx0; tx <= tx1; tx++){
+                auto it = tiles.find(make_pair(tx, ty));
+                if (it == tiles.end()){
+                    it = tiles.emplace(make_pair(tx, ty), Tile()).first;
+                    it->second.pixels = Mat(tileSize, tileSize, type, Scalar::all(0));
+                    TRACE_BYTES(it->second.pixels);
+                    rep.tilesCreated++;
+                }
+                it->second.dirty = true;
+                touched.push_back(make_pair(Rect(tx * tileSize, ty * tileSize, tileSize, tileSize), &it->second));
+            }
+        }
+        rep.tilesTouched = (int)touched.size();
+
+        parallel_for_(Range(0, (int)touched.size()), [&](const Range &r){
+            Mat warped; // reused by every tile of this chunk
+            for (int i = r.start; i < r.end; i++){
+                const Rect tile = touched[i].first;
+                const Rect part = box & tile;
+
+                // only the part of the tile the frame covers, in canvas coordinates shifted to its corner
+                Mat shift = (Mat_<double>(3, 3) << 1, 0, -part.x, 0, 1, -part.y, 0, 0, 1);
+                warpPerspective(frame, warped, shift * H, part.size());
+
+                Mat roi = touched[i].second->pixels(Rect(part.x - tile.x, part.y - tile.y, part.width, part.height));
+                max(roi, warped, roi);
+            }
+        });
+    }
+
+    IncrementalParameters P;
+    int tileSize;
+    map<pair<int, int>, Tile> tiles; // (tx, ty) -> the pixels [tx * tileSize, (tx + 1) * tileSize) x ...
+    deque<Keyframe> keys;            // oldest first
+    Mat lastH, previousH;            // the last two frames added -> canvas
+    Rect canvasBox;
+    int received = 0, added = 0;
+    int type = -1;
+    double previewScale = 0;
+};
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef KEYPOINT_SELECTION_H
+#define KEYPOINT_SELECTION_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+/*
+Ways to thin out a set of keypoints using their response (for FAST that is the corner score).
+FAST fires on every pixel of a corner, so without this the corners come in clumps of 5-10 keypoints
+that all get a SIFT descriptor and all get matched against each other later.
+*/
+
+/* raster order: row by row, left to right (the order the detectors produce) */
+bool keypoint_raster_less(const KeyPoint &a, const KeyPoint &b){
+    int ay = cvRound(a.pt.y), by = cvRound(b.pt.y);
+    if (ay != by) return ay < by;
+    return cvRound(a.pt.x) < cvRound(b.pt.x);
+}
+
+/*
+3x3 non-maximum suppression: a keypoint survives if none of its 8 neighbours has a bigger response.
+On ties the one that comes first in raster order wins, so two equal neighbours don't kill each other.
+The neighbours are found with a binary search on the (raster ordered) keypoints, no score image needed.
+The _into version wants kps in raster order already (FAST gives them that way) and fills result.
+*/
+void nonmax_suppression_3x3_into(const vector<KeyPoint> &kps, vector<KeyPoint> &result){
+    CV_Assert(is_sorted(kps.begin(), kps.end(), keypoint_raster_less));
+    result.clear();
+    result.reserve(kps.size());
+
+    for (size_t i = 0; i < kps.size(); i++){
+        int x = cvRound(kps[i].pt.x), y = cvRound(kps[i].pt.y);
+        bool keep = true;
+
+        for (int dy = -1; dy <= 1 && keep; dy++){
+            KeyPoint probe(Point2f(float(x - 1), float(y + dy)), 0.0f);
+            auto it = lower_bound(kps.begin(), kps.end(), probe, keypoint_raster_less);
+
+            for (; it != kps.end() && keep; ++it){
+                if (cvRound(it->pt.y) != y + dy || cvRound(it->pt.x) > x + 1) break;
+                size_t j = it - kps.begin();
+                if (j == i) continue;
+                if (it->response > kps[i].response || (it->response == kps[i].response && j < i))
+                    keep = false;
+            }
+        }
+
+        if (keep) result.push_back(kps[i]);
+    }
+}
+
+vector<KeyPoint> nonmax_suppression_3x3(vector<KeyPoint> kps){
+    if (!is_sorted(kps.begin(), kps.end(), keypoint_raster_less))
+        stable_sort(kps.begin(), kps.end(), keypoint_raster_less);
+
+    vector<KeyPoint> result;
+    nonmax_suppression_3x3_into(kps, result);
+    return result;
+}
+
+/*
+Keeps at most maxKeypoints keypoints (0 means no limit).
+With a 1x1 grid it is just the best ones by response. With a bigger grid the image is split in
+gridCols x gridRows cells and the keypoints are taken round robin: the best of every cell, then the
+second best of every cell, and so on, so a very textured corner of the image can't take all of them.
+The result stays in raster order.
+*/
+vector<KeyPoint> retain_best_keypoints(const vector<KeyPoint> &kps, int maxKeypoints, Size imageSize,
+                                       int gridCols = 1, int gridRows = 1){
+    if (maxKeypoints <= 0 || (int)kps.size() <= maxKeypoints) return kps;
+
+    gridCols = std::max(gridCols, 1);
+    gridRows = std::max(gridRows, 1);
+
+    // best first, position breaks the ties so the result doesn't depend on the input order
+    auto better = [&](int a, int b){
+        if (kps[a].response != kps[b].response) return kps[a].response > kps[b].response;
+        return keypoint_raster_less(kps[a], kps[b]);
+    };
+
+    vector<vector<int>> cells(gridCols * gridRows);
+    for (int i = 0; i < (int)kps.size(); i++){
+        int cx = std::min(std::max(int(kps[i].pt.x * gridCols / std::max(imageSize.width, 1)), 0), gridCols - 1);
+        int cy = std::min(std::max(int(kps[i].pt.y * gridRows / std::max(imageSize.height, 1)), 0), gridRows - 1);
+        cells[cy * gridCols + cx].push_back(i);
+    }
+    for (auto &cell : cells)
+        sort(cell.begin(), cell.end(), better);
+
+    vector<int> chosen;
+    chosen.reserve(maxKeypoints);
+    for (size_t rank = 0; (int)chosen.size() < maxKeypoints; rank++){
+        // everything of this rank, best first, until we run out
+        vector<int> level;
+        for (auto &cell : cells)
+            if (rank < cell.size()) level.push_back(cell[rank]);
+        if (level.empty()) break;
+
+        sort(level.begin(), level.end(), better);
+        for (int i : level){
+            if ((int)chosen.size() == maxKeypoints) break;
+            chosen.push_back(i);
+        }
+    }
+
+    sort(chosen.begin(), chosen.end(), [&](int a, int b){ return keypoint_raster_less(kps[a], kps[b]); });
+    vector<KeyPoint> result;
+    result.reserve(chosen.size());
+    for (int i : chosen) result.push_back(kps[i]);
+    return result;
+}
+
+#endif
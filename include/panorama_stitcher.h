@@ -0,0 +1,353 @@
+#ifndef PANORAMA_STITCHER_H
+#define PANORAMA_STITCHER_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+
+#include <feature_store.h>
+#include <ransac.h>
+#include <blender.h>
+#include <coarse_alignment.h>
+#include <stage_pipeline.h>
+#include <image_ingest.h>
+
+using namespace cv;
+using namespace std;
+
+/*
+Global stitcher for N images.
+Chaining panorama_FAST (or panorama_chain) warps the whole panorama again every time an image is added,
+so the first image gets interpolated N-1 times (blur), the errors of every step pile up (drift) and the
+pixels moved grow like N^2. Here instead:
+1) features of every image, once (FeatureStore), optionally on a pyramid level and refined at full
+   resolution later (coarse_alignment.h)
+2) homographies only between neighbours (images i and i+1 .. i+neighbours, the input is a sequence)
+3) a spanning tree of the best pairs (most inliers) starting from the reference image, composing the pair
+   homographies along it gives every image -> reference
+4) one canvas for everything, and every source image is warped exactly once, only over its own footprint
+   (tile by tile, see tiled_compositor.h and blender.h)
+So the warping cost is the sum of the image footprints, O(N) in output pixels.
+*/
+
+struct StitcherParameters{
+    RansacParameters ransac;        // matching ratio + RANSAC
+    FeatureStoreParameters features; // detector
+    int reference = -1;             // image everything is relative to, -1 = the one in the middle
+    int neighbours = 1;             // pairs (i, i+1 .. i+neighbours) are tried
+    int minInliers = 12;            // a pair with fewer inliers doesn't count as overlapping
+    BlendParameters blend;          // max, feather or multi-band (blender.h)
+    AlignmentParameters align;      // with features.maxProxyPixels > 0: full resolution refinement of the pairs
+};
+
+/* Threads of every stage and queue sizes of PanoramaStitcher::stitch_paths */
+struct PipelineParameters{
+    int decodeWorkers = 2;
+    int featureWorkers = 2;
+    int matchWorkers = 2;
+    int queueCapacity = 2; // images waiting between two stages, this is what bounds the memory in flight
+};
+
+/* One pair of overlapping images: H maps image b into image a */
+struct PairwiseMatch{
+    int a = -1, b = -1;
+    Mat H_BtoA;
+    int inliers = 0;
+};
+
+class PanoramaStitcher{
+public:
+    explicit PanoramaStitcher(const StitcherParameters &P = {}) : P(P), store(P.features){}
+
+    /* with a sink, the panorama is handed to it tile by tile (tiled_output.h) and an empty Mat comes back */
+    Mat stitch(const vector<Mat> &images, TileSink *sink = nullptr){
+        TRACE_SCOPE("stitch");
+        store.clear();
+        pairList.clear();
+        global.assign(images.size(), Mat());
+        if (images.empty()) return Mat();
+
+        refIndex = (P.reference >= 0 && P.reference < (int)images.size()) ? P.reference : (int)images.size() / 2;
+
+        // gray once, shared by the detector, SIFT and the full resolution refinement
+        vector<Mat> gray(images.size());
+        for (size_t i = 0; i < images.size(); i++){
+            if (images[i].channels() == 3) cvtColor(images[i], gray[i], COLOR_BGR2GRAY);
+            else gray[i] = images[i];
+        }
+
+        // 1) features (every image once)
+        for (int i = 0; i < (int)images.size(); i++)
+            store.get(i, gray[i]);
+
+        // 2) pairwise homographies between neighbours, the pairs are independent so in parallel
+        estimatePairs(gray);
+
+        // 3) image -> reference along the best pairs
+        composeTransforms((int)images.size());
+
+        // 4) one warp per image
+        return composite(images, sink);
+    }
+
+    /*
+    Same as stitch() but from files, as a pipeline of stages with their own threads:
+      decode (ingest_image) -> features (detect + describe) -> match (pairs + RANSAC) -> warp
+    Decoding image i+1 overlaps the features of image i, and a pair is matched as soon as both of its
+    images are described, while the next ones are still being decoded. The queues between the stages
+    are bounded (PP.queueCapacity), so a slow stage makes the ones before it wait instead of piling up
+    images. The decoded images themselves are kept until the end since the single final warp needs them;
+    they are decoded into pooled buffers (image_ingest.h) with their gray made once, and go back to the
+    pool when the panorama is done.
+    report (optional) gets the busy / idle / blocked time and the occupancy of every stage.
+    sink (optional): the panorama goes there tile by tile like in stitch().
+    */
+    Mat stitch_paths(const vector<string> &paths, const PipelineParameters &PP = {}, PipelineReport *report = nullptr,
+                     TileSink *sink = nullptr){
+        TRACE_SCOPE("stitch_paths");
+        const int n = (int)paths.size();
+        int64 start = getTickCount();
+        store.clear();
+        pairList.clear();
+        global.assign(n, Mat());
+        if (n == 0) return Mat();
+        refIndex = (P.reference >= 0 && P.reference < n) ? P.reference : n / 2;
+
+        vector<IngestedImage> inputs(n);
+        vector<PairwiseMatch> candidates = candidatePairs(n);
+        vector<char> described(n, 0), taken(candidates.size(), 0);
+        mutex storeMutex;
+
+        StageStats decodeStats("decode", PP.decodeWorkers), featureStats("features", PP.featureWorkers),
+                   matchStats("match", PP.matchWorkers), warpStats("warp", 1);
+        BoundedQueue<int> decoded(PP.queueCapacity), ready(PP.queueCapacity);
+        atomic<int> nextPath(0);
+        // a stage that throws closes both queues: the stages before it stop pushing, the ones after it drain
+        auto abort = [&]{
+            decoded.close();
+            ready.close();
+        };
+
+        {
+            // decode: every worker takes the next path; an unreadable image still goes on (empty)
+            StageWorkers decode(decodeStats, [&]{
+                for (int i = nextPath++; i < n; i = nextPath++){
+                    stage_timed(decodeStats, [&]{ inputs[i] = ingest_image(paths[i]); });
+                    if (!decoded.push(i, &decodeStats)) break;
+                }
+            }, [&]{ decoded.close(); }, abort);
+
+            // features of every decoded image, into the store
+            // (every worker of the features and match stages leases an arena for its scratch buffers, see frame_arena.h)
+            StageWorkers features(featureStats, [&]{
+                ArenaLease arena;
+                int i;
+                while (decoded.pop(i, &featureStats)){
+                    stage_timed(featureStats, [&]{
+                        ImageFeatures f;
+                        if (!inputs[i].empty()) f = FeatureStore::compute(inputs[i].gray, store.parameters());
+                        lock_guard<mutex> lock(storeMutex);
+                        store.insert(i, std::move(f));
+                    });
+                    if (!ready.push(i, &featureStats)) break;
+                }
+            }, [&]{ ready.close(); }, abort);
+
+            // every pair whose two images are described, taken by the worker that completes it
+            StageWorkers match(matchStats, [&]{
+                ArenaLease arena;
+                int i;
+                while (ready.pop(i, &matchStats)){
+                    stage_timed(matchStats, [&]{
+                        vector<int> mine;
+                        {
+                            lock_guard<mutex> lock(storeMutex);
+                            described[i] = 1;
+                            for (size_t k = 0; k < candidates.size(); k++)
+                                if (!taken[k] && described[candidates[k].a] && described[candidates[k].b]){
+                                    taken[k] = 1;
+                                    mine.push_back((int)k);
+                                }
+                        }
+                        for (int k : mine){
+                            PairwiseMatch &m = candidates[k];
+                            const ImageFeatures *fa, *fb;
+                            {
+                                lock_guard<mutex> lock(storeMutex);
+                                fa = &store.at(m.a);
+                                fb = &store.at(m.b);
+                            }
+                            estimatePair(m, *fa, *fb, inputs[m.a].gray, inputs[m.b].gray);
+                        }
+                    });
+                }
+            }, []{}, abort);
+
+            decode.join();
+            features.join();
+            match.join();
+            // the first stage that failed fails the whole call (run_job records it), once the buffers are back in the pool
+            try {
+                decode.rethrow();
+                features.rethrow();
+                match.rethrow();
+            } catch (...){
+                for (auto &in : inputs) release_image(in);
+                throw;
+            }
+        }
+
+        PipelineReport rep;
+        for (int i = 0; i < n; i++)
+            if (inputs[i].empty()) rep.unreadable.push_back(paths[i]);
+
+        Mat panorama;
+        if (rep.unreadable.empty()){
+            keepPairs(candidates);
+            stage_timed(warpStats, [&]{
+                composeTransforms(n);
+                vector<Mat> images(n);
+                for (int i = 0; i < n; i++) images[i] = inputs[i].color;
+                panorama = composite(images, sink);
+            });
+        }
+        for (auto &in : inputs) release_image(in);
+
+        if (report){
+            rep.wallMs = (getTickCount() - start) * 1000.0 / getTickFrequency();
+            for (const StageStats *st : {&decodeStats, &featureStats, &matchStats, &warpStats})
+                rep.add(*st);
+            *report = rep;
+        }
+        return panorama;
+    }
+
+    /* image i -> final canvas (empty if image i couldn't be connected to the reference) */
+    const vector<Mat> &transforms() const { return global; }
+    const vector<PairwiseMatch> &pairs() const { return pairList; }
+    int reference() const { return refIndex; }
+    Size canvasSize() const { return canvas; }
+
+private:
+    /* all the (a, b) pairs that are tried: b - a between 1 and P.neighbours */
+    vector<PairwiseMatch> candidatePairs(int n) const{
+        vector<PairwiseMatch> candidates;
+        for (int a = 0; a < n; a++)
+            for (int b = a + 1; b <= std::min(a + std::max(P.neighbours, 1), n - 1); b++){
+                PairwiseMatch m;
+                m.a = a;
+                m.b = b;
+                candidates.push_back(m);
+            }
+        return candidates;
+    }
+
+    /* match + RANSAC of one pair (grayA / grayB for the refinement), m.H_BtoA stays empty if it fails */
+    void estimatePair(PairwiseMatch &m, const ImageFeatures &fa, const ImageFeatures &fb,
+                      const Mat &grayA, const Mat &grayB) const{
+        TRACE_SCOPE("pair");
+        if (fa.descriptors.empty() || fb.descriptors.empty()) return;
+
+        // features from a pyramid level: the keypoints are scaled up, so their errors too
+        int level = std::max(fa.level, fb.level);
+        RansacParameters R = P.ransac;
+        R.maxDistance *= ImagePyramid::scale(level);
+        R.guided.radius *= ImagePyramid::scale(level);
+
+        // global matching, or guided by the sparse pass when P.ransac.guided is on (pairs stay independent)
+        vector<DMatch> &good = frame_arena().vec<DMatch>(ARENA_PAIR_MATCHES);
+        vector<char> mask;
+        Mat H = matchAndEstimateHomography(fa, fb, R, good, mask);
+        if (H.empty()) return;
+
+        // the proxy homography is only as good as the proxy pixels: refine it at full resolution
+        if (level > 0 && P.align.refine){
+            vector<Point2f> seeds;
+            for (size_t j = 0; j < good.size(); j++)
+                if (mask[j]) seeds.push_back(fa.pt(good[j].queryIdx));
+            AlignmentParameters A = P.align;
+            A.searchRadius = refine_search_radius(P.align, level);
+            H = refine_homography(grayA, grayB, H, seeds, A, P.ransac);
+        }
+
+        m.H_BtoA = H;
+        m.inliers = (int)count(mask.begin(), mask.end(), 1);
+    }
+
+    void estimatePairs(const vector<Mat> &gray){
+        vector<PairwiseMatch> candidates = candidatePairs((int)gray.size());
+
+        parallel_for_(Range(0, (int)candidates.size()), [&](const Range &r){
+            for (int i = r.start; i < r.end; i++){
+                PairwiseMatch &m = candidates[i];
+                estimatePair(m, store.at(m.a), store.at(m.b), gray[m.a], gray[m.b]);
+            }
+        });
+        keepPairs(candidates);
+    }
+
+    void keepPairs(const vector<PairwiseMatch> &candidates){
+        for (auto &m : candidates)
+            if (!m.H_BtoA.empty() && m.inliers >= P.minInliers)
+                pairList.push_back(m);
+    }
+
+    /* Prim's algorithm on the inlier counts: always attach the unconnected image with the strongest pair */
+    void composeTransforms(int n){
+        TRACE_SCOPE("compose_transforms");
+        vector<Mat> toRef(n);
+        toRef[refIndex] = Mat::eye(3, 3, CV_64F);
+
+        for (;;){
+            int best = -1;
+            for (int i = 0; i < (int)pairList.size(); i++){
+                const PairwiseMatch &m = pairList[i];
+                if (toRef[m.a].empty() == toRef[m.b].empty()) continue; // both or none connected
+                if (best < 0 || m.inliers > pairList[best].inliers) best = i;
+            }
+            if (best < 0) break;
+
+            const PairwiseMatch &m = pairList[best];
+            if (!toRef[m.a].empty()) toRef[m.b] = toRef[m.a] * m.H_BtoA;
+            else                     toRef[m.a] = toRef[m.b] * m.H_BtoA.inv();
+        }
+
+        // canvas = bounding box of every connected image in reference coordinates
+        float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+        for (int i = 0; i < n; i++){
+            if (toRef[i].empty()) continue;
+            Size s = store.at(i).size;
+            vector<Point2f> corners = {{0, 0}, {float(s.width), 0}, {float(s.width), float(s.height)}, {0, float(s.height)}};
+            vector<Point2f> moved;
+            perspectiveTransform(corners, moved, toRef[i]);
+            for (auto &p : moved){
+                minX = std::min(minX, p.x); minY = std::min(minY, p.y);
+                maxX = std::max(maxX, p.x); maxY = std::max(maxY, p.y);
+            }
+        }
+
+        Mat T = (Mat_<double>(3, 3) << 1, 0, -minX, 0, 1, -minY, 0, 0, 1);
+        canvas = Size(int(ceil(maxX - minX)), int(ceil(maxY - minY)));
+        for (int i = 0; i < n; i++)
+            if (!toRef[i].empty()) global[i] = T * toRef[i];
+    }
+
+    /* every image warped once, tile by tile, only where it covers the canvas, blended as P.blend says (blender.h) */
+    Mat composite(const vector<Mat> &images, TileSink *sink = nullptr) const{
+        Ptr<Blender> blender = create_blender(P.blend);
+        if (!sink) return blender->blend(images, global, canvas);
+        blender->blend_to(images, global, canvas, *sink);
+        return Mat();
+    }
+
+    StitcherParameters P;
+    FeatureStore store;
+    vector<PairwiseMatch> pairList;
+    vector<Mat> global;
+    int refIndex = 0;
+    Size canvas;
+};
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef PARALLEL_BANDS_H
+#define PARALLEL_BANDS_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+/*
+Helpers to split an image into horizontal bands of rows and run them with cv::parallel_for_.
+
+The important detail: the bands only depend on the image height and the band height, never on the
+number of threads. Every band writes into its own slot and the slots are merged in band order,
+so the result is exactly the same with 1 thread or 32 (only the speed changes).
+*/
+
+// 64 rows is small enough to keep every core busy on a 1 MP image and big enough to not pay much for the halos
+const int DETECT_BAND_ROWS = 64;
+
+int band_count(int rows, int bandRows = DETECT_BAND_ROWS){
+    bandRows = std::max(bandRows, 1);
+    return (rows + bandRows - 1) / bandRows;
+}
+
+/* rows [start, end) of band i */
+Range band_range(int i, int rows, int bandRows = DETECT_BAND_ROWS){
+    bandRows = std::max(bandRows, 1);
+    return Range(i * bandRows, std::min((i + 1) * bandRows, rows));
+}
+
+/*
+Band plus `halo` rows above and below (clipped to the image): what a band needs to read when
+the filters look at neighbouring rows
+*/
+Range band_with_halo(const Range &band, int halo, int rows){
+    return Range(std::max(band.start - halo, 0), std::min(band.end + halo, rows));
+}
+
+/*
+Same as parallel_bands_collect below, with the per band vectors (at least one per band, empty) and the
+result given by the caller, so they can be buffers that are reused from frame to frame (frame_arena.h)
+*/
+template <typename T, typename Fn>
+void parallel_bands_collect_into(int rows, int bandRows, Fn fn, vector<vector<T>> &perBand, vector<T> &result){
+    int nBands = band_count(rows, bandRows);
+    CV_Assert((int)perBand.size() >= nBands);
+
+    parallel_for_(Range(0, nBands), [&](const Range &r){
+        for (int i = r.start; i < r.end; i++)
+            fn(band_range(i, rows, bandRows), perBand[i]);
+    });
+
+    size_t total = 0;
+    for (int i = 0; i < nBands; i++) total += perBand[i].size();
+
+    result.clear();
+    result.reserve(total);
+    for (int i = 0; i < nBands; i++)
+        result.insert(result.end(), perBand[i].begin(), perBand[i].end());
+}
+
+/*
+Runs fn(rows, out) for every band in parallel, each band with its own output vector,
+then concatenates the vectors in band order.
+Since each row belongs to exactly one band, nothing on a band border is lost or found twice.
+*/
+template <typename T, typename Fn>
+vector<T> parallel_bands_collect(int rows, int bandRows, Fn fn){
+    vector<vector<T>> perBand(band_count(rows, bandRows));
+    vector<T> result;
+    parallel_bands_collect_into(rows, bandRows, fn, perBand, result);
+    return result;
+}
+
+/* Same thing when every band writes straight into a shared output (different rows, so no locking) */
+template <typename Fn>
+void parallel_bands_for(int rows, int bandRows, Fn fn){
+    int nBands = band_count(rows, bandRows);
+    parallel_for_(Range(0, nBands), [&](const Range &r){
+        for (int i = r.start; i < r.end; i++)
+            fn(i, band_range(i, rows, bandRows));
+    });
+}
+
+#endif
@@ -5,10 +5,18 @@
 #include <opencv2/features2d.hpp>
 #include <vector>
 #include <algorithm>
+#include <numeric>
+#include <cstring>
 #include <cmath>
 
 #include <fast_detector.h>
 #include <fastR_detector.h>
+#include <descriptor_matcher.h>
+#include <sift_extractor.h>
+#include <feature_store.h>
+#include <tiled_compositor.h>
+#include <homography_ransac.h>
+#include <guided_matcher.h>
 
 using namespace cv;
 using namespace std;
@@ -36,63 +44,216 @@ struct RansacParameters{
     int maxIters = 2000; // maximum number of trials
     double maxDistance = 4.0; // reprojection threshold in px
     float ratio = 0.85;
+    MatcherParameters matcher; // which matching engine to use (see descriptor_matcher.h)
+    bool builtin = true; // our RANSAC (homography_ransac.h), false = cv::findHomography
+    bool prosac = true;  // builtin only: try the matches with the smallest descriptor distance first
+    GuidedMatchParameters guided; // match only around where a prior homography says (guided_matcher.h)
 };
 
+/* gray version of src; an image that is already gray is shared, not copied */
 void ensureGray(const Mat& src, Mat& gray) {
     if (src.channels() == 3) cvtColor(src, gray, COLOR_BGR2GRAY);
-    else                     gray = src.clone();
+    else                     gray = src;
 }
 
-void siftDescriptorsAt(const Mat& gray, vector<KeyPoint>& kps, Mat& desc) {
-    Ptr<SIFT> sift = SIFT::create();
-    sift->compute(gray, kps, desc);
+/* SIFT descriptors at kps, through the (per thread) persistent extractor in sift_extractor.h */
+void siftDescriptorsAt(const Mat& image, vector<KeyPoint>& kps, Mat& desc) {
+    sift_extractor().compute(image, kps, desc);
 }
 
 
 
-vector<DMatch> knnRatioMatch(const Mat &d1, const Mat &d2, float ratio = 0.8){
-    BFMatcher matcher(NORM_L2, false);
-    vector<vector<DMatch>> knn;
-    matcher.knnMatch(d1, d2, knn, 2);
+/* KNN + Lowe ratio test, the engine (brute force, FLANN, blocked SIMD) comes from M */
+vector<DMatch> knnRatioMatch(const Mat &d1, const Mat &d2, float ratio = 0.8, const MatcherParameters &M = {},
+                             MatchReport *report = nullptr){
+    return ratio_match(d1, d2, ratio, M, report);
+}
 
-    vector<DMatch> good;
-    good.reserve(knn.size());
-    for (int i = 0; i < knn.size(); i++){
-        vector<DMatch> v = knn[i];
-        if (v.size() < 2)
-            continue;
-        if (v[0].distance < ratio * v[1].distance)
-            good.push_back(v[0]);
-    }
 
-    return good;
+/*
+Estimate homography with RANSAC (keep inliers) from correspondences already gathered: (x, y) of image B
+-> (X, Y) of image A, in pixels. report (builtin only) gets iterations, inliers and time.
+*/
+Mat estimateHomographyRANSAC(const HomographyPoints& pts,
+                             const vector<float>& quality,
+                             const RansacParameters& P,
+                             vector<char>& inlierMask,
+                             RansacReport* report = nullptr)
+{
+    // we want H that maps B -> A (so src = B, dst = A)
+    if (P.builtin)
+        return find_homography_ransac(pts, quality, P.maxDistance, P.confidence, P.maxIters, P.prosac,
+                                      inlierMask, report);
+
+    // findHomography(src, dst, ...) maps src->dst, and wants arrays of points
+    TRACE_SCOPE("ransac_opencv");
+    vector<Point2f> pB(pts.size()), pA(pts.size());
+    for (int i = 0; i < pts.size(); i++) {
+        pB[i] = Point2f(pts.x[i], pts.y[i]);
+        pA[i] = Point2f(pts.X[i], pts.Y[i]);
+    }
+    Mat H = findHomography(pB, pA, RANSAC, P.maxDistance, inlierMask, P.maxIters, P.confidence);
+    TRACE_COUNT("ransac_inlier_ratio", pts.size() == 0 ? 0.0 : double(countNonZero(inlierMask)) / pts.size());
+    return H;
 }
 
+/*
+Same from the matches between two FeatureSets (queryIdx in A, trainIdx in B): the two points of every
+match are read from the x[] / y[] arrays straight into the SoA the RANSAC works on, in buffers of the
+thread's arena, so there is no KeyPoint and no Point2f copy in between.
+*/
+Mat estimateHomographyRANSAC(const FeatureSet& fA,
+                             const FeatureSet& fB,
+                             const vector<DMatch>& matches,
+                             const RansacParameters& P,
+                             vector<char>& inlierMask,
+                             RansacReport* report = nullptr)
+{
+    FrameArena& arena = frame_arena();
+    HomographyPoints& pts = arena.get<HomographyPoints>(ARENA_RANSAC_POINTS);
+    vector<float>& quality = arena.vec<float>(ARENA_RANSAC_QUALITY);
+    const int n = (int)matches.size();
+    pts.resize(n);
+    quality.resize(n);
+
+    for (int i = 0; i < n; i++) {
+        const DMatch& m = matches[i];
+        pts.x[i] = fB.x[m.trainIdx]; // image B points
+        pts.y[i] = fB.y[m.trainIdx];
+        pts.X[i] = fA.x[m.queryIdx]; // image A points
+        pts.Y[i] = fA.y[m.queryIdx];
+        quality[i] = m.distance;     // smaller = better match (PROSAC)
+    }
+    return estimateHomographyRANSAC(pts, quality, P, inlierMask, report);
+}
 
-/* Estimate homography with RANSAC (keep inliers) */
+/* Same from OpenCV keypoints */
 Mat estimateHomographyRANSAC(const vector<KeyPoint>& kA,
-                                    const vector<KeyPoint>& kB,
-                                    const vector<DMatch>& matches,
-                                    const RansacParameters& P,
-                                    vector<char>& inlierMask)
+                             const vector<KeyPoint>& kB,
+                             const vector<DMatch>& matches,
+                             const RansacParameters& P,
+                             vector<char>& inlierMask,
+                             RansacReport* report = nullptr)
+{
+    FrameArena& arena = frame_arena();
+    HomographyPoints& pts = arena.get<HomographyPoints>(ARENA_RANSAC_POINTS);
+    vector<float>& quality = arena.vec<float>(ARENA_RANSAC_QUALITY);
+    const int n = (int)matches.size();
+    pts.resize(n);
+    quality.resize(n);
+
+    for (int i = 0; i < n; i++) {
+        const DMatch& m = matches[i];
+        pts.x[i] = kB[m.trainIdx].pt.x;
+        pts.y[i] = kB[m.trainIdx].pt.y;
+        pts.X[i] = kA[m.queryIdx].pt.x;
+        pts.Y[i] = kA[m.queryIdx].pt.y;
+        quality[i] = m.distance;
+    }
+    return estimateHomographyRANSAC(pts, quality, P, inlierMask, report);
+}
+
+/*
+Prior for guided matching when there is none: the seedKeypoints strongest keypoints of A (detector
+score) matched globally against B, and the RANSAC homography of those. Empty if that fails.
+*/
+Mat seedHomography(const FeatureSet& fA, const FeatureSet& fB, const RansacParameters& P)
 {
-    vector<Point2f> pA, pB;
-    pA.reserve(matches.size());
-    pB.reserve(matches.size());
+    TRACE_SCOPE("guided_seed");
+    FrameArena& arena = frame_arena();
+    const int k = std::min(P.guided.seedKeypoints, fA.count());
+    if (k < 8) return Mat();
+
+    // the k best scores (ties by index, so it doesn't depend on the sort), then back in their order
+    vector<int>& strongest = arena.vec<int>(ARENA_GUIDED_SEEDS);
+    strongest.resize(fA.count());
+    iota(strongest.begin(), strongest.end(), 0);
+    nth_element(strongest.begin(), strongest.begin() + (k - 1), strongest.end(), [&](int a, int b) {
+        return fA.score[a] != fA.score[b] ? fA.score[a] > fA.score[b] : a < b;
+    });
+    strongest.resize(k);
+    sort(strongest.begin(), strongest.end());
+
+    Mat seeds = arena.mat(ARENA_GUIDED_SEED_DESCRIPTORS, Size(fA.descriptors.cols, k), fA.descriptors.type());
+    for (int r = 0; r < k; r++)
+        memcpy(seeds.ptr(r), fA.descriptors.ptr(strongest[r]), seeds.cols * seeds.elemSize());
+
+    MatcherParameters M = P.matcher;
+    M.norm = fA.norm;
+    vector<DMatch>& matches = arena.vec<DMatch>(ARENA_GUIDED_SEED_MATCHES);
+    ratio_match_into(seeds, fB.descriptors, P.ratio, matches, M);
+    if (matches.size() < 8) return Mat();
+    for (auto& m : matches) m.queryIdx = strongest[m.queryIdx];
+
+    vector<char> mask;
+    return estimateHomographyRANSAC(fA, fB, matches, P, mask);
+}
 
-    for (const auto& m : matches) {
-        pA.push_back(kA[m.queryIdx].pt); // image A points
-        pB.push_back(kB[m.trainIdx].pt); // image B points
+/*
+Matches and homography (B -> A) of two FeatureSets with descriptors of the same kind (their norm says
+how they are compared, whatever P.matcher.norm is).
+Without P.guided.enabled: ratio_match of everything against everything + RANSAC, as always.
+With it (guided_matcher.h):
+1) a prior: the one given, or else the homography of the sparse pass (seedHomography)
+2) guided matches around where the prior puts every keypoint of A, RANSAC on them
+3) if they don't verify the prior (fewer than minMatches, or fewer than minInlierRatio of them inliers)
+   it falls back to 1 without guidance
+good gets the matches the homography comes from and inlierMask its inliers; empty Mat if it fails
+(fewer than 8 matches, or no homography).
+*/
+Mat matchAndEstimateHomography(const FeatureSet& fA,
+                               const FeatureSet& fB,
+                               const RansacParameters& P,
+                               vector<DMatch>& good,
+                               vector<char>& inlierMask,
+                               const Mat& prior = Mat(),
+                               GuidedMatchReport* report = nullptr)
+{
+    GuidedMatchReport rep;
+    auto finish = [&](Mat H) {
+        rep.matches = (int)good.size();
+        rep.inliers = H.empty() ? 0 : (int)count(inlierMask.begin(), inlierMask.end(), 1);
+        if (report) *report = rep;
+        return H;
+    };
+    MatcherParameters M = P.matcher;
+    M.norm = fA.norm;
+    auto global = [&]() -> Mat {
+        ratio_match_into(fA.descriptors, fB.descriptors, P.ratio, good, M);
+        if (good.size() < 8) return Mat();
+        return estimateHomographyRANSAC(fA, fB, good, P, inlierMask);
+    };
+
+    good.clear();
+    inlierMask.clear();
+    if (fA.descriptors.empty() || fB.descriptors.empty()) return finish(Mat());
+    CV_Assert(fA.norm == fB.norm);
+    if (!P.guided.enabled) return finish(global());
+
+    Mat H0 = prior;
+    if (H0.empty() && P.guided.seedKeypoints > 0 && fA.count() > 2 * P.guided.seedKeypoints) {
+        H0 = seedHomography(fA, fB, P);
+        rep.seeded = !H0.empty();
     }
 
-    // findHomography(src, dst, ...) maps src->dst;
-    // we want H that maps B -> A (so src = pB, dst = pA)
-    Mat H = findHomography(pB, pA, RANSAC, P.maxDistance, inlierMask, P.maxIters, P.confidence);
-    return H;
+    if (!H0.empty()) {
+        guided_ratio_match_into(fA, fB, H0, P.ratio, P.guided.radius, good, frame_arena(), &rep.comparisons);
+        if ((int)good.size() >= std::max(P.guided.minMatches, 8)) {
+            Mat H = estimateHomographyRANSAC(fA, fB, good, P, inlierMask);
+            int inliers = (int)count(inlierMask.begin(), inlierMask.end(), 1);
+            if (!H.empty() && inliers >= P.guided.minInlierRatio * good.size()) {
+                rep.guided = true;
+                return finish(H);
+            }
+        }
+        rep.fellBack = true;
+        TRACE_COUNT("guided_fallbacks", 1);
+    }
+    return finish(global());
 }
 
-/* both images into a common canvas and max-blend */
-Mat warpAndBlendPanorama(const Mat& imgA, const Mat& imgB, const Mat& H_BtoA)
+/* both images into a common canvas and max-blend, translation (optional) gets the shift applied to A */
+Mat warpAndBlendPanorama(const Mat& imgA, const Mat& imgB, const Mat& H_BtoA, Mat* translation = nullptr)
 {
     // B corners -> A space
     vector<Point2f> cornersB = {
@@ -121,51 +282,39 @@ Mat warpAndBlendPanorama(const Mat& imgA, const Mat& imgB, const Mat& H_BtoA)
 
     // translate so everything is positive
     Mat T = (Mat_<double>(3,3) << 1,0,-minX,  0,1,-minY,  0,0,1);
+    if (translation) *translation = T;
 
     // canvas size
     int W = int(ceil(maxX - minX));
     int H = int(ceil(maxY - minY));
     Size panoSize(W, H);
 
-    // warp B with H and translation
-    Mat warpedB;
-    warpPerspective(imgB, warpedB, T * H_BtoA, panoSize);
-
-    // warp A with identity + translation
-    Mat warpedA;
-    warpPerspective(imgA, warpedA, T, panoSize);
-
-    // simple max blend (per-pixel)
-    Mat panorama;
-    max(warpedA, warpedB, panorama);
-    return panorama;
+    // warp A (identity + translation) and B (H + translation) tile by tile into the canvas,
+    // simple max blend (per-pixel), see tiled_compositor.h
+    return composite_tiled({imgA, imgB}, {T, T * H_BtoA}, panoSize);
 }
 
-/* Build a panorama using FAST keypoints */
-Mat panorama_FAST(const Mat& imgA, const Mat& imgB, const RansacParameters& P = {})
+/* Build a panorama using FAST keypoints, prior (optional, B -> A) guides the matching if P.guided is on */
+Mat panorama_FAST(const Mat& imgA, const Mat& imgB, const RansacParameters& P = {}, const Mat& prior = Mat())
 {
     // 1) detect (your FAST)
     vector<KeyPoint> kpA = my_fast_detector(imgA);
     vector<KeyPoint> kpB = my_fast_detector(imgB);
 
-    // 2) describe at those KPs (SIFT)
-    Mat gA, gB; 
-    ensureGray(imgA, gA); 
-    ensureGray(imgB, gB);
-    Mat dA, dB;
+    // 2) describe at those KPs (SIFT), the extractor does the grayscale itself
+    FeatureSet fA, fB;
 
-    siftDescriptorsAt(gA, kpA, dA);
-    siftDescriptorsAt(gB, kpB, dB);
-    
-    if (dA.empty() || dB.empty()) return Mat();
+    siftDescriptorsAt(imgA, kpA, fA.descriptors);
+    siftDescriptorsAt(imgB, kpB, fB.descriptors);
+    from_keypoints(kpA, fA);
+    from_keypoints(kpB, fB);
 
-    // 3) match
-    vector<DMatch> good = knnRatioMatch(dA, dB, P.ratio);
-    if (good.size() < 8) return Mat(); // need enough for a homography
+    if (fA.descriptors.empty() || fB.descriptors.empty()) return Mat();
 
-    // 4) RANSAC homography
+    // 3) match (globally, or guided) + 4) RANSAC homography, needs at least 8 matches
+    vector<DMatch> good;
     vector<char> inliers;
-    Mat H_BtoA = estimateHomographyRANSAC(kpA, kpB, good, P, inliers);
+    Mat H_BtoA = matchAndEstimateHomography(fA, fB, P, good, inliers, prior);
     if (H_BtoA.empty()) return Mat();
 
     // 5) warp & blend
@@ -173,30 +322,81 @@ Mat panorama_FAST(const Mat& imgA, const Mat& imgB, const RansacParameters& P =
 }
 
 
-Mat panorama_FASTR(const Mat& imgA, const Mat& imgB, const RansacParameters& P = {})
+/* Same with FASTR keypoints, prior (optional, B -> A) guides the matching if P.guided is on */
+Mat panorama_FASTR(const Mat& imgA, const Mat& imgB, const RansacParameters& P = {}, const Mat& prior = Mat())
 {
     // 1) detect (your FASTR)
     vector<KeyPoint> kpA = my_fastR_detector(imgA);
     vector<KeyPoint> kpB = my_fastR_detector(imgB);
 
     // 2) describe (SIFT)
-    Mat gA, gB; ensureGray(imgA, gA); ensureGray(imgB, gB);
-    Mat dA, dB;
-    siftDescriptorsAt(gA, kpA, dA);
-    siftDescriptorsAt(gB, kpB, dB);
-    if (dA.empty() || dB.empty()) return Mat();
+    FeatureSet fA, fB;
 
-    // 3) match
-    vector<DMatch> good = knnRatioMatch(dA, dB, P.ratio);
-    if (good.size() < 7) return Mat();
+    siftDescriptorsAt(imgA, kpA, fA.descriptors);
+    siftDescriptorsAt(imgB, kpB, fB.descriptors);
+    from_keypoints(kpA, fA);
+    from_keypoints(kpB, fB);
 
-    // 4) RANSAC homography
+    if (fA.descriptors.empty() || fB.descriptors.empty()) return Mat();
+
+    // 3) match (globally, or guided) + 4) RANSAC homography, needs at least 8 matches
+    vector<DMatch> good;
     vector<char> inliers;
-    Mat H_BtoA = estimateHomographyRANSAC(kpA, kpB, good, P, inliers);
+    Mat H_BtoA = matchAndEstimateHomography(fA, fB, P, good, inliers, prior);
     if (H_BtoA.empty()) return Mat();
 
     // 5) warp & blend
     return warpAndBlendPanorama(imgA, imgB, H_BtoA);
 }
 
+/*
+Panorama of a chain of images: images[order[0]], images[order[1]], ... each one overlapping the previous.
+Doing it with panorama_FAST(panorama, next) detects and describes the whole (growing) panorama again at
+every step. Here the features of every image come from the store (so they are computed once per image,
+on the original image) and image N is matched only against image N-1, whose keypoints are moved into the
+panorama with its accumulated homography. So the homography we get maps image N straight into the panorama.
+Adding an image costs one detection + description and one match.
+
+The image IDs in the store are the indices in images. If homographies is given it gets, for every image in
+order, the homography from that image to the final panorama. Returns an empty Mat if a step fails.
+*/
+Mat panorama_chain(const vector<Mat>& images, const vector<int>& order, FeatureStore& store,
+                   const RansacParameters& P = {}, vector<Mat>* homographies = nullptr)
+{
+    if (order.empty()) return Mat();
+
+    Mat panorama = images[order[0]].clone();
+    vector<Mat> H(1, Mat::eye(3, 3, CV_64F)); // image -> current panorama
+    store.get(order[0], images[order[0]]);
+
+    for (size_t i = 1; i < order.size(); i++){
+        int prev = order[i - 1], cur = order[i];
+        const ImageFeatures& fPrev = store.get(prev, images[prev]);
+        const ImageFeatures& fCur = store.get(cur, images[cur]);
+        if (fPrev.descriptors.empty() || fCur.descriptors.empty()) return Mat();
+
+        // previous image's keypoints, already in panorama coordinates
+        FeatureSet fPrevPano = store.mapped_features(prev, H.back());
+
+        // guided matching: the camera keeps moving like it did between the two previous images,
+        // so cur -> prev ~ prev -> the one before, and cur -> panorama ~ H.back() * that
+        Mat prior;
+        if (P.guided.enabled && H.size() >= 2) prior = H.back() * H[H.size() - 2].inv() * H.back();
+
+        vector<DMatch> good;
+        vector<char> inliers;
+        Mat H_curToPano = matchAndEstimateHomography(fPrevPano, fCur, P, good, inliers, prior);
+        if (H_curToPano.empty()) return Mat();
+
+        // the panorama grows (and moves) so every homography we have gets the same translation
+        Mat T;
+        panorama = warpAndBlendPanorama(panorama, images[cur], H_curToPano, &T);
+        for (auto& h : H) h = T * h;
+        H.push_back(T * H_curToPano);
+    }
+
+    if (homographies) *homographies = H;
+    return panorama;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,123 @@
+#ifndef SIFT_EXTRACTOR_H
+#define SIFT_EXTRACTOR_H
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/features2d.hpp>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "trace.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+SIFT descriptors at keypoints we already have (FAST / FASTR), with one extractor that lives for the
+whole run instead of a SIFT::create() on every call.
+
+Why it is cheaper than sift->compute(gray, kps, desc) on the whole image:
+- Our keypoints are all octave 0, layer 0. With given keypoints OpenCV's SIFT still builds the Gaussian
+  pyramid, nOctaveLayers + 3 blurred copies of the image, but the descriptors only read the first one.
+  With nOctaveLayers = 1 it builds 4 instead of 6 and the first one is exactly the same image.
+- The keypoints are split in bands of rows and every band is computed on its own crop of the image
+  (plus a margin as big as the descriptor window and the blur), in parallel. So the pyramid is only
+  built where there are keypoints, and by several threads.
+The descriptors are the same as with the whole image: inside the margin the crop has the same pixels.
+Keypoints from other octaves (e.g. from OpenCV's own SIFT detector) just go to a normal SIFT.
+
+The gray buffer is reused between calls, so an extractor is meant to be used by one thread at a time
+(sift_extractor() gives one per thread).
+*/
+class SiftExtractor{
+public:
+    explicit SiftExtractor(int bandRows = 512)
+        : sift(SIFT::create()), baseSift(SIFT::create(0, 1)), bandRows(std::max(bandRows, 1)){}
+
+    void compute(const Mat &image, vector<KeyPoint> &kps, Mat &desc){
+        TRACE_SCOPE("sift_describe");
+        TRACE_COUNT("keypoints", kps.size()); // every image's keypoints go through here once
+        // a gray input is read in place: the buffer is only ever written by cvtColor, never made to share the caller's pixels
+        if (image.channels() == 3) cvtColor(image, grayBuffer, COLOR_BGR2GRAY);
+        const Mat &gray = image.channels() == 3 ? grayBuffer : image;
+
+        if (kps.empty()){
+            desc.release();
+            return;
+        }
+
+        bool baseOnly = true;
+        float maxSize = 0;
+        for (const auto &kp : kps){
+            if (kp.octave != 0) baseOnly = false;
+            maxSize = std::max(maxSize, kp.size);
+        }
+        if (!baseOnly){
+            sift->compute(gray, kps, desc);
+            return;
+        }
+
+        /* Descriptor window radius at octave 0 (3 * size/2 per histogram cell, 4 cells + 1, times sqrt(2), as in OpenCV's
+        calcSIFTDescriptor) + the support of the initial blur and the gradient */
+        int margin = cvCeil(3.0 * maxSize * 0.5 * 1.4142135623730951 * (4 + 1) * 0.5) + 16;
+
+        // bands of rows, each one with the keypoints inside it
+        int nBands = (gray.rows + bandRows - 1) / bandRows;
+        vector<vector<int>> members(nBands);
+        for (int i = 0; i < (int)kps.size(); i++){
+            int b = std::min(std::max(cvFloor(kps[i].pt.y) / bandRows, 0), nBands - 1);
+            members[b].push_back(i);
+        }
+
+        vector<Mat> bandDesc(nBands);
+        vector<char> sameCount(nBands, 1);
+
+        parallel_for_(Range(0, nBands), [&](const Range &r){
+            for (int b = r.start; b < r.end; b++){
+                if (members[b].empty()) continue;
+
+                int y0 = std::max(b * bandRows - margin, 0);
+                int y1 = std::min((b + 1) * bandRows + margin, gray.rows);
+                Mat crop = gray.rowRange(y0, y1);
+
+                vector<KeyPoint> local;
+                local.reserve(members[b].size());
+                for (int i : members[b]){
+                    KeyPoint kp = kps[i];
+                    kp.pt.y -= float(y0);
+                    local.push_back(kp);
+                }
+
+                baseSift->compute(crop, local, bandDesc[b]);
+                if (local.size() != members[b].size() || bandDesc[b].rows != (int)local.size())
+                    sameCount[b] = 0;
+            }
+        });
+
+        // SIFT is allowed to drop keypoints, if it did the rows don't line up anymore: do it the plain way
+        for (int b = 0; b < nBands; b++){
+            if (!sameCount[b]){
+                baseSift->compute(gray, kps, desc);
+                return;
+            }
+        }
+
+        desc.create((int)kps.size(), baseSift->descriptorSize(), baseSift->descriptorType());
+        for (int b = 0; b < nBands; b++)
+            for (int j = 0; j < (int)members[b].size(); j++)
+                bandDesc[b].row(j).copyTo(desc.row(members[b][j]));
+    }
+
+private:
+    Ptr<SIFT> sift;      // default SIFT, for keypoints that are not octave 0
+    Ptr<SIFT> baseSift;  // nOctaveLayers = 1, enough for octave 0 keypoints
+    Mat grayBuffer;      // reused between calls (BGR inputs only)
+    int bandRows;
+};
+
+/* The extractor of the calling thread, created the first time it is used */
+SiftExtractor &sift_extractor(){
+    thread_local SiftExtractor extractor;
+    return extractor;
+}
+
+#endif
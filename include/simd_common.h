@@ -0,0 +1,64 @@
+#ifndef SIMD_COMMON_H
+#define SIMD_COMMON_H
+
+/* The intrinsics headers depend on the architecture we are compiling for */
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIMD_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SIMD_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* With GCC/Clang we can compile a single function for AVX2 without passing -mavx2 to the
+whole project, that way the binary still runs on machines without AVX2 (we just never call it there).
+The CPU check itself is done at runtime with cv::checkHardwareSupport */
+#if defined(__GNUC__) || defined(__clang__)
+#define SIMD_TARGET_SSE2 __attribute__((target("sse2")))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#define SIMD_TARGET_AVX512_POPCNT __attribute__((target("avx512f,avx512vl,avx512vpopcntdq")))
+#else
+#define SIMD_TARGET_SSE2
+#define SIMD_TARGET_AVX2
+#define SIMD_TARGET_AVX512_POPCNT
+#endif
+
+/* index of the lowest set bit (mask can't be 0) */
+inline int simd_lowest_bit(unsigned mask){
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while (!(mask & 1u)){
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+/* number of set bits */
+inline int simd_popcount(unsigned mask){
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcount(mask);
+#else
+    int n = 0;
+    for (; mask; mask &= mask - 1) n++;
+    return n;
+#endif
+}
+
+/* number of set bits of a 64 bit word */
+inline int simd_popcount64(unsigned long long x){
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    int n = 0;
+    for (; x; x &= x - 1) n++;
+    return n;
+#endif
+}
+
+#endif
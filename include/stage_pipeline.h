@@ -0,0 +1,185 @@
+#ifndef STAGE_PIPELINE_H
+#define STAGE_PIPELINE_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <deque>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <cstdio>
+
+using namespace cv;
+using namespace std;
+
+/*
+Pieces for a staged pipeline: every stage has its own worker threads and the stages talk through
+bounded queues. A full queue makes the stage before it wait (backpressure), so only a few items are
+ever in flight no matter how many there are in total, and while one stage waits on its input (e.g.
+PNG decoding) the others keep working on the items they already have.
+
+Every stage keeps StageStats: how long its workers were busy, waiting for input (idle) and waiting
+for room in the next queue (blocked). The stage whose workers are busy all the time is the bottleneck,
+a stage that is mostly blocked has more workers than it needs.
+*/
+
+struct StageStats{
+    string name;
+    int workers = 1;
+    atomic<long> items{0};
+    atomic<int64> busy{0}, idle{0}, blocked{0}; // ticks, summed over the workers
+
+    StageStats(const string &name = "", int workers = 1) : name(name), workers(workers){}
+};
+
+/* FIFO with a maximum size, push waits while it's full and pop while it's empty */
+template <typename T>
+class BoundedQueue{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(std::max<size_t>(capacity, 1)){}
+
+    /* false if the queue was closed (the item is dropped) */
+    bool push(T item, StageStats *stats = nullptr){
+        int64 start = getTickCount();
+        unique_lock<mutex> lock(m);
+        notFull.wait(lock, [&]{ return items.size() < capacity || closed; });
+        if (stats) stats->blocked += getTickCount() - start;
+        if (closed) return false;
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    /* false once the queue is closed and empty */
+    bool pop(T &item, StageStats *stats = nullptr){
+        int64 start = getTickCount();
+        unique_lock<mutex> lock(m);
+        notEmpty.wait(lock, [&]{ return !items.empty() || closed; });
+        if (stats) stats->idle += getTickCount() - start;
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    /* no more pushes: the consumers finish what's left and then pop returns false */
+    void close(){
+        lock_guard<mutex> lock(m);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+private:
+    size_t capacity;
+    deque<T> items;
+    bool closed = false;
+    mutex m;
+    condition_variable notEmpty, notFull;
+};
+
+/*
+Starts stats.workers threads running body(). When the last one returns, onFinish() is called
+(normally to close the queue of the next stage). join() waits for all of them.
+An exception thrown by body() doesn't leave the thread (that would terminate the process): the first
+one is kept for rethrow() and onError() is called (normally to close the stage's queues, so the stages
+around it stop waiting on it); onFinish() is still called when the last worker is done.
+*/
+class StageWorkers{
+public:
+    template <typename Body, typename Finish>
+    StageWorkers(StageStats &stats, Body body, Finish onFinish) : StageWorkers(stats, body, onFinish, []{}){}
+
+    template <typename Body, typename Finish, typename Error>
+    StageWorkers(StageStats &stats, Body body, Finish onFinish, Error onError){
+        remaining = std::max(stats.workers, 1);
+        for (int w = 0; w < std::max(stats.workers, 1); w++){
+            threads.emplace_back([this, body, onFinish, onError]() mutable {
+                try {
+                    body();
+                } catch (...){
+                    {
+                        lock_guard<mutex> lock(errorMutex);
+                        if (!error) error = current_exception();
+                    }
+                    onError();
+                }
+                if (--remaining == 0) onFinish();
+            });
+        }
+    }
+
+    void join(){
+        for (auto &t : threads)
+            if (t.joinable()) t.join();
+    }
+
+    /* after join(): throws the first exception of the workers, if there was one */
+    void rethrow(){
+        lock_guard<mutex> lock(errorMutex);
+        if (error) rethrow_exception(error);
+    }
+
+    ~StageWorkers(){ join(); }
+
+private:
+    vector<thread> threads;
+    atomic<int> remaining{0};
+    mutex errorMutex;
+    exception_ptr error;
+};
+
+/* runs fn on an item and adds the time to the stage's busy time */
+template <typename Fn>
+void stage_timed(StageStats &stats, Fn fn){
+    int64 start = getTickCount();
+    fn();
+    stats.busy += getTickCount() - start;
+    stats.items++;
+}
+
+struct StageSummary{
+    string name;
+    int workers = 0;
+    long items = 0;
+    double busyMs = 0, idleMs = 0, blockedMs = 0;
+    double occupancy = 0; // busy time / (wall time * workers)
+};
+
+struct PipelineReport{
+    double wallMs = 0;
+    vector<StageSummary> stages;
+    vector<string> unreadable; // inputs that couldn't be decoded
+
+    void add(const StageStats &s){
+        double toMs = 1000.0 / getTickFrequency();
+        StageSummary r;
+        r.name = s.name;
+        r.workers = s.workers;
+        r.items = s.items;
+        r.busyMs = s.busy * toMs;
+        r.idleMs = s.idle * toMs;
+        r.blockedMs = s.blocked * toMs;
+        r.occupancy = wallMs > 0 ? r.busyMs / (wallMs * std::max(s.workers, 1)) : 0;
+        stages.push_back(r);
+    }
+
+    /* one line per stage, for a terminal */
+    string table() const{
+        string out = "stage      workers  items   busy ms   idle ms  blocked ms  occupancy\n";
+        char line[160];
+        for (const auto &s : stages){
+            snprintf(line, sizeof(line), "%-10s %7d %6ld %9.1f %9.1f %11.1f %9.0f%%\n", s.name.c_str(), s.workers, s.items,
+                     s.busyMs, s.idleMs, s.blockedMs, 100.0 * s.occupancy);
+            out += line;
+        }
+        snprintf(line, sizeof(line), "wall %.1f ms\n", wallMs);
+        return out + line;
+    }
+};
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef TILED_COMPOSITOR_H
+#define TILED_COMPOSITOR_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+#include "trace.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+Tiled warp + max blend.
+The straightforward way (warpPerspective every image into its own full canvas, then max of the canvases)
+needs one canvas per image plus the result, and for a wide panorama most of those pixels are just black.
+Here the output canvas is the only big buffer: it is walked in tiles, for each tile only the images whose
+warped footprint touches it are warped (straight into a tile sized buffer) and max-blended in.
+Tiles are independent so they run in parallel, the extra memory is one tile buffer per thread.
+*/
+
+const int COMPOSITE_TILE = 256;
+
+/* Bounding box of an image of size s warped by H, 1 extra pixel for the interpolation, clipped to the canvas */
+Rect warped_footprint(Size s, const Mat &H, Size canvas){
+    vector<Point2f> corners = {{0, 0}, {float(s.width), 0}, {float(s.width), float(s.height)}, {0, float(s.height)}};
+    vector<Point2f> moved;
+    perspectiveTransform(corners, moved, H);
+    Rect box = boundingRect(moved);
+    box = Rect(box.x - 1, box.y - 1, box.width + 2, box.height + 2);
+    return box & Rect(Point(0, 0), canvas);
+}
+
+/*
+Where finished tiles go when the canvas is too big to be one Mat (tiled_output.h writes them to disk).
+The blenders (blender.h) walk the canvas on the sink's tile grid, one row of tiles at a time, and call
+write() from their worker threads as soon as a tile is done, so a sink can compress tiles in parallel;
+it has to lock whatever it shares. Tiles are written once each, tile.x / tile.y are multiples of
+tileSize() and the tiles on the right / bottom border are cut to the canvas.
+*/
+class TileSink{
+public:
+    virtual ~TileSink(){}
+    virtual int tileSize() const = 0;
+    /* before the first tile: size and type (CV_8UC1 or CV_8UC3, BGR) of the whole canvas */
+    virtual void begin(Size canvas, int type) = 0;
+    /* the pixels of one tile of the grid (any thread) */
+    virtual void write(const Rect &tile, const Mat &pixels) = 0;
+    /* after the last tile */
+    virtual void finish() = 0;
+};
+
+/* the part of every image that reaches this tile of the canvas, max blended into out (tile sized, zeros to start with) */
+void composite_tile(const vector<Mat> &images, const vector<Mat> &H, const vector<Rect> &footprint,
+                    const Rect &tile, Mat &out, Mat &warped){
+    for (size_t i = 0; i < images.size(); i++){
+        Rect part = footprint[i] & tile;
+        if (part.empty()) continue;
+
+        // only the part of the tile the image covers, in canvas coordinates shifted to its corner
+        Mat shift = (Mat_<double>(3, 3) << 1, 0, -part.x, 0, 1, -part.y, 0, 0, 1);
+        warpPerspective(images[i], warped, shift * H[i], part.size());
+
+        Mat roi = out(Rect(part.x - tile.x, part.y - tile.y, part.width, part.height));
+        max(roi, warped, roi);
+    }
+}
+
+/*
+images[i] warped by H[i] (image -> canvas, empty = skip the image) into a canvas of the given size,
+max blended like warpAndBlendPanorama. All images must have the same type.
+*/
+Mat composite_tiled(const vector<Mat> &images, const vector<Mat> &H, Size canvas, int tileSize = COMPOSITE_TILE){
+    CV_Assert(!images.empty() && images.size() == H.size());
+
+    TRACE_SCOPE("composite");
+    tileSize = std::max(tileSize, 16);
+    Mat panorama(canvas, images[0].type(), Scalar::all(0));
+    TRACE_COUNT("canvas_pixels", canvas.area());
+    TRACE_BYTES(panorama);
+
+    vector<Rect> footprint(images.size());
+    for (size_t i = 0; i < images.size(); i++)
+        if (!H[i].empty()) footprint[i] = warped_footprint(images[i].size(), H[i], canvas);
+
+    const int tilesX = (canvas.width + tileSize - 1) / tileSize;
+    const int tilesY = (canvas.height + tileSize - 1) / tileSize;
+
+    parallel_for_(Range(0, tilesX * tilesY), [&](const Range &r){
+        TRACE_SCOPE("composite_tiles");
+        Mat warped; // reused by every tile of this chunk
+        for (int t = r.start; t < r.end; t++){
+            Rect tile((t % tilesX) * tileSize, (t / tilesX) * tileSize, tileSize, tileSize);
+            tile &= Rect(Point(0, 0), canvas);
+            Mat out = panorama(tile);
+            composite_tile(images, H, footprint, tile, out, warped);
+        }
+    });
+    return panorama;
+}
+
+#endif
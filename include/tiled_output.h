@@ -0,0 +1,316 @@
+#ifndef TILED_OUTPUT_H
+#define TILED_OUTPUT_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <fstream>
+#include <filesystem>
+#include <zlib.h>
+#include "tiled_compositor.h"
+#include "trace.h"
+
+using namespace cv;
+using namespace std;
+
+/*
+Panoramas written to disk tile by tile, for canvases that don't fit in memory.
+A gigapixel canvas is tens of GB as one Mat, and imwrite then encodes it on a single thread. The blenders
+can hand their tiles to a TileSink instead (Blender::blend_to, one row of tiles in memory at a time),
+and the sinks here write every tile as soon as it is blended, compressed by the worker that made it:
+- BigTiffSink (.tif / .tiff): one tiled BigTIFF (64-bit offsets, so no 4 GB limit), tiles compressed
+  with Deflate + horizontal predictor (zlib, in parallel); only the file writes take a lock. The header
+  and the tile tables are written first and every tile's entry is filled in when it lands, so the file
+  is a valid TIFF at any moment (tiles that aren't there yet have 0 bytes)
+- DeepZoomSink (.dzi): a DeepZoom image pyramid (what OpenSeadragon and most tile viewers read), the
+  .dzi descriptor and one JPEG / PNG per tile and level under <name>_files/<level>/<col>_<row>.jpg. The
+  levels below the full resolution one are made from the tiles above them: every tile is halved into
+  its parent, and a parent is written (and halved in turn) as soon as its last child arrived, so only the
+  parents still waiting for children are kept (about a row of tiles per level). The descriptor is
+  written first, so the panorama can be looked at while it is being made
+The memory doesn't depend on the canvas size any more; the source images are still all in memory.
+*/
+
+struct TiledOutputParameters{
+    int tileSize = 256;       // side of the tiles (BigTIFF: rounded up to a multiple of 16, DeepZoom: to an even number)
+    int deflateLevel = 6;     // BigTIFF: zlib level, 0 = tiles stored uncompressed
+    string format = "jpg";    // DeepZoom: image format of the tiles, jpg or png
+    int quality = 90;         // DeepZoom: JPEG quality
+};
+
+/* little endian values appended to a buffer, for the TIFF structures */
+inline void put_le(vector<uchar> &b, uint64_t v, int bytes){
+    for (int i = 0; i < bytes; i++) b.push_back(uchar(v >> (8 * i)));
+}
+
+class BigTiffSink : public TileSink{
+public:
+    explicit BigTiffSink(const string &path, const TiledOutputParameters &P = {})
+        : path(path), ts((std::max(P.tileSize, 16) + 15) / 16 * 16), level(std::min(std::max(P.deflateLevel, 0), 9)){}
+
+    ~BigTiffSink() override{
+        if (file) fclose(file);
+    }
+
+    int tileSize() const override { return ts; }
+
+    void begin(Size canvas, int type) override{
+        CV_Assert(type == CV_8UC1 || type == CV_8UC3);
+        size = canvas;
+        channels = CV_MAT_CN(type);
+        tilesX = (canvas.width + ts - 1) / ts;
+        tilesY = (canvas.height + ts - 1) / ts;
+        const uint64_t tiles = (uint64_t)tilesX * tilesY;
+        failed = false;
+
+        file = fopen(path.c_str(), "wb");
+        if (!file) CV_Error(Error::StsError, "can't write " + path);
+
+        /*
+        header (16 bytes), then the IFD, then the TileOffsets and TileByteCounts tables (LONG8), then the
+        tiles in the order they come. An entry is tag, type, count and the value itself when it fits in
+        8 bytes, otherwise where it is.
+        */
+        struct Entry{ uint16_t tag, type; uint64_t count, value; };
+        const uint16_t SHORT = 3, LONG = 4, LONG8 = 16;
+        uint64_t bits = 0;
+        for (int c = 0; c < channels; c++) bits |= uint64_t(8) << (16 * c); // 8, 8, 8 as SHORTs
+
+        vector<Entry> entries = {
+            {256, LONG, 1, (uint64_t)canvas.width},           // ImageWidth
+            {257, LONG, 1, (uint64_t)canvas.height},          // ImageLength
+            {258, SHORT, (uint64_t)channels, bits},           // BitsPerSample
+            {259, SHORT, 1, uint64_t(level ? 8 : 1)},         // Compression: Deflate / none
+            {262, SHORT, 1, uint64_t(channels == 3 ? 2 : 1)}, // PhotometricInterpretation: RGB / BlackIsZero
+            {277, SHORT, 1, (uint64_t)channels},              // SamplesPerPixel
+            {284, SHORT, 1, 1},                               // PlanarConfiguration: interleaved
+        };
+        if (level) entries.push_back({317, SHORT, 1, 2});     // Predictor: horizontal differencing
+        entries.push_back({322, LONG, 1, (uint64_t)ts});      // TileWidth
+        entries.push_back({323, LONG, 1, (uint64_t)ts});      // TileLength
+
+        const uint64_t ifd = 16;
+        const uint64_t entriesAt = ifd + 8;
+        const uint64_t tablesAt = entriesAt + (entries.size() + 2) * 20 + 8;
+        // a single tile has its offset and byte count in the entries themselves
+        offsetsAt = tiles == 1 ? entriesAt + entries.size() * 20 + 12 : tablesAt;
+        countsAt = tiles == 1 ? entriesAt + (entries.size() + 1) * 20 + 12 : tablesAt + tiles * 8;
+        entries.push_back({324, LONG8, tiles, tiles == 1 ? 0 : offsetsAt}); // TileOffsets
+        entries.push_back({325, LONG8, tiles, tiles == 1 ? 0 : countsAt});  // TileByteCounts
+
+        vector<uchar> head;
+        head.push_back('I'); head.push_back('I');
+        put_le(head, 43, 2);  // BigTIFF
+        put_le(head, 8, 2);   // offsets are 8 bytes
+        put_le(head, 0, 2);
+        put_le(head, ifd, 8);
+        put_le(head, entries.size(), 8);
+        for (const Entry &e : entries){
+            put_le(head, e.tag, 2);
+            put_le(head, e.type, 2);
+            put_le(head, e.count, 8);
+            put_le(head, e.value, 8);
+        }
+        put_le(head, 0, 8); // no next IFD
+        if (tiles > 1) head.resize(head.size() + tiles * 16, 0);
+
+        end = head.size();
+        if (fwrite(head.data(), 1, head.size(), file) != head.size()) failed = true;
+    }
+
+    /* compressed by the calling worker, only the write into the file is locked */
+    void write(const Rect &tile, const Mat &pixels) override{
+        TRACE_SCOPE("tiff_tile");
+        CV_Assert(tile.x % ts == 0 && tile.y % ts == 0 && pixels.type() == CV_MAKETYPE(CV_8U, channels));
+
+        // a full ts x ts tile (the ones on the border are padded with zeros), RGB, then the predictor:
+        // every sample minus the same sample of the pixel on its left
+        const int rowBytes = ts * channels;
+        vector<uchar> raw((size_t)rowBytes * ts, 0);
+        for (int y = 0; y < pixels.rows; y++){
+            const uchar *p = pixels.ptr<uchar>(y);
+            uchar *r = raw.data() + (size_t)y * rowBytes;
+            if (channels == 3)
+                for (int x = 0; x < pixels.cols; x++){
+                    r[3 * x] = p[3 * x + 2];
+                    r[3 * x + 1] = p[3 * x + 1];
+                    r[3 * x + 2] = p[3 * x];
+                }
+            else memcpy(r, p, pixels.cols);
+            if (level)
+                for (int i = rowBytes - 1; i >= channels; i--) r[i] -= r[i - channels];
+        }
+
+        vector<uchar> packed;
+        const vector<uchar> *data = &raw;
+        if (level){
+            uLongf length = compressBound((uLong)raw.size());
+            packed.resize(length);
+            if (compress2(packed.data(), &length, raw.data(), (uLong)raw.size(), level) != Z_OK){
+                failed = true;
+                return;
+            }
+            packed.resize(length);
+            data = &packed;
+        }
+        TRACE_COUNT("tiff_tile_bytes", data->size());
+
+        const uint64_t index = (uint64_t)(tile.y / ts) * tilesX + tile.x / ts;
+        vector<uchar> offset, count;
+        lock_guard<mutex> lock(m);
+        put_le(offset, end, 8);
+        put_le(count, data->size(), 8);
+        bool ok = seek(end) && fwrite(data->data(), 1, data->size(), file) == data->size() &&
+                  seek(offsetsAt + index * 8) && fwrite(offset.data(), 1, 8, file) == 8 &&
+                  seek(countsAt + index * 8) && fwrite(count.data(), 1, 8, file) == 8;
+        if (!ok) failed = true;
+        end += data->size();
+    }
+
+    void finish() override{
+        bool closed = file && fclose(file) == 0;
+        file = nullptr;
+        if (failed || !closed) CV_Error(Error::StsError, "can't write " + path);
+    }
+
+private:
+    bool seek(uint64_t at){
+#if defined(_WIN32)
+        return _fseeki64(file, (long long)at, SEEK_SET) == 0;
+#else
+        return fseeko(file, (off_t)at, SEEK_SET) == 0;
+#endif
+    }
+
+    string path;
+    int ts, level;
+    Size size;
+    int channels = 3, tilesX = 0, tilesY = 0;
+    FILE *file = nullptr;
+    mutex m;
+    uint64_t end = 0, offsetsAt = 0, countsAt = 0;
+    atomic<bool> failed{false}; // set by the workers, reported by finish()
+};
+
+class DeepZoomSink : public TileSink{
+public:
+    explicit DeepZoomSink(const string &path, const TiledOutputParameters &P = {})
+        : path(path), ts((std::max(P.tileSize, 16) + 1) / 2 * 2), format(P.format), quality(P.quality){
+        size_t dot = path.find_last_of('.');
+        folder = (dot == string::npos ? path : path.substr(0, dot)) + "_files";
+    }
+
+    int tileSize() const override { return ts; }
+
+    void begin(Size canvas, int type) override{
+        CV_Assert(CV_MAT_DEPTH(type) == CV_8U);
+        failed = false;
+        pending.clear();
+
+        // level maxLevel is the canvas, every level below is half of the one above (rounded up), level 0 is 1x1
+        maxLevel = (int)std::ceil(std::log2((double)std::max(std::max(canvas.width, canvas.height), 1)));
+        levels.assign(maxLevel + 1, canvas);
+        for (int l = maxLevel - 1; l >= 0; l--)
+            levels[l] = Size((levels[l + 1].width + 1) / 2, (levels[l + 1].height + 1) / 2);
+
+        std::error_code ec;
+        for (int l = 0; l <= maxLevel; l++)
+            filesystem::create_directories(folder + "/" + to_string(l), ec);
+        if (ec) CV_Error(Error::StsError, "can't create " + folder);
+
+        ofstream dzi(path);
+        dzi << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"" << format
+            << "\" Overlap=\"0\" TileSize=\"" << ts << "\">\n"
+            << "  <Size Width=\"" << canvas.width << "\" Height=\"" << canvas.height << "\"/>\n"
+            << "</Image>\n";
+        if (!dzi) CV_Error(Error::StsError, "can't write " + path);
+    }
+
+    void write(const Rect &tile, const Mat &pixels) override{
+        TRACE_SCOPE("dzi_tile");
+        save(maxLevel, tile.x / ts, tile.y / ts, pixels);
+        reduce(maxLevel, tile.x / ts, tile.y / ts, pixels);
+    }
+
+    void finish() override{
+        // with every tile of the grid written, every parent got all of its children
+        CV_Assert(pending.empty());
+        if (failed) CV_Error(Error::StsError, "can't write the tiles of " + path);
+    }
+
+private:
+    /* a tile of level l - 1 that is waiting for some of its children */
+    struct Parent{
+        Mat pixels;
+        int received = 0;
+    };
+
+    int tilesAcross(int l) const { return (levels[l].width + ts - 1) / ts; }
+    int tilesDown(int l) const { return (levels[l].height + ts - 1) / ts; }
+
+    void save(int l, int col, int row, const Mat &pixels){
+        string file = folder + "/" + to_string(l) + "/" + to_string(col) + "_" + to_string(row) + "." + format;
+        vector<int> params;
+        if (format == "jpg" || format == "jpeg") params = {IMWRITE_JPEG_QUALITY, quality};
+        if (!imwrite(file, pixels, params)) failed = true;
+    }
+
+    /* tile (col, row) of level l halved into its parent; the parent goes on when it has all its children */
+    void reduce(int l, int col, int row, const Mat &pixels){
+        if (l == 0) return;
+        Mat half;
+        resize(pixels, half, Size((pixels.cols + 1) / 2, (pixels.rows + 1) / 2), 0, 0, INTER_AREA);
+
+        const int pc = col / 2, pr = row / 2;
+        const int children = (std::min(2 * pc + 1, tilesAcross(l) - 1) - 2 * pc + 1) *
+                             (std::min(2 * pr + 1, tilesDown(l) - 1) - 2 * pr + 1);
+        Mat done;
+        {
+            lock_guard<mutex> lock(m);
+            Parent &p = pending[make_tuple(l - 1, pr, pc)];
+            if (p.pixels.empty()){
+                Size s(std::min(ts, levels[l - 1].width - pc * ts), std::min(ts, levels[l - 1].height - pr * ts));
+                p.pixels = Mat::zeros(s, pixels.type());
+            }
+            half.copyTo(p.pixels(Rect((col % 2) * ts / 2, (row % 2) * ts / 2, half.cols, half.rows)));
+            if (++p.received == children){
+                done = p.pixels;
+                pending.erase(make_tuple(l - 1, pr, pc));
+            }
+        }
+        if (done.empty()) return;
+        save(l - 1, pc, pr, done);
+        reduce(l - 1, pc, pr, done);
+    }
+
+    string path, folder;
+    int ts;
+    string format;
+    int quality;
+    int maxLevel = 0;
+    vector<Size> levels;
+    mutex m;
+    map<tuple<int, int, int>, Parent> pending; // (level, row, col)
+    atomic<bool> failed{false};
+};
+
+/* .tif / .tiff / .dzi outputs are written tile by tile, for anything else this returns an empty Ptr */
+Ptr<TileSink> open_tile_sink(const string &path, const TiledOutputParameters &P = {}){
+    size_t dot = path.find_last_of('.');
+    string ext = dot == string::npos ? "" : path.substr(dot + 1);
+    for (auto &c : ext) c = (char)tolower(c);
+    if (ext == "tif" || ext == "tiff") return makePtr<BigTiffSink>(path, P);
+    if (ext == "dzi") return makePtr<DeepZoomSink>(path, P);
+    return Ptr<TileSink>();
+}
+
+#endif
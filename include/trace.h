@@ -0,0 +1,226 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <cstdio>
+
+using namespace cv;
+using namespace std;
+
+/*
+Tracing of the pipeline: which stage took the time, on which thread, and how much work it had.
+- TRACE_SCOPE("name") times the rest of the block (one "complete" event per call)
+- TRACE_COUNT("name", value) records a number (keypoints of an image, matches after the ratio test,
+  RANSAC iterations, canvas pixels, bytes of a big buffer...)
+Nothing is recorded until Tracer::instance().start(); before that a scope costs one relaxed atomic load
+and a counter's value isn't even computed. Building with PANO_TRACE=0 (CMake option PANORAMA_TRACE=OFF)
+removes the macros completely.
+
+Every thread writes to its own buffer (its lock is only ever contended while exporting), and the names
+must be string literals: only the pointer is kept. At the end:
+- chrome_json(): Chrome trace-event JSON, open it in chrome://tracing or ui.perfetto.dev for a timeline
+  of every stage on every thread (nested scopes stack up like a flame graph)
+- summary(): calls / total / mean / max time per scope and count / sum / mean / min / max per counter
+*/
+
+#ifndef PANO_TRACE
+#define PANO_TRACE 1
+#endif
+
+struct TraceEvent{
+    const char *name;
+    int64 start, end; // ticks
+};
+
+struct TraceSample{
+    const char *name;
+    int64 at;
+    double value;
+};
+
+struct TraceThread{
+    int tid = 0;
+    mutex m;
+    vector<TraceEvent> events;
+    vector<TraceSample> samples;
+};
+
+class Tracer{
+public:
+    static Tracer &instance(){
+        static Tracer tracer;
+        return tracer;
+    }
+
+    static bool on(){ return instance().enabled.load(memory_order_relaxed); }
+
+    /* forgets what was recorded so far and starts recording */
+    void start(){
+        clear();
+        origin = getTickCount();
+        enabled = true;
+    }
+
+    void stop(){ enabled = false; }
+
+    void clear(){
+        lock_guard<mutex> lock(m);
+        for (auto &t : threads){
+            lock_guard<mutex> tl(t->m);
+            t->events.clear();
+            t->samples.clear();
+        }
+    }
+
+    void scope(const char *name, int64 start, int64 end){
+        TraceThread &t = local();
+        lock_guard<mutex> lock(t.m);
+        t.events.push_back({name, start, end});
+    }
+
+    void count(const char *name, double value){
+        TraceThread &t = local();
+        lock_guard<mutex> lock(t.m);
+        t.samples.push_back({name, getTickCount(), value});
+    }
+
+    /* {"traceEvents": [...]}: "X" events for the scopes, "C" events for the counters, one tid per thread */
+    string chrome_json() const{
+        const double toUs = 1e6 / getTickFrequency();
+        string out = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        char buf[320];
+        bool first = true;
+        auto add = [&](const char *line){
+            if (!first) out += ",\n";
+            out += line;
+            first = false;
+        };
+
+        lock_guard<mutex> lock(m);
+        for (const auto &t : threads){
+            lock_guard<mutex> tl(t->m);
+            snprintf(buf, sizeof(buf), "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                     "\"args\": {\"name\": \"thread %d\"}}", t->tid, t->tid);
+            add(buf);
+            for (const auto &e : t->events){
+                snprintf(buf, sizeof(buf), "{\"name\": \"%s\", \"cat\": \"pano\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                         "\"ts\": %.3f, \"dur\": %.3f}", e.name, t->tid, (e.start - origin) * toUs, (e.end - e.start) * toUs);
+                add(buf);
+            }
+            for (const auto &s : t->samples){
+                snprintf(buf, sizeof(buf), "{\"name\": \"%s\", \"ph\": \"C\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, "
+                         "\"args\": {\"value\": %.6g}}", s.name, t->tid, (s.at - origin) * toUs, s.value);
+                add(buf);
+            }
+        }
+        return out + "\n]}\n";
+    }
+
+    /* one line per scope and per counter, the slowest scopes first */
+    string summary() const{
+        struct Timer{ long calls = 0; double total = 0, max = 0; };
+        struct Count{ long n = 0; double sum = 0, min = 0, max = 0; };
+        map<string, Timer> timers;
+        map<string, Count> counts;
+        const double toMs = 1000.0 / getTickFrequency();
+
+        {
+            lock_guard<mutex> lock(m);
+            for (const auto &t : threads){
+                lock_guard<mutex> tl(t->m);
+                for (const auto &e : t->events){
+                    Timer &s = timers[e.name];
+                    double ms = (e.end - e.start) * toMs;
+                    s.calls++;
+                    s.total += ms;
+                    s.max = std::max(s.max, ms);
+                }
+                for (const auto &v : t->samples){
+                    Count &c = counts[v.name];
+                    c.min = c.n ? std::min(c.min, v.value) : v.value;
+                    c.max = c.n ? std::max(c.max, v.value) : v.value;
+                    c.n++;
+                    c.sum += v.value;
+                }
+            }
+        }
+
+        vector<pair<string, Timer>> sorted(timers.begin(), timers.end());
+        sort(sorted.begin(), sorted.end(), [](const pair<string, Timer> &a, const pair<string, Timer> &b){
+            return a.second.total > b.second.total;
+        });
+
+        char line[200];
+        string out = "scope                      calls   total ms    mean ms     max ms\n";
+        for (const auto &s : sorted){
+            snprintf(line, sizeof(line), "%-24s %7ld %10.2f %10.3f %10.3f\n", s.first.c_str(), s.second.calls,
+                     s.second.total, s.second.total / s.second.calls, s.second.max);
+            out += line;
+        }
+        out += "counter                  samples        sum       mean        min        max\n";
+        for (const auto &c : counts){
+            snprintf(line, sizeof(line), "%-24s %7ld %10.4g %10.4g %10.4g %10.4g\n", c.first.c_str(), c.second.n,
+                     c.second.sum, c.second.sum / c.second.n, c.second.min, c.second.max);
+            out += line;
+        }
+        return out;
+    }
+
+private:
+    Tracer(){}
+
+    /* this thread's buffer, made the first time the thread records something */
+    TraceThread &local(){
+        thread_local TraceThread *mine = nullptr;
+        if (!mine){
+            lock_guard<mutex> lock(m);
+            threads.emplace_back(new TraceThread());
+            mine = threads.back().get();
+            mine->tid = (int)threads.size() - 1;
+        }
+        return *mine;
+    }
+
+    atomic<bool> enabled{false};
+    int64 origin = 0;
+    mutable mutex m;
+    vector<unique_ptr<TraceThread>> threads; // never shrinks, the threads keep pointers to their buffer
+};
+
+/* times its lifetime when the tracer is on */
+class TraceScope{
+public:
+    explicit TraceScope(const char *name) : label(Tracer::on() ? name : nullptr), start(label ? getTickCount() : 0){}
+    ~TraceScope(){
+        if (label) Tracer::instance().scope(label, start, getTickCount());
+    }
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+    const char *label;
+    int64 start;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#if PANO_TRACE
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope_, __LINE__)(name)
+#define TRACE_COUNT(name, value) do { if (Tracer::on()) Tracer::instance().count(name, double(value)); } while (0)
+#else
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_COUNT(name, value) do {} while (0)
+#endif
+
+/* size of a buffer that was just allocated, under the "bytes_allocated" counter */
+#define TRACE_BYTES(mat) TRACE_COUNT("bytes_allocated", (mat).total() * (mat).elemSize())
+
+#endif
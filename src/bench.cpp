@@ -0,0 +1,415 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <filesystem>
+#include <opencv2/opencv.hpp>
+#include <bench_harness.h>
+#include <fast_detector.h>
+#include <fastR_detector.h>
+#include <harris_corner_detector.h>
+#include <ransac.h>
+#include <coarse_alignment.h>
+#include <panorama_stitcher.h>
+#include <tiled_output.h>
+#include <incremental_stitcher.h>
+
+using namespace std;
+using namespace cv;
+
+/*
+Benchmarks of every stage of the pipeline and of whole stitches, on the images/S*-im*.png sets as they
+are and upscaled to 4, 12 and 48 megapixels (the S images are small, the real frames are not).
+
+  bench [--images DIR] [--sizes orig,4,12,48] [--sets S1,S2] [--filter NAME] [--min-time SEC]
+        [--min-iters N] [--threads N] [--json FILE]
+
+Stage benchmarks use the first two images of a set, with everything before the stage computed once
+outside the timing. Results are printed and written as JSON (bench_results.json by default).
+*/
+
+struct Dataset{
+    string name;   // e.g. "S2@12MP"
+    vector<Mat> images;
+    double megapixels = 0;
+};
+
+/* S1-im1.png, S1-im2.png, S2-im1.png... grouped by the part before "-im" */
+map<string, vector<Mat>> load_sets(const string &dir){
+    vector<String> paths;
+    glob(dir + "/S*-im*.png", paths, false);
+
+    map<string, vector<Mat>> sets;
+    for (const auto &p : paths){
+        string file = p.substr(p.find_last_of("/\\") + 1);
+        string set = file.substr(0, file.find("-im"));
+        Mat img = imread(p, IMREAD_COLOR);
+        if (img.empty()){
+            cerr << "can't read " << p << "\n";
+            continue;
+        }
+        sets[set].push_back(img);
+    }
+    return sets;
+}
+
+/* the set resized so every image has ~targetMP megapixels (0 = as it is) */
+Dataset make_dataset(const string &set, const vector<Mat> &images, double targetMP){
+    Dataset d;
+    d.name = set + (targetMP > 0 ? "@" + to_string((int)targetMP) + "MP" : "");
+    for (const auto &img : images){
+        if (targetMP <= 0){
+            d.images.push_back(img);
+            continue;
+        }
+        double f = std::sqrt(targetMP * 1e6 / (double(img.cols) * img.rows));
+        Mat big;
+        resize(img, big, Size(cvRound(img.cols * f), cvRound(img.rows * f)), 0, 0, INTER_CUBIC);
+        d.images.push_back(big);
+    }
+    d.megapixels = d.images[0].cols * double(d.images[0].rows) / 1e6;
+    return d;
+}
+
+/* mean distance between where H and reference put the corners of an image of that size (B -> A) */
+double corner_error(const Mat &H, const Mat &reference, Size size){
+    vector<Point2f> corners = {{0, 0}, {float(size.width), 0}, {float(size.width), float(size.height)}, {0, float(size.height)}};
+    vector<Point2f> a, b;
+    perspectiveTransform(corners, a, H);
+    perspectiveTransform(corners, b, reference);
+    double e = 0;
+    for (int i = 0; i < 4; i++) e += norm(a[i] - b[i]);
+    return e / 4;
+}
+
+vector<string> split_list(const string &s){
+    vector<string> out;
+    stringstream ss(s);
+    string item;
+    while (getline(ss, item, ',')) if (!item.empty()) out.push_back(item);
+    return out;
+}
+
+int main(int argc, char **argv){
+    string dir = "../images", filter, jsonPath = "bench_results.json";
+    vector<string> sizes = {"orig", "4", "12", "48"}, sets;
+    BenchOptions O;
+
+    for (int i = 1; i < argc; i++){
+        string a = argv[i];
+        if (i + 1 >= argc && a != "-h" && a != "--help"){
+            cerr << "missing value for " << a << "\n";
+            return 2;
+        }
+        if (a == "-h" || a == "--help"){
+            cerr << "usage: bench [--images DIR] [--sizes orig,4,12,48] [--sets S1,S2] [--filter NAME]\n"
+                    "             [--min-time SEC] [--min-iters N] [--threads N] [--json FILE]\n";
+            return 0;
+        }
+        else if (a == "--images") dir = argv[++i];
+        else if (a == "--sizes") sizes = split_list(argv[++i]);
+        else if (a == "--sets") sets = split_list(argv[++i]);
+        else if (a == "--filter") filter = argv[++i];
+        else if (a == "--min-time") O.minSeconds = atof(argv[++i]);
+        else if (a == "--min-iters") O.minIters = std::max(1, atoi(argv[++i]));
+        else if (a == "--threads") setNumThreads(atoi(argv[++i]));
+        else if (a == "--json") jsonPath = argv[++i];
+        else { cerr << "unknown option " << a << "\n"; return 2; }
+    }
+
+    map<string, vector<Mat>> all = load_sets(dir);
+    if (all.empty()){
+        cerr << "no S*-im*.png images in " << dir << "\n";
+        return 1;
+    }
+
+    vector<BenchResult> results;
+    auto bench = [&](const string &name, const Dataset &d, auto fn) -> BenchResult * {
+        if (!filter.empty() && name.find(filter) == string::npos) return nullptr;
+        results.push_back(run_bench(name, d.name, d.megapixels, O, fn));
+        return &results.back();
+    };
+    auto report = [&](BenchResult *r){
+        if (r) cout << bench_line(*r) << endl;
+    };
+
+    for (const auto &set : all){
+        if (!sets.empty() && find(sets.begin(), sets.end(), set.first) == sets.end()) continue;
+        if (set.second.size() < 2) continue;
+
+        for (const auto &size : sizes){
+            Dataset d = make_dataset(set.first, set.second, size == "orig" ? 0 : atof(size.c_str()));
+            const Mat &A = d.images[0], &B = d.images[1];
+            RansacParameters P;
+
+            // inputs of the later stages, computed once
+            vector<KeyPoint> kA = my_fast_detector(A), kB = my_fast_detector(B);
+            Mat dA, dB;
+            siftDescriptorsAt(A, kA, dA);
+            siftDescriptorsAt(B, kB, dB);
+            vector<DMatch> good = knnRatioMatch(dA, dB, P.ratio, P.matcher);
+            vector<char> mask;
+            Mat H = good.size() >= 8 ? estimateHomographyRANSAC(kA, kB, good, P, mask) : Mat();
+
+            /* stages */
+            BenchResult *r = bench("fast_detect", d, [&]{ my_fast_detector(A); });
+            if (r) r->counters["keypoints"] = (double)kA.size();
+            report(r);
+
+            /* Harris and FASTR in fixed point (the default) and in float, and how far apart they end up */
+            report(bench("harris_response", d, [&]{ my_harris_corner_detector(A); }));
+            r = bench("harris_response_float", d, [&]{ my_harris_corner_detector(A, DETECT_BAND_ROWS, HARRIS_PRECISION::FLOAT); });
+            if (r) r->counters["max_diff_normalized"] = norm(my_harris_corner_detector(A),
+                                                             my_harris_corner_detector(A, DETECT_BAND_ROWS, HARRIS_PRECISION::FLOAT), NORM_INF);
+            report(r);
+
+            FastRParameters floatR;
+            floatR.harrisPrecision = HARRIS_PRECISION::FLOAT;
+            vector<KeyPoint> fixedKps = my_fastR_detector(A), floatKps = my_fastR_detector(A, floatR);
+            r = bench("fastR_detect", d, [&]{ my_fastR_detector(A); });
+            if (r) r->counters["keypoints"] = (double)fixedKps.size();
+            report(r);
+            r = bench("fastR_detect_float", d, [&]{ my_fastR_detector(A, floatR); });
+            if (r){
+                // both keep a subset of the same FAST keypoints, in the same order
+                size_t common = 0;
+                for (size_t i = 0, j = 0; i < fixedKps.size() && j < floatKps.size();){
+                    if (fixedKps[i].pt == floatKps[j].pt){ common++; i++; j++; }
+                    else if (keypoint_raster_less(fixedKps[i], floatKps[j])) i++;
+                    else j++;
+                }
+                r->counters["keypoints"] = (double)floatKps.size();
+                r->counters["common_with_fixed"] = (double)common;
+            }
+            report(r);
+
+            r = bench("sift_describe", d, [&]{
+                vector<KeyPoint> k = kA;
+                Mat desc;
+                siftDescriptorsAt(A, k, desc);
+            });
+            if (r) r->counters["keypoints"] = (double)kA.size();
+            report(r);
+
+            for (MATCHER backend : {MATCHER::BRUTE_FORCE, MATCHER::FLANN, MATCHER::BLOCKED}){
+                if (dA.empty() || dB.empty()) break;
+                MatcherParameters M;
+                M.backend = backend;
+                size_t count = 0;
+                r = bench(string("ratio_match_") + matcher_name(backend), d, [&]{ count = knnRatioMatch(dA, dB, P.ratio, M).size(); });
+                if (r){
+                    r->counters["queries"] = dA.rows;
+                    r->counters["train"] = dB.rows;
+                    r->counters["matches"] = (double)count;
+                }
+                report(r);
+            }
+
+            FeatureSet fA, fB;
+            from_keypoints(kA, fA);
+            from_keypoints(kB, fB);
+            fA.descriptors = dA;
+            fB.descriptors = dB;
+
+            if (!H.empty()){
+                // the pair's own homography as the prior: the best case of guided matching
+                vector<DMatch> guided;
+                long comparisons = 0;
+                r = bench("guided_match", d, [&]{
+                    guided_ratio_match_into(fA, fB, H, P.ratio, P.guided.radius, guided, frame_arena(), &comparisons);
+                });
+                if (r){
+                    r->counters["comparisons"] = (double)comparisons;
+                    r->counters["global_comparisons"] = (double)dA.rows * dB.rows;
+                    r->counters["matches"] = (double)guided.size();
+                }
+                report(r);
+            }
+
+            /* binary descriptors at the same keypoints: their cost, and the homography they give against SIFT's */
+            FeatureSet bA, bB;
+            from_keypoints(kA, bA);
+            from_keypoints(kB, bB);
+            brief_describe_into(A, bA, bA.descriptors);
+            brief_describe_into(B, bB, bB.descriptors);
+
+            r = bench("brief_describe", d, [&]{
+                Mat desc;
+                brief_describe_into(A, bA, desc);
+            });
+            if (r) r->counters["keypoints"] = (double)kA.size();
+            report(r);
+
+            for (MATCHER backend : {MATCHER::BRUTE_FORCE, MATCHER::BLOCKED}){
+                if (bA.empty() || bB.empty()) break;
+                MatcherParameters M;
+                M.backend = backend;
+                M.norm = NORM_HAMMING;
+                size_t count = 0;
+                r = bench(string("hamming_match_") + matcher_name(backend), d, [&]{
+                    count = ratio_match(bA.descriptors, bB.descriptors, P.ratio, M).size();
+                });
+                if (r){
+                    r->counters["queries"] = bA.count();
+                    r->counters["train"] = bB.count();
+                    r->counters["matches"] = (double)count;
+                }
+                report(r);
+            }
+
+            for (const FeatureSet *f : {&fA, &bA}){
+                const FeatureSet &g = f == &fA ? fB : bB;
+                if (f->descriptors.empty() || g.descriptors.empty()) continue;
+                vector<DMatch> m;
+                vector<char> inliers;
+                Mat Hd;
+                r = bench(f == &fA ? "pair_match_sift" : "pair_match_brief", d, [&]{
+                    Hd = matchAndEstimateHomography(*f, g, P, m, inliers);
+                });
+                if (r){
+                    int n = (int)count(inliers.begin(), inliers.end(), 1);
+                    r->counters["matches"] = (double)m.size();
+                    r->counters["inliers"] = n;
+                    r->counters["inlier_ratio"] = m.empty() ? 0.0 : double(n) / m.size();
+                    if (!Hd.empty() && !H.empty()) r->counters["corner_error_px"] = corner_error(Hd, H, B.size());
+                }
+                report(r);
+            }
+
+            if (good.size() >= 8){
+                for (bool builtin : {true, false}){
+                    RansacParameters R = P;
+                    R.builtin = builtin;
+                    RansacReport rr;
+                    r = bench(builtin ? "ransac_builtin" : "ransac_opencv", d, [&]{
+                        vector<char> m;
+                        estimateHomographyRANSAC(kA, kB, good, R, m, &rr);
+                    });
+                    if (r){
+                        r->counters["matches"] = (double)good.size();
+                        if (builtin){
+                            r->counters["iterations"] = rr.iterations;
+                            r->counters["inliers"] = rr.inliers;
+                        }
+                    }
+                    report(r);
+                }
+            }
+
+            if (!H.empty()){
+                Mat pano;
+                r = bench("warp_blend_max", d, [&]{ pano = warpAndBlendPanorama(A, B, H); });
+                if (r) r->counters["canvas_mp"] = pano.total() / 1e6;
+                report(r);
+            }
+
+            /* blending of the whole set (transforms from one stitch) */
+            PanoramaStitcher stitcher;
+            Mat stitched = stitcher.stitch(d.images);
+            if (!stitched.empty()){
+                for (BLEND mode : {BLEND::FEATHER, BLEND::MULTIBAND}){
+                    BlendParameters bp;
+                    bp.mode = mode;
+                    Ptr<Blender> blender = create_blender(bp);
+                    r = bench(mode == BLEND::FEATHER ? "blend_feather" : "blend_multiband", d, [&]{
+                        blender->blend(d.images, stitcher.transforms(), stitcher.canvasSize());
+                    });
+                    if (r){
+                        r->counters["canvas_mp"] = stitcher.canvasSize().area() / 1e6;
+                        // the tiles against one tile as big as the canvas: 0 when the halo is wide enough
+                        if (mode == BLEND::MULTIBAND){
+                            BlendParameters whole = bp;
+                            whole.tileSize = std::max(stitcher.canvasSize().width, stitcher.canvasSize().height);
+                            Mat tiled = blender->blend(d.images, stitcher.transforms(), stitcher.canvasSize());
+                            Mat single = create_blender(whole)->blend(d.images, stitcher.transforms(), stitcher.canvasSize());
+                            r->counters["max_diff_vs_one_tile"] = norm(tiled, single, NORM_INF);
+                        }
+                    }
+                    report(r);
+                }
+
+                /* the max blend written to disk tile by tile instead of into a canvas */
+                for (string ext : {"tif", "dzi"}){
+                    string path = tempfile(("." + ext).c_str());
+                    Ptr<Blender> blender = create_blender();
+                    r = bench(ext == "tif" ? "tiled_output_bigtiff" : "tiled_output_deepzoom", d, [&]{
+                        Ptr<TileSink> sink = open_tile_sink(path);
+                        blender->blend_to(d.images, stitcher.transforms(), stitcher.canvasSize(), *sink);
+                    });
+                    if (r){
+                        r->counters["canvas_mp"] = stitcher.canvasSize().area() / 1e6;
+                        if (ext == "tif") r->counters["file_mb"] = filesystem::file_size(path) / 1e6;
+                    }
+                    report(r);
+                    std::error_code ec;
+                    filesystem::remove(path, ec);
+                    filesystem::remove_all(path.substr(0, path.size() - 4) + "_files", ec);
+                }
+            }
+
+            /* end to end */
+            report(bench("pair_fast", d, [&]{ panorama_FAST(A, B, P); }));
+            if (d.megapixels > 2.5)
+                report(bench("pair_fast_pyramid", d, [&]{ panorama_FAST_pyramid(A, B, P); }));
+
+            r = bench("sequence_stitch", d, [&]{
+                PanoramaStitcher s;
+                s.stitch(d.images);
+            });
+            if (r) r->counters["images"] = (double)d.images.size();
+            report(r);
+
+            r = bench("sequence_stitch_brief", d, [&]{
+                StitcherParameters SP;
+                SP.features.descriptor = DESCRIPTOR::BRIEF;
+                PanoramaStitcher s(SP);
+                s.stitch(d.images);
+            });
+            if (r) r->counters["images"] = (double)d.images.size();
+            report(r);
+
+            /* live stitching: every image of the set added one by one, then the preview after a new frame */
+            IncrementalFrameReport last;
+            int added = 0, keyframes = 0;
+            size_t tiles = 0;
+            r = bench("incremental_stitch", d, [&]{
+                IncrementalStitcher s;
+                for (const Mat &img : d.images) s.addFrame(img, &last);
+                added = s.frames();
+                keyframes = s.keyframeCount();
+                tiles = s.tileCount();
+            });
+            if (r){
+                r->counters["images"] = (double)d.images.size();
+                r->counters["added"] = added;
+                r->counters["keyframes"] = keyframes;
+                r->counters["tiles"] = (double)tiles;
+                r->counters["last_frame_ms"] = last.millis;
+            }
+            report(r);
+
+            IncrementalStitcher live;
+            for (const Mat &img : d.images) live.addFrame(img);
+            if (live.frames() > 1){
+                live.preview();
+                r = bench("incremental_preview", d, [&]{
+                    live.addFrame(d.images.back());
+                    live.preview();
+                });
+                if (r) r->counters["tiles"] = (double)live.tileCount();
+                report(r);
+            }
+        }
+    }
+
+    ofstream json(jsonPath);
+    if (!json){
+        cerr << "can't write " << jsonPath << "\n";
+        return 1;
+    }
+    json << bench_json(results);
+    cerr << results.size() << " results written to " << jsonPath << "\n";
+    return 0;
+}
@@ -6,6 +6,9 @@
 #include <fastR_detector.h>
 #include <sift_matcher.h>
 #include <ransac.h>
+#include <panorama_stitcher.h>
+#include <incremental_stitcher.h>
+#include <image_ingest.h>
 
 using namespace std;
 using namespace cv;
@@ -34,16 +37,18 @@ int main(){
     
 
     /* Step 1: Showing all the images */
-    // Image imports
+    // Image imports: mapped + decoded into pooled buffers, with the gray made once (see image_ingest.h)
+    vector<IngestedImage> frames;
     vector<Mat> images;
     images.reserve(paths.size()); //Creates empty spaces
     for(int i = 0; i < paths.size(); i++){
-        Mat img = imread(paths[i], IMREAD_COLOR);
+        IngestedImage img = ingest_image(paths[i]);
         if (img.empty()){
             cerr << "Failed to read path number: " << i << endl; 
             continue;
         }
-        images.push_back(img);
+        images.push_back(img.color);
+        frames.push_back(img);
 
         
     }
@@ -52,8 +57,8 @@ int main(){
         
         /* Step 2: FAST feature detector */
         /* since the function is already created in "own_functions.h" just call it*/
-        vector<KeyPoint> fast_kps = my_fast_detector(images[i]);
-        vector<KeyPoint> fastR_kps = my_fastR_detector(images[i]);
+        vector<KeyPoint> fast_kps = my_fast_detector(frames[i].gray);
+        vector<KeyPoint> fastR_kps = my_fastR_detector(frames[i].gray);
         
 
         // Now to overlay it, we can simply use the function:
@@ -92,25 +97,25 @@ int main(){
 
     /* Step 2: SIFT Matcher*/
     //With Fast only
-    vector<KeyPoint> kps1 = my_fast_detector(images[0]);
-    vector<KeyPoint> kps2 = my_fast_detector(images[1]);
+    vector<KeyPoint> kps1 = my_fast_detector(frames[0].gray);
+    vector<KeyPoint> kps2 = my_fast_detector(frames[1].gray);
     SIFT_matcher(images[0], images[1], kps1, kps2, "matching FAST ");
     
     //With FASTR
-    vector<KeyPoint> Fkps1 = my_fastR_detector(images[0]);
-    vector<KeyPoint> Fkps2 = my_fastR_detector(images[1]);
+    vector<KeyPoint> Fkps1 = my_fastR_detector(frames[0].gray);
+    vector<KeyPoint> Fkps2 = my_fastR_detector(frames[1].gray);
     SIFT_matcher(images[0], images[1], Fkps1, Fkps2, "matching FASTR");
 
     
     
     //With Fast only
-    kps1 = my_fast_detector(images[10]);
-    kps2 = my_fast_detector(images[11]);
+    kps1 = my_fast_detector(frames[10].gray);
+    kps2 = my_fast_detector(frames[11].gray);
     SIFT_matcher(images[10], images[11], kps1, kps2, "matching FAST ");
     
     //With FASTR
-    Fkps1 = my_fastR_detector(images[10]);
-    Fkps2 = my_fastR_detector(images[11]);
+    Fkps1 = my_fastR_detector(frames[10].gray);
+    Fkps2 = my_fastR_detector(frames[11].gray);
     SIFT_matcher(images[10], images[11], Fkps1, Fkps2, "matching FASTR");
 
     
@@ -130,13 +135,36 @@ int main(){
         imshow("Panorama FASTR", panoFastR);
     waitKey(0);
 
-    panoFast = panorama_FAST(images[3], images[4], P);
-    Mat panoFast2 = panorama_FAST(panoFast, images[5], P);
-    panoFast = panorama_FAST(panoFast2, images[6], P);
+    // chain of 4 images, every image is detected and described once (see feature_store.h)
+    FeatureStore store;
+    panoFast = panorama_chain(images, {3, 4, 5, 6}, store, P);
 
     if (!panoFast.empty())  
         imshow("Panorama FAST",  panoFast);
 
+    // same 4 images, all at once: pairwise homographies, one warp per image (see panorama_stitcher.h)
+    StitcherParameters SP;
+    SP.ransac = P;
+    SP.blend.mode = BLEND::MULTIBAND; // no seams between the images
+    PanoramaStitcher stitcher(SP);
+    Mat panoGlobal = stitcher.stitch({images[3], images[4], images[5], images[6]});
+    if (!panoGlobal.empty())
+        imshow("Panorama FAST (global)", panoGlobal);
+    waitKey(0);
+
+    // same 4 images as if they came from a camera: each one is matched against the last keyframes only
+    // and warped into the tiles it touches, the preview is updated after every frame (see incremental_stitcher.h)
+    IncrementalParameters IP;
+    IP.ransac = P;
+    IP.ransac.guided.enabled = true;
+    IncrementalStitcher live(IP);
+    for (int i = 3; i <= 6; i++){
+        if (!live.addFrame(images[i]))
+            cerr << "Frame " << i << " could not be placed" << endl;
+        imshow("Live preview", live.preview(0.5));
+        waitKey(0);
+    }
+
 
     return 0;
 }
\ No newline at end of file
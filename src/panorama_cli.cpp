@@ -0,0 +1,157 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <batch_jobs.h>
+
+using namespace std;
+using namespace cv;
+
+/*
+Headless panorama tool: no windows, no waiting for keys, so it runs on a server and it can be timed.
+
+  panorama [options] <manifest.json | manifest.csv>
+  panorama [options] -o <output> <image1> <image2> [...]
+
+Every finished job prints a record (JSON lines, or CSV with --report file.csv) with its status and timings.
+*/
+
+void usage(){
+    cerr << "usage: panorama [options] <manifest.json|manifest.csv>\n"
+            "       panorama [options] -o <output> <image1> <image2> [...]\n"
+            "options:\n"
+            "  -j, --jobs N          panoramas stitched at the same time (default 1)\n"
+            "  -o, --output FILE     output of the single job given on the command line\n"
+            "                        (.tif / .tiff: tiled BigTIFF, .dzi: DeepZoom pyramid, both written tile by tile)\n"
+            "  --tile-size N         tile side of the .tif / .dzi outputs (default 256)\n"
+            "  --report FILE         write the job records there (.csv = CSV, otherwise JSON lines), default stdout\n"
+            "  --detector fast|fastr default detector (default fast)\n"
+            "  --descriptor sift|brief   default descriptor (default sift; brief is binary, much faster, less distinctive)\n"
+            "  --blend max|feather|multiband   default blending (default max)\n"
+            "  --max-keypoints N     strongest keypoints kept per image, spread over an 8x6 grid (default 2000, 0 = all)\n"
+            "  --proxy-mp X          align on a pyramid level of at most X megapixels (default: full resolution)\n"
+            "  --guided              match around a homography from a sparse pass of the strongest keypoints\n"
+            "  --pool-mb N           spare decode buffers kept for the next images, in MB (default 256)\n"
+            "  --occupancy           print the per stage occupancy table of every job to stderr\n"
+            "  --trace FILE          write a Chrome trace (chrome://tracing, ui.perfetto.dev) of every stage and thread\n"
+            "  --profile             print time per stage and the counters (keypoints, matches, RANSAC...) to stderr\n"
+            "  --show                show every panorama at the end (needs a display)\n";
+}
+
+int main(int argc, char **argv){
+    StitcherParameters defaults;
+    int workers = 1;
+    TiledOutputParameters tiles;
+    string output, report, trace;
+    vector<string> inputs;
+    bool show = false, occupancy = false, profile = false;
+
+    for (int i = 1; i < argc; i++){
+        string a = argv[i];
+        auto value = [&]() -> string {
+            if (i + 1 >= argc){
+                cerr << "missing value for " << a << "\n";
+                exit(2);
+            }
+            return argv[++i];
+        };
+
+        if (a == "-h" || a == "--help"){ usage(); return 0; }
+        else if (a == "-j" || a == "--jobs") workers = std::max(1, atoi(value().c_str()));
+        else if (a == "-o" || a == "--output") output = value();
+        else if (a == "--report") report = value();
+        else if (a == "--tile-size") tiles.tileSize = std::max(16, atoi(value().c_str()));
+        else if (a == "--show") show = true;
+        else if (a == "--occupancy") occupancy = true;
+        else if (a == "--trace") trace = value();
+        else if (a == "--profile") profile = true;
+        else if (a == "--detector"){
+            string d = value();
+            if (!set_detector(defaults, d)){ cerr << "unknown detector " << d << "\n"; return 2; }
+        }
+        else if (a == "--descriptor"){
+            string d = value();
+            if (!set_descriptor(defaults, d)){ cerr << "unknown descriptor " << d << "\n"; return 2; }
+        }
+        else if (a == "--blend"){
+            string b = value();
+            if (!set_blend(defaults, b)){ cerr << "unknown blend " << b << "\n"; return 2; }
+        }
+        else if (a == "--max-keypoints") set_max_keypoints(defaults.features, atoi(value().c_str()));
+        else if (a == "--proxy-mp") defaults.features.maxProxyPixels = long(atof(value().c_str()) * 1e6);
+        else if (a == "--pool-mb") image_pool().setMaxBytes(size_t(std::max(0, atoi(value().c_str()))) << 20);
+        else if (a == "--guided") defaults.ransac.guided.enabled = true;
+        else if (!a.empty() && a[0] == '-'){ cerr << "unknown option " << a << "\n"; usage(); return 2; }
+        else inputs.push_back(a);
+    }
+
+    vector<PanoramaJob> jobs;
+    try {
+        if (output.empty()){
+            if (inputs.size() != 1){ usage(); return 2; }
+            jobs = load_manifest(inputs[0], defaults);
+        }
+        else {
+            PanoramaJob job;
+            job.id = "cli";
+            job.inputs = inputs;
+            job.output = output;
+            job.params = defaults;
+            jobs.push_back(job);
+        }
+    }
+    catch (const std::exception &e){
+        cerr << e.what() << "\n";
+        return 2;
+    }
+    for (auto &job : jobs) job.tiles = tiles;
+
+    // records as the jobs finish, so a long batch can be followed (and killed) without losing them
+    bool csv = report.size() >= 4 && report.substr(report.size() - 4) == ".csv";
+    ofstream reportFile;
+    if (!report.empty()){
+        reportFile.open(report);
+        if (!reportFile){ cerr << "can't write " << report << "\n"; return 2; }
+        if (csv) reportFile << RECORD_CSV_HEADER << "\n";
+    }
+    ostream &out = report.empty() ? cout : reportFile;
+    mutex outMutex;
+
+    if (!trace.empty() || profile){
+        if (!PANO_TRACE) cerr << "built without tracing (PANORAMA_TRACE=OFF), --trace / --profile record nothing\n";
+        Tracer::instance().start();
+    }
+
+    int64 start = getTickCount();
+    vector<JobRecord> records = run_jobs(jobs, workers, [&](const JobRecord &r){
+        lock_guard<mutex> lock(outMutex);
+        out << (csv ? record_csv(r) : record_json(r)) << endl;
+        if (occupancy) cerr << r.id << "\n" << r.pipeline.table();
+    });
+
+    int failed = 0;
+    for (const auto &r : records) failed += !r.ok;
+    cerr << records.size() - failed << "/" << records.size() << " panoramas in "
+         << millis_since(start) / 1000.0 << " s (" << workers << " workers)\n";
+
+    Tracer::instance().stop();
+    if (profile) cerr << Tracer::instance().summary();
+    if (!trace.empty()){
+        ofstream traceFile(trace);
+        if (traceFile) traceFile << Tracer::instance().chrome_json();
+        else cerr << "can't write " << trace << "\n";
+    }
+
+    if (show){
+        for (const auto &r : records){
+            if (!r.ok) continue;
+            if (open_tile_sink(r.output)) continue; // tiled outputs are meant for a tile viewer
+            imshow(r.id, imread(r.output, IMREAD_COLOR));
+        }
+        waitKey(0);
+        destroyAllWindows();
+    }
+    return failed ? 1 : 0;
+}